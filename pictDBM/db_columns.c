@@ -0,0 +1,125 @@
+/**
+ * @file db_columns.c
+ * @brief Columns of the metadata of an opened pictDB, for the scans.
+ *
+ * A struct pict_metadata is mostly its picture id: a scan reading only
+ * is_valid, the id or the SHA of every metadata loads a cache line (or a
+ * page of the mapping) for a few bytes. The columns copy what the scans
+ * and the probes of the indexes compare, one array per field: a bitmap of
+ * the valid metadata, 32 bits of the hash of each id and the first 32 bits
+ * of each SHA, about 8 bytes per metadata. The metadata itself is only
+ * read for the pictures found (and for their contents, when the free
+ * extents are found), and written.
+ *
+ * They are built on first use, like the indexes, and kept up to date by
+ * write_metadata: a change is seen by the scans once its metadata is
+ * marked as to be written.
+ *
+ * @date 16 October 2026
+ */
+
+#include "pictDB.h"
+#include "db_columns.h"
+#include "db_index.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+* @brief Copy the metadata into the columns (allocated again).
+* @param db_file Pointer to a pictdb_file structure with its metadata loaded.
+* @return 0 if no error occurs, otherwise an error.
+*/
+int columns_build(struct pictdb_file* db_file)
+{
+    if(db_file == NULL || db_file->metadata == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    columns_free(db_file);
+    struct pict_columns* columns = &db_file->columns;
+    size_t count = db_file->header.max_files;
+    //One more word, so that an empty database has columns too
+    columns->valid = calloc((count + 63) / 64 + 1, sizeof(uint64_t));
+    columns->id_hash = malloc(count * sizeof(uint32_t) + 1);
+    columns->sha_prefix = malloc(count * sizeof(uint32_t) + 1);
+    if(columns->valid == NULL || columns->id_hash == NULL || columns->sha_prefix == NULL) {
+        columns_free(db_file);
+        return ERR_OUT_OF_MEMORY;
+    }
+    columns->count = db_file->header.max_files;
+    columns_update(db_file, 0, count);
+    return 0;
+}
+
+/**
+* @brief Build the columns if it was not done yet.
+* @param db_file Pointer to a pictdb_file structure with its metadata loaded.
+* @return 0 if the columns are available, otherwise an error.
+*/
+int columns_ensure(struct pictdb_file* db_file)
+{
+    if(db_file->columns.valid != NULL) {
+        return 0;
+    }
+    return columns_build(db_file);
+}
+
+/**
+* @brief Copy consecutive metadata into the columns again.
+* @param db_file Pointer to a pictdb_file structure.
+* @param first Position of the first metadata.
+* @param count Number of metadata.
+*/
+void columns_update(struct pictdb_file* db_file, size_t first, size_t count)
+{
+    struct pict_columns* columns = &db_file->columns;
+    if(columns->valid == NULL) {
+        return;
+    }
+    for(size_t i = first; i < first + count && i < columns->count; i++) {
+        const struct pict_metadata* metadata = &db_file->metadata[i];
+        uint64_t bit = UINT64_C(1) << (i % 64);
+        if(metadata->is_valid == NON_EMPTY) {
+            columns->valid[i / 64] |= bit;
+            columns->id_hash[i] = (uint32_t)index_hash_id(metadata->pict_id);
+        } else {
+            columns->valid[i / 64] &= ~bit;
+            columns->id_hash[i] = 0;
+        }
+        memcpy(&columns->sha_prefix[i], metadata->SHA, sizeof(uint32_t));
+    }
+}
+
+/**
+* @brief Free the memory used by the columns.
+* @param db_file Pointer to a pictdb_file structure.
+*/
+void columns_free(struct pictdb_file* db_file)
+{
+    if(db_file != NULL) {
+        struct pict_columns* columns = &db_file->columns;
+        free(columns->valid);
+        free(columns->id_hash);
+        free(columns->sha_prefix);
+        memset(columns, 0, sizeof(struct pict_columns));
+    }
+}
+
+/**
+* @brief Next valid metadata, from the built columns.
+* @param columns The columns.
+* @param index Position from which to look.
+* @return The position of the first valid metadata from index on, or
+* columns->count if there is none.
+*/
+uint32_t column_next_valid(const struct pict_columns* columns, uint32_t index)
+{
+    while(index < columns->count) {
+        uint64_t word = columns->valid[index / 64] >> (index % 64);
+        if(word != 0) {
+            index += (uint32_t)__builtin_ctzll(word);
+            return index < columns->count ? index : columns->count;
+        }
+        index = (index / 64 + 1) * 64;
+    }
+    return columns->count;
+}
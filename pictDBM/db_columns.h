@@ -0,0 +1,58 @@
+/**
+ * @file db_columns.h
+ * @brief Columns of the metadata of an opened pictDB, for the scans.
+ *
+ * @date 16 October 2026
+ */
+#ifndef DB_COLUMNS_H
+#define DB_COLUMNS_H
+
+#include "pictDB.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+* @brief Copy the metadata into the columns (allocated again).
+* @param db_file Pointer to a pictdb_file structure with its metadata loaded.
+* @return 0 if no error occurs, otherwise an error.
+*/
+int columns_build(struct pictdb_file* db_file);
+
+/**
+* @brief Build the columns if it was not done yet.
+* @param db_file Pointer to a pictdb_file structure with its metadata loaded.
+* @return 0 if the columns are available, otherwise an error.
+*/
+int columns_ensure(struct pictdb_file* db_file);
+
+/**
+* @brief Copy consecutive metadata into the columns again, after they
+* changed (nothing is done if the columns are not built). write_metadata
+* calls it.
+* @param db_file Pointer to a pictdb_file structure.
+* @param first Position of the first metadata.
+* @param count Number of metadata.
+*/
+void columns_update(struct pictdb_file* db_file, size_t first, size_t count);
+
+/**
+* @brief Free the memory used by the columns.
+* @param db_file Pointer to a pictdb_file structure.
+*/
+void columns_free(struct pictdb_file* db_file);
+
+/**
+* @brief Next valid metadata, from the built columns.
+* @param columns The columns.
+* @param index Position from which to look.
+* @return The position of the first valid metadata from index on, or
+* columns->count if there is none.
+*/
+uint32_t column_next_valid(const struct pict_columns* columns, uint32_t index);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -0,0 +1,475 @@
+/**
+ * @file db_compact.c
+ * @brief In-place compaction of a pictDB.
+ *
+ * Unlike do_gbcollect, no second file is needed: the contents still
+ * referred to are slid towards the beginning of the data, in offset order,
+ * and the file is truncated after the last one. Consecutive contents are
+ * moved together (a run, at most COMPACT_RUN bytes unless a single content
+ * is larger).
+ *
+ * Before a run is moved, "<database>.compact" records where it goes and
+ * the new offsets of the metadata, and the bytes themselves when the new
+ * position overlaps the old one, and is synced. If the compaction is
+ * interrupted, do_open writes the run again (from the recorded bytes or
+ * from its old position, which is still intact) and applies the new
+ * offsets: both are idempotent, and a run whose new offsets are already
+ * in the metadata is not written again (its bytes are synced before its
+ * metadata is written). The progress file is emptied
+ * before the file is truncated. The database is consistent after every
+ * run, so an interrupted compaction only has to be started again.
+ *
+ * @date 16 October 2026
+ */
+
+#define _POSIX_C_SOURCE 200809L // for pread, pwrite, fdatasync, ftruncate
+
+#include "pictDB.h"
+#include "db_compact.h"
+#include "db_extent.h"
+#include "db_segment.h"
+#include "db_record.h"
+#include <stddef.h> // for offsetof
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define COMPACT_MAGIC  0x54504D43u        // "CMPT"
+#define COMPACT_RUN    (64 * 1024 * 1024) // bytes moved at once
+#define COMPACT_BUFFER (1024 * 1024)      // bytes copied at once
+
+/**
+* @brief Beginning of "<database>.compact", followed by nb_updates
+* compact_update and, if staged is 1, the length bytes of the run.
+*/
+struct compact_record {
+    uint32_t magic;
+    uint32_t nb_updates;
+    uint64_t src;      // old position of the run
+    uint64_t dst;      // new position of the run
+    uint64_t length;
+    uint32_t staged;
+    uint32_t checksum; // of the fields above and everything which follows
+};
+
+/**
+* @brief New offset of one resolution of one metadata.
+*/
+struct compact_update {
+    uint32_t index;
+    uint32_t res;
+    uint64_t offset;
+};
+
+/**
+* @brief A content to move, or a run of consecutive ones.
+*/
+struct live_range {
+    uint64_t offset;
+    uint64_t size;
+};
+
+/**
+* @brief FNV-1a hash, continued from a previous value.
+*/
+static uint32_t fnv1a(uint32_t hash, const void* bytes, size_t len)
+{
+    const unsigned char* p = bytes;
+    for(size_t i = 0; i < len; i++) {
+        hash = (hash ^ p[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+* @brief Write a whole buffer at a given position of a file.
+*/
+static int pwrite_all(int fd, const void* buf, size_t len, uint64_t offset)
+{
+    const char* src = buf;
+    while(len > 0) {
+        ssize_t n = pwrite(fd, src, len, (off_t)offset);
+        if(n <= 0) {
+            return ERR_IO;
+        }
+        src += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/**
+* @brief Read a whole buffer at a given position of a file.
+*/
+static int pread_all(int fd, void* buf, size_t len, uint64_t offset)
+{
+    char* dst = buf;
+    while(len > 0) {
+        ssize_t n = pread(fd, dst, len, (off_t)offset);
+        if(n <= 0) {
+            return ERR_IO;
+        }
+        dst += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/**
+* @brief Copy bytes between two files (or towards the beginning of the same
+* file), from the first byte to the last: every chunk is read before it is
+* written, so overlapping ranges are copied right as long as dst <= src.
+* The hash of the bytes is updated if hash is not NULL.
+*/
+static int copy_bytes(int from, uint64_t src, int to, uint64_t dst, uint64_t len, char* buffer, uint32_t* hash)
+{
+    int check = 0;
+    while(len > 0 && check == 0) {
+        size_t n = len < COMPACT_BUFFER ? len : COMPACT_BUFFER;
+        check = pread_all(from, buffer, n, src);
+        if(check == 0) {
+            check = pwrite_all(to, buffer, n, dst);
+        }
+        if(hash != NULL) {
+            *hash = fnv1a(*hash, buffer, n);
+        }
+        src += n;
+        dst += n;
+        len -= n;
+    }
+    return check;
+}
+
+/**
+* @brief Name of the progress file of a database (to be freed).
+*/
+static char* compact_name(const char* file_name)
+{
+    size_t len = strlen(file_name);
+    char* name = malloc(len + sizeof(".compact"));
+    if(name != NULL) {
+        memcpy(name, file_name, len);
+        memcpy(name + len, ".compact", sizeof(".compact"));
+    }
+    return name;
+}
+
+/**
+ * @brief Finish the move an interrupted compaction was doing.
+ *
+ * @param file_name Name of the database file.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int compact_recover(const char* file_name)
+{
+    char* name = compact_name(file_name);
+    if(name == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    int progress = open(name, O_RDONLY);
+    if(progress == -1) {
+        free(name);
+        return 0;
+    }
+    int fd = open(file_name, O_RDWR);
+    struct compact_record record;
+    struct compact_update* updates = NULL;
+    char* buffer = malloc(COMPACT_BUFFER);
+    int check = (fd == -1) ? ERR_IO : (buffer == NULL ? ERR_OUT_OF_MEMORY : 0);
+
+    //A record torn by the crash was not synced: nothing was moved yet
+    int valid = check == 0 && pread_all(progress, &record, sizeof(record), 0) == 0
+                && record.magic == COMPACT_MAGIC && record.nb_updates <= MAX_MAX_FILES * NB_RES;
+    if(valid) {
+        updates = malloc(record.nb_updates * sizeof(struct compact_update) + 1);
+        valid = updates != NULL
+                && pread_all(progress, updates, record.nb_updates * sizeof(struct compact_update), sizeof(record)) == 0;
+    }
+    if(valid) {
+        uint32_t hash = fnv1a(2166136261u, &record, offsetof(struct compact_record, checksum));
+        hash = fnv1a(hash, updates, record.nb_updates * sizeof(struct compact_update));
+        uint64_t position = sizeof(record) + record.nb_updates * sizeof(struct compact_update);
+        for(uint64_t left = record.staged ? record.length : 0; valid && left > 0;) {
+            size_t n = left < COMPACT_BUFFER ? left : COMPACT_BUFFER;
+            valid = pread_all(progress, buffer, n, position) == 0;
+            hash = fnv1a(hash, buffer, n);
+            position += n;
+            left -= n;
+        }
+        valid = valid && hash == record.checksum;
+    }
+
+    struct pictdb_header header;
+    if(valid) {
+        check = pread_all(fd, &header, sizeof(header), 0);
+    }
+    //Done if the metadata already refers to the new position: the old one
+    //may have been overwritten by the next run, or truncated
+    int applied = 1;
+    for(uint32_t i = 0; valid && check == 0 && applied && i < record.nb_updates; i++) {
+        uint64_t offset = 0;
+        if(updates[i].res < NB_RES) {
+            check = pread_all(fd, &offset, sizeof(uint64_t),
+                              offset_position(&header, updates[i].index, updates[i].res));
+            applied = offset == updates[i].offset;
+        }
+    }
+    if(valid && check == 0 && !applied) {
+        //The run, then the metadata referring to it
+        check = record.staged
+                ? copy_bytes(progress, sizeof(record) + record.nb_updates * sizeof(struct compact_update),
+                             fd, record.dst, record.length, buffer, NULL)
+                : copy_bytes(fd, record.src, fd, record.dst, record.length, buffer, NULL);
+        for(uint32_t i = 0; check == 0 && i < record.nb_updates; i++) {
+            if(updates[i].res < NB_RES) {
+                check = pwrite_all(fd, &updates[i].offset, sizeof(uint64_t),
+                                   offset_position(&header, updates[i].index, updates[i].res));
+            }
+        }
+        if(check == 0 && fdatasync(fd) != 0) {
+            check = ERR_IO;
+        }
+    }
+    if(check == 0) {
+        unlink(name);
+    }
+
+    free(updates);
+    free(buffer);
+    if(fd != -1) {
+        close(fd);
+    }
+    close(progress);
+    free(name);
+    return check;
+}
+
+/**
+* @brief Compare two ranges by offset, for qsort.
+*/
+static int compare_ranges(const void* a, const void* b)
+{
+    const struct live_range* x = a;
+    const struct live_range* y = b;
+    return x->offset < y->offset ? -1 : (x->offset > y->offset ? 1 : 0);
+}
+
+/**
+* @brief The contents referred to by the valid metadata, each once, sorted.
+*/
+static int live_ranges(const struct pictdb_file* db_file, struct live_range** ranges, size_t* nb_ranges)
+{
+    size_t allocated = 16;
+    size_t nb = 0;
+    struct live_range* list = malloc(allocated * sizeof(struct live_range));
+    if(list == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    for(uint32_t i = 0; i < db_file->header.max_files; i++) {
+        const struct pict_metadata* metadata = &db_file->metadata[i];
+        for(size_t res = 0; metadata->is_valid == NON_EMPTY && res < NB_RES; res++) {
+            if(metadata->offset[res] == 0) {
+                continue;
+            }
+            if(nb == allocated) {
+                struct live_range* grown = realloc(list, 2 * allocated * sizeof(struct live_range));
+                if(grown == NULL) {
+                    free(list);
+                    return ERR_OUT_OF_MEMORY;
+                }
+                list = grown;
+                allocated *= 2;
+            }
+            list[nb].offset = metadata->offset[res];
+            list[nb].size = metadata->size[res];
+            nb += 1;
+        }
+    }
+    qsort(list, nb, sizeof(struct live_range), compare_ranges);
+    *ranges = list;
+    *nb_ranges = nb;
+    return 0;
+}
+
+/**
+* @brief Move a run of contents towards the beginning of the file: the
+* move is recorded and synced, done and synced, and the metadata updated
+* and synced.
+*/
+static int move_run(struct pictdb_file* db_file, int progress, uint64_t src, uint64_t dst, uint64_t length,
+                    char* buffer)
+{
+    //The new offsets of every metadata referring to the run
+    size_t nb_updates = 0;
+    size_t allocated = 16;
+    struct compact_update* updates = malloc(allocated * sizeof(struct compact_update));
+    if(updates == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    for(uint32_t i = 0; i < db_file->header.max_files; i++) {
+        const struct pict_metadata* metadata = &db_file->metadata[i];
+        for(uint32_t res = 0; metadata->is_valid == NON_EMPTY && res < NB_RES; res++) {
+            if(metadata->offset[res] < src || metadata->offset[res] >= src + length) {
+                continue;
+            }
+            if(nb_updates == allocated) {
+                struct compact_update* grown = realloc(updates, 2 * allocated * sizeof(struct compact_update));
+                if(grown == NULL) {
+                    free(updates);
+                    return ERR_OUT_OF_MEMORY;
+                }
+                updates = grown;
+                allocated *= 2;
+            }
+            updates[nb_updates].index = i;
+            updates[nb_updates].res = res;
+            updates[nb_updates].offset = metadata->offset[res] - (src - dst);
+            nb_updates += 1;
+        }
+    }
+
+    //The bytes are recorded only if the move overwrites them
+    struct compact_record record = {COMPACT_MAGIC, (uint32_t)nb_updates, src, dst, length, dst + length > src, 0};
+    uint32_t hash = fnv1a(2166136261u, &record, offsetof(struct compact_record, checksum));
+    hash = fnv1a(hash, updates, nb_updates * sizeof(struct compact_update));
+    uint64_t staged_at = sizeof(record) + nb_updates * sizeof(struct compact_update);
+    int check = 0;
+    if(ftruncate(progress, 0) != 0) {
+        check = ERR_IO;
+    }
+    if(check == 0) {
+        check = pwrite_all(progress, updates, nb_updates * sizeof(struct compact_update), sizeof(record));
+    }
+    if(check == 0 && record.staged) {
+        check = copy_bytes(db_file->fd, src, progress, staged_at, length, buffer, &hash);
+    }
+    record.checksum = hash;
+    if(check == 0) {
+        check = pwrite_all(progress, &record, sizeof(record), 0);
+    }
+    if(check == 0 && fdatasync(progress) != 0) {
+        check = ERR_IO;
+    }
+
+    //Then the move itself
+    if(check == 0) {
+        check = copy_bytes(db_file->fd, src, db_file->fd, dst, length, buffer, NULL);
+    }
+    //Recovery takes a run whose new offsets are on the disk for done
+    if(check == 0 && fdatasync(db_file->fd) != 0) {
+        check = ERR_IO;
+    }
+    for(size_t i = 0; check == 0 && i < nb_updates; i++) {
+        db_file->metadata[updates[i].index].offset[updates[i].res] = updates[i].offset;
+        check = write_metadata(db_file, updates[i].index);
+    }
+    if(check == 0) {
+        check = db_flush(db_file);
+    }
+    if(check == 0) {
+        check = db_sync_file(db_file);
+    }
+    free(updates);
+    return check;
+}
+
+/**
+ * @brief Compact a database in place: the contents are slid towards the
+ * beginning of the data and the file is truncated.
+ *
+ * @param db_file In memory structure with header and metadata.
+ * @param file_name Name of the database file.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int do_compact(struct pictdb_file* db_file, const char* file_name)
+{
+    if(db_file == NULL || file_name == NULL || db_file->fd < 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    //The segments are only appended to: their garbage goes with them
+    if(is_segmented(db_file)) {
+        return segments_gc(db_file);
+    }
+    //Everything pending is written first: only the moves are left to recover
+    int check = db_sync(db_file);
+    if(check != 0) {
+        return check;
+    }
+
+    struct live_range* ranges = NULL;
+    size_t nb_ranges = 0;
+    check = live_ranges(db_file, &ranges, &nb_ranges);
+    if(check != 0) {
+        return check;
+    }
+    char* name = compact_name(file_name);
+    char* buffer = malloc(COMPACT_BUFFER);
+    int progress = -1;
+    if(name == NULL || buffer == NULL) {
+        check = ERR_OUT_OF_MEMORY;
+    } else {
+        progress = open(name, O_RDWR | O_CREAT | O_TRUNC, 0666);
+        check = progress == -1 ? ERR_IO : 0;
+    }
+
+    uint64_t cursor = table_end(&db_file->header, db_file->header.max_files);
+    size_t first = 0;
+    while(check == 0 && first < nb_ranges) {
+        //A run: the contents which follow each other (or overlap)
+        uint64_t src = ranges[first].offset;
+        uint64_t end = src + ranges[first].size;
+        size_t next = first + 1;
+        while(next < nb_ranges && ranges[next].offset <= end
+              && (ranges[next].offset < end || end - src < COMPACT_RUN)) {
+            if(ranges[next].offset + ranges[next].size > end) {
+                end = ranges[next].offset + ranges[next].size;
+            }
+            next += 1;
+        }
+        if(src > cursor) {
+            check = move_run(db_file, progress, src, cursor, end - src, buffer);
+        }
+        cursor += end - src;
+        first = next;
+    }
+
+    //Every run is applied and synced: the last record must not be replayed
+    //once the file is truncated
+    if(check == 0 && (ftruncate(progress, 0) != 0 || fdatasync(progress) != 0)) {
+        check = ERR_IO;
+    }
+
+    //The tail only holds garbage now
+    if(check == 0) {
+        db_file->header.dead_bytes = 0;
+        check = write_header(db_file);
+    }
+    if(check == 0) {
+        check = db_flush(db_file);
+    }
+    if(check == 0 && cursor < db_file->file_size) {
+        if(ftruncate(db_file->fd, (off_t)cursor) != 0) {
+            check = ERR_IO;
+        } else {
+            db_file->file_size = cursor;
+            check = db_sync_file(db_file);
+        }
+    }
+    if(progress != -1) {
+        close(progress);
+        if(check == 0) {
+            unlink(name);
+        }
+    }
+    //The free extents and references are found again from the new offsets
+    extent_free_all(db_file);
+    free(ranges);
+    free(buffer);
+    free(name);
+    return check;
+}
@@ -0,0 +1,30 @@
+/**
+ * @file db_compact.h
+ * @brief In-place compaction of a pictDB.
+ *
+ * @date 16 October 2026
+ */
+#ifndef DB_COMPACT_H
+#define DB_COMPACT_H
+
+#include "pictDB.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Finish the move a compaction was doing when it was interrupted:
+ * the contents are written at their new position again and the metadata
+ * is made to refer to them. Nothing is done if no compaction was running.
+ *
+ * @param file_name Name of the database file.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int compact_recover(const char* file_name);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -6,50 +6,99 @@
  * @date 2 Nov 2015
  */
 
+#define _POSIX_C_SOURCE 200809L // for open
+
 #include "pictDB.h"
+#include "db_journal.h"
+#include "db_segment.h"
+#include "db_extent.h"
+#include "db_record.h"
 #include <string.h> // for strncpy
 #include <stdlib.h>
+#include <fcntl.h> // for open
+#include <unistd.h> // for unlink
+#include <sys/mman.h> // for mmap
 
 
 /********************************************************************//**
- * Creates the database called db_filename. Writes the header and the
- * preallocated empty metadata array to database file.
+ * Creates the database called db_filename. Writes the header; the empty
+ * metadata array is a sparse range of the file, mapped in memory, so that
+ * neither the disk nor the memory is used before the metadata is (compact
+ * records are not mapped, the metadata is allocated instead).
  */
 int do_create(const char* file_name, struct pictdb_file* db_file)
 {
-    size_t number_header = 0;
-    size_t number_metadata = 0;
     // Sets the DB header name
     strncpy(db_file->header.db_name, CAT_TXT,  MAX_DB_NAME);
     db_file->header.db_name[MAX_DB_NAME] = '\0';
     //Initialisation
     db_file->header.db_version = 0;
     db_file->header.num_files = 0;
+    //Only the options chosen by the caller are kept
+    db_file->header.flags = HEADER_MAGIC | (db_file->header.flags & (FLAG_VARIANTS | FLAG_SEGMENTED | FLAG_COMPACT | FLAG_SEGMENT_SIZE));
+    db_file->header.dead_bytes = 0;
 
-    //Memory allocation
-    db_file->metadata = calloc(db_file->header.max_files, sizeof(struct pict_metadata));
-    if(db_file->metadata == NULL) {
-        return ERR_OUT_OF_MEMORY;
-    }
+    db_file->fd = -1;
+    db_file->map = NULL;
+    db_file->map_size = 0;
+    db_file->index.id_table = NULL;
+    db_file->index.sha_table = NULL;
+    db_file->index.free_slots = NULL;
+    memset(&db_file->columns, 0, sizeof(db_file->columns));
+    init_write_back(db_file);
+    db_file->journal.fd = -1;
+    db_file->journal.size = 0;
+    db_file->journal.name = NULL;
+    memset(&db_file->extents, 0, sizeof(db_file->extents));
+    memset(&db_file->segments, 0, sizeof(db_file->segments));
 
-    for(int i = 0; i < db_file->header.max_files; i++) {
-        db_file->metadata[i].is_valid = 0;
+    db_file->metadata = NULL;
+
+    //Nothing is removed while another process writes a database with this name
+    db_file->file_size = 0;
+    db_file->fd = db_open_file(file_name, O_RDWR | O_CREAT | O_TRUNC);
+    if(db_file->fd == -1) {
+        return ERR_IO;
     }
 
-    db_file->fpdb = NULL;
-    db_file->fpdb = fopen(file_name, "w+b");
+    //The journal of a previous database with this name must not be replayed
+    int check = journal_init(db_file, file_name);
+    if(check != 0) {
+        return check;
+    }
+    (void)unlink(db_file->journal.name);
+    //And neither must its segments be read
+    check = segments_create(db_file, file_name);
+    if(check != 0) {
+        return check;
+    }
 
-    if(db_file->fpdb != NULL) {
-        number_header = fwrite(&db_file->header, sizeof(struct pictdb_header), 1, db_file->fpdb);
-        number_metadata = fwrite(db_file->metadata, sizeof(struct pict_metadata), db_file->header.max_files, db_file->fpdb);
+    size_t map_size = table_end(&db_file->header, db_file->header.max_files);
+    check = db_pwrite(db_file, &db_file->header, sizeof(struct pictdb_header), 0);
+    if(check == 0) {
+        check = db_zero(db_file, sizeof(struct pictdb_header), map_size - sizeof(struct pictdb_header));
+    }
+    if(check != 0) {
+        return check;
     }
 
-    if(number_header != 1 || number_metadata != db_file->header.max_files || db_file->fpdb == NULL) {
-        free(db_file->metadata);
-        db_file->metadata = NULL;
-        return ERR_IO;
+    if(has_compact_records(&db_file->header)) {
+        db_file->metadata = calloc(db_file->header.max_files, sizeof(struct pict_metadata));
+        if(db_file->metadata == NULL) {
+            return ERR_OUT_OF_MEMORY;
+        }
+    } else {
+        void* map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, db_file->fd, 0);
+        if(map == MAP_FAILED) {
+            return ERR_IO;
+        }
+        db_file->map = map;
+        db_file->map_size = map_size;
+        db_file->metadata = (struct pict_metadata*)((char*)map + sizeof(struct pictdb_header));
     }
 
-    printf("%zu item(s) written\n", number_header+number_metadata);
+    //Only the header is written, the metadata is a hole
+    printf("1 item(s) written\n");
+    memset(&db_file->dedup, 0, sizeof(db_file->dedup));
     return 0;
 }
@@ -8,6 +8,8 @@
 #include <string.h> // for strcmp
 #include <stdio.h> // for sprintf
 #include "pictDB.h"
+#include "db_index.h"
+#include "db_extent.h"
 
 /**
  * @brief Delete an image in the file
@@ -22,37 +24,31 @@ int do_delete(const char* picture_name, struct pictdb_file* db_file)
     if(db_file->header.num_files == 0) {
         return ERR_IO;
     }
-    unsigned int index = 0;   //Position of the image to delete
-    while(index < db_file->header.max_files && strcmp(picture_name, db_file->metadata[index].pict_id) != 0) {
-        index += 1;
-        while(index < db_file->header.max_files && db_file->metadata[index].is_valid == EMPTY) { //Skip the non valid metadatas
-            index += 1;
-        }
-    }
-    //If index == db_file->header.max_files, the image is not in the metadatas
-    if(index >= db_file->header.max_files) {
+    uint32_t index = index_find_id(db_file, picture_name);   //Position of the image to delete
+    if(index == INDEX_NOT_FOUND) {
         return ERR_FILE_NOT_FOUND;
     }
 
-    //Position of the image in the file
-    size_t pict_position = sizeof(struct pictdb_header) + index * sizeof(struct pict_metadata);
+    //The contents no other picture refers to become free space
+    const struct pict_metadata* metadata = &db_file->metadata[index];
+    for(size_t res = 0; res < NB_RES; res++) {
+        (void)blob_unref(db_file, metadata->offset[res], metadata->size[res]);
+    }
+
+    index_remove(db_file, index);
     db_file->metadata[index].is_valid = EMPTY;
-    int return_value_fseek = fseek(db_file->fpdb, pict_position, SEEK_SET);
-    size_t return_value_fwrite = 0;
 
-    if(return_value_fseek == 0) {
-        //Rewrite the whole metadata
-        return_value_fwrite = fwrite(&db_file->metadata[index], sizeof(struct pict_metadata), 1, db_file->fpdb);
-        if(return_value_fwrite == 1) {
-            //Update the header
-            db_file->header.db_version += 1;
-            db_file->header.num_files -= 1;
-            return_value_fseek = fseek(db_file->fpdb, 0, SEEK_SET);
-            return_value_fwrite = fwrite(&db_file->header, sizeof(struct pictdb_header), 1, db_file->fpdb);
-        }
+    //Rewrite the whole metadata
+    int check = write_metadata(db_file, index);
+    if(check != 0) {
+        return check;
     }
-    if(return_value_fseek != 0 || return_value_fwrite != 1) {
-        return ERR_IO;
+    //Update the header
+    db_file->header.db_version += 1;
+    db_file->header.num_files -= 1;
+    check = write_header(db_file);
+    if(check != 0) {
+        return check;
     }
-    return 0;
+    return db_commit(db_file);
 }
\ No newline at end of file
@@ -0,0 +1,599 @@
+/**
+ * @file db_extent.c
+ * @brief Free space of an opened pictDB, reused for new contents.
+ *
+ * The free extents are the byte ranges after the metadata which no valid
+ * picture refers to (images deleted, or appended but never committed).
+ * They are found on first use from the metadata of the valid pictures
+ * (skipped to with the columns, see db_columns.c), de-duplicated contents
+ * being referred to by several pictures, and kept sorted by offset and
+ * merged. New contents go to the smallest extent large enough (best fit),
+ * or at the end of the file. Their total is kept in header.dead_bytes,
+ * counted again from the free extents whenever they are found.
+ *
+ * The contents are counted by reference (de-duplicated contents are
+ * referred to by several pictures), so that do_delete knows when the last
+ * picture referring to a content is gone. The bytes are then only reused,
+ * and on Linux given back to the file system (a hole is punched), once
+ * the deletion is written (see db_flush): until then, the old metadata
+ * still refers to them.
+ *
+ * The segments of a segmented database are only appended to: their free
+ * bytes are counted and given back to the file system, never reused (see
+ * db_segment.c).
+ *
+ * @date 16 October 2026
+ */
+
+#define _GNU_SOURCE // for fallocate
+
+#include "pictDB.h"
+#include "db_extent.h"
+#include "db_columns.h"
+#include "db_segment.h"
+#include "db_record.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h> // for fallocate
+#include <unistd.h> // for ftruncate
+
+#define ZERO_BUFFER (1 << 20)
+
+/**
+* @brief Add an extent at the end of a list.
+*/
+static int push_extent(struct extent** list, size_t* nb, size_t* allocated, uint64_t offset, uint64_t size)
+{
+    if(*nb == *allocated) {
+        size_t bigger = *allocated == 0 ? 16 : 2 * *allocated;
+        struct extent* grown = realloc(*list, bigger * sizeof(struct extent));
+        if(grown == NULL) {
+            return ERR_OUT_OF_MEMORY;
+        }
+        *list = grown;
+        *allocated = bigger;
+    }
+    (*list)[*nb].offset = offset;
+    (*list)[*nb].size = size;
+    *nb += 1;
+    return 0;
+}
+
+/**
+* @brief Compare two extents by offset, for qsort.
+*/
+static int compare_offsets(const void* a, const void* b)
+{
+    const struct extent* x = a;
+    const struct extent* y = b;
+    return x->offset < y->offset ? -1 : (x->offset > y->offset ? 1 : 0);
+}
+
+/**
+* @brief Free the lists of extents, keeping the references.
+*/
+static void free_lists(struct free_extents* extents)
+{
+    free(extents->free);
+    free(extents->pending);
+    extents->free = NULL;
+    extents->pending = NULL;
+    extents->nb_free = extents->allocated = 0;
+    extents->nb_pending = extents->pending_allocated = 0;
+    extents->built = 0;
+}
+
+/**
+ * @brief Find the free extents from the metadata.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int extent_build(struct pictdb_file* db_file)
+{
+    if(db_file == NULL || db_file->metadata == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    free_lists(&db_file->extents);
+    if(is_segmented(db_file)) {
+        db_file->extents.built = 1;
+        return 0;
+    }
+
+    //Every range referred to by a valid picture, sorted
+    struct extent* used = NULL;
+    size_t nb_used = 0;
+    size_t allocated = 0;
+    int check = columns_ensure(db_file);
+    const struct pict_columns* columns = &db_file->columns;
+    for(uint32_t i = 0; check == 0 && (i = column_next_valid(columns, i)) < columns->count; i++) {
+        for(size_t res = 0; res < NB_RES && check == 0; res++) {
+            const struct pict_metadata* metadata = &db_file->metadata[i];
+            if(metadata->offset[res] != 0 && metadata->size[res] != 0) {
+                check = push_extent(&used, &nb_used, &allocated, metadata->offset[res], metadata->size[res]);
+            }
+        }
+    }
+    if(check == 0 && nb_used > 0) {
+        qsort(used, nb_used, sizeof(struct extent), compare_offsets);
+    }
+
+    //The gaps between them (shared ranges overlap and leave no gap)
+    struct free_extents* extents = &db_file->extents;
+    uint64_t cursor = table_end(&db_file->header, db_file->header.max_files);
+    for(size_t i = 0; i < nb_used && check == 0; i++) {
+        if(used[i].offset > cursor) {
+            check = push_extent(&extents->free, &extents->nb_free, &extents->allocated,
+                                cursor, used[i].offset - cursor);
+        }
+        if(used[i].offset + used[i].size > cursor) {
+            cursor = used[i].offset + used[i].size;
+        }
+    }
+    if(check == 0 && cursor < db_file->file_size) {
+        check = push_extent(&extents->free, &extents->nb_free, &extents->allocated,
+                            cursor, db_file->file_size - cursor);
+    }
+    free(used);
+
+    if(check != 0) {
+        free_lists(extents);
+        return check;
+    }
+    extents->built = 1;
+
+    //Fixes the count of a database written before it was kept
+    uint64_t dead = 0;
+    for(size_t i = 0; i < extents->nb_free; i++) {
+        dead += extents->free[i].size;
+    }
+    if(dead != db_file->header.dead_bytes) {
+        db_file->header.dead_bytes = dead;
+        return write_header(db_file);
+    }
+    return 0;
+}
+
+/**
+ * @brief Free the memory used by the free extents.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ */
+void extent_free_all(struct pictdb_file* db_file)
+{
+    if(db_file != NULL) {
+        free_lists(&db_file->extents);
+        free(db_file->extents.refs.offsets);
+        free(db_file->extents.refs.counts);
+        memset(&db_file->extents, 0, sizeof(db_file->extents));
+    }
+}
+
+/**
+* @brief Give a range back to the sorted list of free extents, merging it
+* with its neighbours.
+*/
+static int insert_free(struct free_extents* extents, uint64_t offset, uint64_t size)
+{
+    //First extent after the range
+    size_t lo = 0;
+    size_t hi = extents->nb_free;
+    while(lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if(extents->free[mid].offset < offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    int after = lo < extents->nb_free && offset + size == extents->free[lo].offset;
+    int before = lo > 0 && extents->free[lo - 1].offset + extents->free[lo - 1].size == offset;
+
+    if(before && after) {
+        extents->free[lo - 1].size += size + extents->free[lo].size;
+        memmove(&extents->free[lo], &extents->free[lo + 1], (extents->nb_free - lo - 1) * sizeof(struct extent));
+        extents->nb_free -= 1;
+    } else if(before) {
+        extents->free[lo - 1].size += size;
+    } else if(after) {
+        extents->free[lo].offset = offset;
+        extents->free[lo].size += size;
+    } else {
+        int check = push_extent(&extents->free, &extents->nb_free, &extents->allocated, 0, 0);
+        if(check != 0) {
+            return check;
+        }
+        memmove(&extents->free[lo + 1], &extents->free[lo], (extents->nb_free - lo - 1) * sizeof(struct extent));
+        extents->free[lo].offset = offset;
+        extents->free[lo].size = size;
+    }
+    return 0;
+}
+
+/**
+* @brief Give the blocks of a range of a file back to the file system, the
+* range then reading as zeros. Only on Linux.
+*
+* @return 0 if the blocks were given back, ERR_IO otherwise.
+*/
+static int punch(int fd, uint64_t offset, uint64_t size)
+{
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+    return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)offset, (off_t)size) == 0 ? 0 : ERR_IO;
+#else
+    (void)fd;
+    (void)offset;
+    (void)size;
+    return ERR_IO;
+#endif
+}
+
+/**
+* @brief Give the blocks of the free extent containing an offset back to the
+* file system (the whole extent, so that the blocks it shares with the
+* ranges freed before are given back too).
+*/
+static void punch_hole(struct pictdb_file* db_file, uint64_t offset)
+{
+    const struct free_extents* extents = &db_file->extents;
+    for(size_t i = 0; i < extents->nb_free; i++) {
+        const struct extent* extent = &extents->free[i];
+        if(extent->offset <= offset && offset < extent->offset + extent->size) {
+            //Not supported by the file system: the bytes are only reused
+            (void)punch(db_file->fd, extent->offset, extent->size);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Take a free range of the given size, the smallest extent large
+ * enough being used.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param size Number of bytes needed.
+ * @param offset Where the position of the range is stored.
+ *
+ * @return 0 if a range was found, ERR_FILE_NOT_FOUND if no extent is large
+ * enough (or none may be reused), otherwise an error.
+ */
+int extent_alloc(struct pictdb_file* db_file, uint64_t size, uint64_t* offset)
+{
+    //During an online garbage collection, a reused range could be taken for
+    //the content copied from it when the collection started (see gc_finish)
+    if(db_file->write_back.changed != NULL) {
+        return ERR_FILE_NOT_FOUND;
+    }
+    if(!db_file->extents.built) {
+        int check = extent_build(db_file);
+        if(check != 0) {
+            return check;
+        }
+    }
+    struct free_extents* extents = &db_file->extents;
+    size_t best = extents->nb_free;
+    for(size_t i = 0; i < extents->nb_free; i++) {
+        if(extents->free[i].size >= size
+           && (best == extents->nb_free || extents->free[i].size < extents->free[best].size)) {
+            best = i;
+            if(extents->free[i].size == size) {
+                break;
+            }
+        }
+    }
+    if(best == extents->nb_free || size == 0) {
+        return ERR_FILE_NOT_FOUND;
+    }
+
+    *offset = extents->free[best].offset;
+    db_file->header.dead_bytes -= size < db_file->header.dead_bytes ? size : db_file->header.dead_bytes;
+    extents->free[best].offset += size;
+    extents->free[best].size -= size;
+    if(extents->free[best].size == 0) {
+        memmove(&extents->free[best], &extents->free[best + 1],
+                (extents->nb_free - best - 1) * sizeof(struct extent));
+        extents->nb_free -= 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Give a range back once the change which freed it is written.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param offset Position of the range.
+ * @param size Number of bytes.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int extent_release(struct pictdb_file* db_file, uint64_t offset, uint64_t size)
+{
+    struct free_extents* extents = &db_file->extents;
+    if(size == 0) {
+        return 0;
+    }
+    //Built now, while the picture freeing the range is still valid
+    if(!extents->built) {
+        int check = extent_build(db_file);
+        if(check != 0) {
+            return check;
+        }
+    }
+    db_file->header.dead_bytes += size;
+    return push_extent(&extents->pending, &extents->nb_pending, &extents->pending_allocated, offset, size);
+}
+
+/**
+ * @brief Make the ranges given back by the changes just written reusable.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ */
+void extent_release_pending(struct pictdb_file* db_file)
+{
+    struct free_extents* extents = &db_file->extents;
+    for(size_t i = 0; i < extents->nb_pending; i++) {
+        if(is_segmented(db_file)) {
+            int fd = segment_fd(db_file, extents->pending[i].offset);
+            if(fd != -1) {
+                (void)punch(fd, SEGMENT_POSITION(extents->pending[i].offset), extents->pending[i].size);
+            }
+            continue;
+        }
+        //Out of memory: the range is only lost until the next open
+        (void)insert_free(extents, extents->pending[i].offset, extents->pending[i].size);
+        punch_hole(db_file, extents->pending[i].offset);
+    }
+    extents->nb_pending = 0;
+}
+
+/**
+ * @brief Number of bytes of the data still referred to by valid metadata.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ *
+ * @return The number of bytes.
+ */
+uint64_t live_bytes(const struct pictdb_file* db_file)
+{
+    uint64_t data = data_bytes(db_file);
+    return data > db_file->header.dead_bytes ? data - db_file->header.dead_bytes : 0;
+}
+
+/**
+ * @brief Number of bytes of the data, referred to or not.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ *
+ * @return The number of bytes.
+ */
+uint64_t data_bytes(const struct pictdb_file* db_file)
+{
+    if(is_segmented(db_file)) {
+        return segments_size(db_file);
+    }
+    uint64_t start = table_end(&db_file->header, db_file->header.max_files);
+    return db_file->file_size > start ? db_file->file_size - start : 0;
+}
+
+/**
+* @brief Position of an offset in the table of references: its entry, or
+* the empty entry where it would be added.
+*/
+static uint32_t refs_slot(const struct blob_refs* refs, uint64_t offset)
+{
+    uint32_t mask = refs->capacity - 1;
+    uint32_t pos = (uint32_t)((offset * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+    while(refs->offsets[pos] != 0 && refs->offsets[pos] != offset) {
+        pos = (pos + 1) & mask;
+    }
+    return pos;
+}
+
+/**
+* @brief Add a reference to an offset, the table being built.
+*/
+static int refs_add(struct blob_refs* refs, uint64_t offset)
+{
+    //Kept at most half full
+    if(2 * (refs->used + 1) > refs->capacity) {
+        struct blob_refs bigger = {NULL, NULL, refs->capacity == 0 ? 64 : 2 * refs->capacity, 0, refs->built};
+        bigger.offsets = calloc(bigger.capacity, sizeof(uint64_t));
+        bigger.counts = calloc(bigger.capacity, sizeof(uint32_t));
+        if(bigger.offsets == NULL || bigger.counts == NULL) {
+            free(bigger.offsets);
+            free(bigger.counts);
+            return ERR_OUT_OF_MEMORY;
+        }
+        for(uint32_t i = 0; i < refs->capacity; i++) {
+            if(refs->offsets[i] != 0) {
+                uint32_t pos = refs_slot(&bigger, refs->offsets[i]);
+                bigger.offsets[pos] = refs->offsets[i];
+                bigger.counts[pos] = refs->counts[i];
+                bigger.used += 1;
+            }
+        }
+        free(refs->offsets);
+        free(refs->counts);
+        *refs = bigger;
+    }
+    uint32_t pos = refs_slot(refs, offset);
+    if(refs->offsets[pos] == 0) {
+        refs->offsets[pos] = offset;
+        refs->used += 1;
+    }
+    refs->counts[pos] += 1;
+    return 0;
+}
+
+/**
+* @brief Remove the entry at a position, shifting back the following
+* entries of its cluster.
+*/
+static void refs_remove_at(struct blob_refs* refs, uint32_t hole)
+{
+    uint32_t mask = refs->capacity - 1;
+    uint32_t pos = hole;
+    for(;;) {
+        pos = (pos + 1) & mask;
+        if(refs->offsets[pos] == 0) {
+            break;
+        }
+        uint32_t home = (uint32_t)((refs->offsets[pos] * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+        //Move the entry iff its home position is not between the hole and itself
+        int between = (hole <= pos) ? (hole < home && home <= pos) : (hole < home || home <= pos);
+        if(!between) {
+            refs->offsets[hole] = refs->offsets[pos];
+            refs->counts[hole] = refs->counts[pos];
+            hole = pos;
+        }
+    }
+    refs->offsets[hole] = 0;
+    refs->counts[hole] = 0;
+    refs->used -= 1;
+}
+
+/**
+* @brief Count the references of every content from the metadata.
+*/
+static int refs_build(struct pictdb_file* db_file)
+{
+    struct blob_refs* refs = &db_file->extents.refs;
+    int check = columns_ensure(db_file);
+    const struct pict_columns* columns = &db_file->columns;
+    for(uint32_t i = 0; check == 0 && (i = column_next_valid(columns, i)) < columns->count; i++) {
+        for(size_t res = 0; res < NB_RES && check == 0; res++) {
+            if(db_file->metadata[i].offset[res] != 0) {
+                check = refs_add(refs, db_file->metadata[i].offset[res]);
+            }
+        }
+    }
+    if(check != 0) {
+        free(refs->offsets);
+        free(refs->counts);
+        memset(refs, 0, sizeof(struct blob_refs));
+        return check;
+    }
+    refs->built = 1;
+    return 0;
+}
+
+/**
+ * @brief Count a new reference to a content, after a picture referring to
+ * it became valid or got a new resolution.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param offset Position of the content.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int blob_ref(struct pictdb_file* db_file, uint64_t offset)
+{
+    //Not built yet: the reference will be counted from the metadata
+    if(!db_file->extents.refs.built || offset == 0) {
+        return 0;
+    }
+    return refs_add(&db_file->extents.refs, offset);
+}
+
+/**
+ * @brief Remove a reference to a content, before the picture referring to
+ * it is marked as invalid. The last reference gives the bytes back.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param offset Position of the content.
+ * @param size Size of the content.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int blob_unref(struct pictdb_file* db_file, uint64_t offset, uint64_t size)
+{
+    struct blob_refs* refs = &db_file->extents.refs;
+    if(offset == 0) {
+        return 0;
+    }
+    if(!refs->built) {
+        int check = refs_build(db_file);
+        if(check != 0) {
+            return check;
+        }
+    }
+    uint32_t pos = refs_slot(refs, offset);
+    if(refs->offsets[pos] == 0) {
+        return 0;
+    }
+    refs->counts[pos] -= 1;
+    if(refs->counts[pos] > 0) {
+        return 0;
+    }
+    refs_remove_at(refs, pos);
+    return extent_release(db_file, offset, size);
+}
+
+/**
+ * @brief Make a range of the database file read as zeros, without writing
+ * them where possible: the part after the end of the file is only added to
+ * its size, the part before is punched (written on other systems or file
+ * systems). Either way, the range takes no disk blocks until it is written.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param offset Position of the range.
+ * @param size Number of bytes.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int db_zero(struct pictdb_file* db_file, uint64_t offset, uint64_t size)
+{
+    uint64_t end = offset + size;
+    uint64_t inside = db_file->file_size > offset ? db_file->file_size - offset : 0;
+    if(inside > size) {
+        inside = size;
+    }
+    if(end > db_file->file_size) {
+        if(ftruncate(db_file->fd, (off_t)end) != 0) {
+            return ERR_IO;
+        }
+        db_file->file_size = end;
+    }
+    if(inside == 0 || punch(db_file->fd, offset, inside) == 0) {
+        return 0;
+    }
+
+    char* zeros = calloc(1, ZERO_BUFFER);
+    if(zeros == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    int check = 0;
+    for(uint64_t done = 0; done < inside && check == 0; done += ZERO_BUFFER) {
+        size_t n = inside - done < ZERO_BUFFER ? inside - done : ZERO_BUFFER;
+        check = db_pwrite(db_file, zeros, n, offset + done);
+    }
+    free(zeros);
+    return check;
+}
+
+/**
+ * @brief Write a new content in a free extent, or at the end of the file.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param buf Bytes to write.
+ * @param len Number of bytes to write.
+ * @param offset Where the position of the written bytes is stored.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int db_write_content(struct pictdb_file* db_file, const void* buf, size_t len, uint64_t* offset)
+{
+    uint64_t position = 0;
+    if(extent_alloc(db_file, len, &position) != 0) {
+        return db_append(db_file, buf, len, offset);
+    }
+    int check = db_pwrite(db_file, buf, len, position);
+    if(check != 0) {
+        //Not written: the range is still free
+        (void)insert_free(&db_file->extents, position, len);
+        return check;
+    }
+    *offset = position;
+    return 0;
+}
@@ -0,0 +1,119 @@
+/**
+ * @file db_extent.h
+ * @brief Free space of an opened pictDB, reused for new contents.
+ *
+ * @date 16 October 2026
+ */
+#ifndef DB_EXTENT_H
+#define DB_EXTENT_H
+
+#include "pictDB.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Find the free extents from the metadata: the ranges after the
+ * metadata which no valid picture refers to. extent_alloc calls it itself
+ * on first use.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int extent_build(struct pictdb_file* db_file);
+
+/**
+ * @brief Free the memory used by the free extents.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ */
+void extent_free_all(struct pictdb_file* db_file);
+
+/**
+ * @brief Take a free range of the given size, the smallest extent large
+ * enough being used.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param size Number of bytes needed.
+ * @param offset Where the position of the range is stored.
+ *
+ * @return 0 if a range was found, ERR_FILE_NOT_FOUND if no extent is large
+ * enough, otherwise an error.
+ */
+int extent_alloc(struct pictdb_file* db_file, uint64_t size, uint64_t* offset);
+
+/**
+ * @brief Give a range back once the change which freed it is written
+ * (extent_release_pending).
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param offset Position of the range.
+ * @param size Number of bytes.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int extent_release(struct pictdb_file* db_file, uint64_t offset, uint64_t size);
+
+/**
+ * @brief Make the ranges given back by the changes just written reusable,
+ * and punch holes there on Linux.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ */
+void extent_release_pending(struct pictdb_file* db_file);
+
+/**
+ * @brief Count a new reference to a content, after a picture referring to
+ * it became valid or got a new resolution.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param offset Position of the content.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int blob_ref(struct pictdb_file* db_file, uint64_t offset);
+
+/**
+ * @brief Remove a reference to a content, before the picture referring to
+ * it is marked as invalid. Once the last reference is gone, the bytes are
+ * given back (extent_release) and, on Linux, a hole is punched there when
+ * the deletion is written.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param offset Position of the content.
+ * @param size Size of the content.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int blob_unref(struct pictdb_file* db_file, uint64_t offset, uint64_t size);
+
+/**
+ * @brief Write a new content in a free extent, or at the end of the file.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param buf Bytes to write.
+ * @param len Number of bytes to write.
+ * @param offset Where the position of the written bytes is stored.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int db_write_content(struct pictdb_file* db_file, const void* buf, size_t len, uint64_t* offset);
+
+/**
+ * @brief Make a range of the database file read as zeros, sparse where the
+ * system allows it (see db_extent.c).
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param offset Position of the range.
+ * @param size Number of bytes.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int db_zero(struct pictdb_file* db_file, uint64_t offset, uint64_t size);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -2,26 +2,50 @@
  * @file do_gbcollect.c
  * @brief A garbage collector, removing invalid images on the disk.
  *
+ * The contents still referred to are copied byte for byte, in offset
+ * order (so that consecutive contents are copied at once, with
+ * copy_file_range where available), and the metadata is carried over
+ * with the new offsets: nothing is decoded nor hashed again, and the
+ * contents shared by several pictures stay shared.
+ *
+ * The server collects its database while serving it (gc_begin, gc_copy,
+ * gc_finish): the contents are copied without any lock from a copy of the
+ * metadata, then, with exclusive access, the metadata changed in the
+ * meantime is copied again and the new file replaces the old one. The
+ * positions of the metadata are kept, so the indexes stay valid. The
+ * contents written in the meantime are appended, no free extent being
+ * reused (see extent_alloc): an offset found among the copied contents
+ * always refers to the content that was copied.
+ *
+ * A segmented database is collected one segment at a time instead, in
+ * place (see db_segment.c).
+ *
+ * do_convert makes the new file with compact records (see db_record.c);
+ * the contents of a segmented database then stay in its segments.
+ *
  * @date 23 May 2016
  */
+#define _GNU_SOURCE // for copy_file_range
+
 #include "pictDB.h"
-#include "image_content.h"
+#include "db_journal.h"
+#include "db_segment.h"
+#include "db_record.h"
+#include "db_columns.h"
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define COPY_BUFFER (1 << 20) // buffer of the copies without copy_file_range
 
 /**
-* @brief Free the content of a pointer
-*
-* @param char** pointer to the image
+* @brief A content of the old database and its position in the new one.
 */
-void free_picture(char** data)
-{
-    if(data != NULL) {
-        if(*data != NULL) {
-            free(*data);
-            *data = NULL;
-        }
-    }
-}
+struct moved_blob {
+    uint64_t old_offset;
+    uint64_t new_offset;
+    uint64_t size;
+};
 
 /**
 * @brief Initialize the db_temp structure.
@@ -36,6 +60,7 @@ void initialize_pictdb(struct pictdb_file* db_file, struct pictdb_file* db_temp)
     db_temp->header.res_resized[2*RES_SMALL] = db_file->header.res_resized[2*RES_SMALL];
     db_temp->header.res_resized[2*RES_SMALL+1] = db_file->header.res_resized[2*RES_SMALL+1];
     db_temp->header.max_files = db_file->header.max_files;
+    db_temp->header.flags = db_file->header.flags;
 }
 
 /**
@@ -60,74 +85,231 @@ int remove_and_rename(const char* filename, const char* temp_filename)
     return 0;
 }
 /**
-* @brief A garbage collection of the pictdb_file given as parameter, by removing
-* every invalid image.
+* @brief Compare two contents by old offset, for qsort.
+*/
+static int compare_old_offsets(const void* a, const void* b)
+{
+    const struct moved_blob* x = a;
+    const struct moved_blob* y = b;
+    return x->old_offset < y->old_offset ? -1 : (x->old_offset > y->old_offset ? 1 : 0);
+}
+
+/**
+* @brief New offset of a content, found by binary search.
+*/
+static uint64_t moved_offset(const struct moved_blob* blobs, size_t nb_blobs, uint64_t old_offset)
+{
+    size_t lo = 0;
+    size_t hi = nb_blobs;
+    while(lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if(blobs[mid].old_offset < old_offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < nb_blobs && blobs[lo].old_offset == old_offset ? blobs[lo].new_offset : 0;
+}
+
+/**
+* @brief Copy bytes from a database file to the end of another one, in the
+* kernel with copy_file_range if possible, through a buffer otherwise.
+*/
+static int copy_range(const struct pictdb_file* from, uint64_t offset, uint64_t len, struct pictdb_file* to)
+{
+    uint64_t position = to->file_size;
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+    loff_t in = (loff_t)offset;
+    loff_t out = (loff_t)position;
+    uint64_t left = len;
+    while(left > 0) {
+        ssize_t n = copy_file_range(from->fd, &in, to->fd, &out, left, 0);
+        if(n <= 0) {
+            break;
+        }
+        left -= n;
+    }
+    if(left == 0) {
+        to->file_size = position + len;
+        return 0;
+    }
+    //Not supported between these files: the rest goes through a buffer
+    offset += len - left;
+    len = left;
+    position = (uint64_t)out;
+#endif
+    char* buffer = malloc(len < COPY_BUFFER ? len : COPY_BUFFER);
+    if(buffer == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    int check = 0;
+    while(len > 0 && check == 0) {
+        size_t n = len < COPY_BUFFER ? len : COPY_BUFFER;
+        check = db_pread(from, buffer, n, offset);
+        if(check == 0) {
+            check = db_pwrite(to, buffer, n, position);
+        }
+        offset += n;
+        position += n;
+        len -= n;
+    }
+    free(buffer);
+    return check;
+}
+
+/**
+* @brief Copy the contents referred to by the valid metadata, each once,
+* and list their new offsets (sorted by old offset).
+*/
+static int copy_contents(const struct pictdb_file* db_file, struct pictdb_file* db_temp,
+                         struct moved_blob** moved, size_t* nb_moved)
+{
+    size_t allocated = 16;
+    size_t nb_blobs = 0;
+    struct moved_blob* blobs = malloc(allocated * sizeof(struct moved_blob));
+    if(blobs == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    for(uint32_t i = 0; i < db_file->header.max_files; i++) {
+        const struct pict_metadata* metadata = &db_file->metadata[i];
+        for(size_t res = 0; metadata->is_valid == NON_EMPTY && res < NB_RES; res++) {
+            if(metadata->offset[res] == 0) {
+                continue;
+            }
+            if(nb_blobs == allocated) {
+                struct moved_blob* grown = realloc(blobs, 2 * allocated * sizeof(struct moved_blob));
+                if(grown == NULL) {
+                    free(blobs);
+                    return ERR_OUT_OF_MEMORY;
+                }
+                blobs = grown;
+                allocated *= 2;
+            }
+            blobs[nb_blobs].old_offset = metadata->offset[res];
+            blobs[nb_blobs].new_offset = 0;
+            blobs[nb_blobs].size = metadata->size[res];
+            nb_blobs += 1;
+        }
+    }
+    qsort(blobs, nb_blobs, sizeof(struct moved_blob), compare_old_offsets);
+
+    //A shared content is kept once
+    size_t nb_unique = 0;
+    for(size_t i = 0; i < nb_blobs; i++) {
+        if(nb_unique > 0 && blobs[nb_unique - 1].old_offset == blobs[i].old_offset) {
+            if(blobs[i].size > blobs[nb_unique - 1].size) {
+                blobs[nb_unique - 1].size = blobs[i].size;
+            }
+        } else {
+            blobs[nb_unique++] = blobs[i];
+        }
+    }
+
+    //Each run of consecutive contents is copied at once
+    int check = 0;
+    size_t first = 0;
+    while(first < nb_unique && check == 0) {
+        size_t end = first + 1;
+        while(end < nb_unique && blobs[end].old_offset == blobs[end - 1].old_offset + blobs[end - 1].size) {
+            end += 1;
+        }
+        uint64_t position = db_temp->file_size;
+        uint64_t length = blobs[end - 1].old_offset + blobs[end - 1].size - blobs[first].old_offset;
+        check = copy_range(db_file, blobs[first].old_offset, length, db_temp);
+        for(size_t i = first; i < end; i++) {
+            blobs[i].new_offset = position + (blobs[i].old_offset - blobs[first].old_offset);
+        }
+        first = end;
+    }
+    if(check != 0) {
+        free(blobs);
+        return check;
+    }
+    *moved = blobs;
+    *nb_moved = nb_unique;
+    return 0;
+}
+
+/**
+* @brief Copy a database to a new file with the given flags, then replace
+* it: the contents are copied (unless they are in segments) and the valid
+* metadata is packed at the beginning.
 *
 * @param db_file A pointer to a pictdb_file
 * @param filename Name of the file to remove
 * @param temp_filename Name of the file to rename
+* @param flags Flags of the new database
 *
 * @return 0 or an error code if an error occured
 */
-int do_gbcollect(struct pictdb_file* db_file, const char* filename, const char* temp_filename)
+static int rebuild(struct pictdb_file* db_file, const char* filename, const char* temp_filename, uint32_t flags)
 {
-    if(db_file == NULL || filename == NULL || temp_filename == NULL) {
-        return ERR_INVALID_ARGUMENT;
-    }
     struct pictdb_file db_temp;
     //Initalize and create db_temp
     initialize_pictdb(db_file, &db_temp);
+    db_temp.header.flags = flags;
     int check = do_create(temp_filename, &db_temp);
     if(check != 0) {
         do_close(&db_temp);
         return check;
     }
-    for(int i=0; i < db_file->header.max_files; i++) {
-        if(db_file->metadata[i].is_valid == NON_EMPTY) {
-            //If the metadata is valid we insert it in db_temp.
-            char* picture;
-            uint32_t pict_size = 0;
-            //Read the image from db_file.
-            check = do_read(db_file->metadata[i].pict_id, RES_ORIG, &picture, &pict_size, db_file);
-            if(check != 0) {
-                do_close(&db_temp);
-                free_picture(&picture);
-                remove(temp_filename); //In case of an error we remove db_temp
-                return check;
-            }
-            //Insert the image in db_temp.
-            check = do_insert(picture, pict_size, db_file->metadata[i].pict_id, &db_temp);
-            if(check != 0) {
-                do_close(&db_temp);
-                free_picture(&picture);
-                remove(temp_filename);
-                return check;
-            }
-            free_picture(&picture);
-            //If the metadata has the small image, we add it too in db_temp.
-            if(db_file->metadata[i].offset[RES_SMALL] != 0) {
-                check = do_read(db_file->metadata[i].pict_id, RES_SMALL, &picture, &pict_size, &db_temp);
-                if(check != 0) {
-                    do_close(&db_temp);
-                    free_picture(&picture);
-                    remove(temp_filename);
-                    return check;
-                }
-                free_picture(&picture);
-            }
-            //If the metadata has the thumbnail, we add it too in db_temp.
-            if(db_file->metadata[i].offset[RES_THUMB] != 0) {
-                check = do_read(db_file->metadata[i].pict_id, RES_THUMB, &picture, &pict_size, &db_temp);
-                if(check != 0) {
-                    do_close(&db_temp);
-                    free_picture(&picture);
-                    remove(temp_filename);
-                    return check;
-                }
-                free_picture(&picture);
+
+    struct moved_blob* moved = NULL;
+    size_t nb_moved = 0;
+    if(!is_segmented(db_file)) {
+        check = copy_contents(db_file, &db_temp, &moved, &nb_moved);
+    } else {
+        db_temp.header.dead_bytes = db_file->header.dead_bytes;
+    }
+    if(check != 0) {
+        do_close(&db_temp);
+        remove(temp_filename); //In case of an error we remove db_temp
+        return check;
+    }
+
+    //The valid metadata, packed at the beginning, with their new offsets
+    uint32_t count = 0;
+    uint32_t end = 0;
+    for(uint32_t i = 0; i < db_file->header.max_files; i++) {
+        if(db_file->metadata[i].is_valid != NON_EMPTY) {
+            continue;
+        }
+        //A compact page only takes the ids its heap has room for
+        uint32_t index = record_fit(&db_temp, end, db_file->metadata[i].pict_id);
+        if(index >= db_temp.header.max_files) {
+            check = ERR_FULL_DATABASE;
+            break;
+        }
+        struct pict_metadata* metadata = &db_temp.metadata[index];
+        *metadata = db_file->metadata[i];
+        for(size_t res = 0; moved != NULL && res < NB_RES; res++) {
+            if(metadata->offset[res] != 0) {
+                metadata->offset[res] = moved_offset(moved, nb_moved, metadata->offset[res]);
             }
         }
+        count += 1;
+        end = index + 1;
+    }
+    free(moved);
+    db_temp.header.num_files = count;
+    db_temp.header.db_version = count;
+
+    if(check == 0) {
+        check = write_metadata_range(&db_temp, 0, end);
     }
+    if(check == 0) {
+        check = write_header(&db_temp);
+    }
+    if(check == 0) {
+        check = db_sync(&db_temp);
+    }
+    if(check != 0) {
+        do_close(&db_temp);
+        remove(temp_filename);
+        return check;
+    }
+
     //Remove db_file and rename db_temp
     check = remove_and_rename(filename, temp_filename);
     do_close(&db_temp);
@@ -135,4 +317,278 @@ int do_gbcollect(struct pictdb_file* db_file, const char* filename, const char*
         return check;
     }
     return 0;
-}
\ No newline at end of file
+}
+
+/**
+* @brief A garbage collection of the pictdb_file given as parameter, by removing
+* every invalid image.
+*
+* @param db_file A pointer to a pictdb_file
+* @param filename Name of the file to remove
+* @param temp_filename Name of the file to rename
+*
+* @return 0 or an error code if an error occured
+*/
+int do_gbcollect(struct pictdb_file* db_file, const char* filename, const char* temp_filename)
+{
+    if(db_file == NULL || filename == NULL || temp_filename == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if(is_segmented(db_file)) {
+        return segments_gc(db_file);
+    }
+    return rebuild(db_file, filename, temp_filename, db_file->header.flags);
+}
+
+/**
+* @brief Convert a database to compact records, collecting its garbage
+* (except in segments).
+*
+* @param db_file A pointer to a pictdb_file
+* @param filename Name of the file to remove
+* @param temp_filename Name of the file to rename
+*
+* @return 0 or an error code if an error occured
+*/
+int do_convert(struct pictdb_file* db_file, const char* filename, const char* temp_filename)
+{
+    if(db_file == NULL || filename == NULL || temp_filename == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if(has_compact_records(&db_file->header)) {
+        return 0;
+    }
+    return rebuild(db_file, filename, temp_filename, db_file->header.flags | FLAG_COMPACT);
+}
+
+/**
+* @brief Remember where a content was copied, keeping the list sorted.
+*/
+static int add_moved(struct online_gc* gc, uint64_t old_offset, uint64_t new_offset, uint64_t size)
+{
+    if(gc->nb_moved == gc->moved_allocated) {
+        size_t bigger = gc->moved_allocated == 0 ? 16 : 2 * gc->moved_allocated;
+        struct moved_blob* grown = realloc(gc->moved, bigger * sizeof(struct moved_blob));
+        if(grown == NULL) {
+            return ERR_OUT_OF_MEMORY;
+        }
+        gc->moved = grown;
+        gc->moved_allocated = bigger;
+    }
+    size_t pos = gc->nb_moved;
+    while(pos > 0 && gc->moved[pos - 1].old_offset > old_offset) {
+        pos -= 1;
+    }
+    memmove(&gc->moved[pos + 1], &gc->moved[pos], (gc->nb_moved - pos) * sizeof(struct moved_blob));
+    gc->moved[pos].old_offset = old_offset;
+    gc->moved[pos].new_offset = new_offset;
+    gc->moved[pos].size = size;
+    gc->nb_moved += 1;
+    return 0;
+}
+
+/**
+* @brief Free the state of an online garbage collection.
+*/
+static void free_gc(struct online_gc* gc)
+{
+    free(gc->source.metadata);
+    free(gc->moved);
+    free(gc->temp_name);
+    memset(gc, 0, sizeof(struct online_gc));
+}
+
+/**
+* @brief A garbage collection started by gc_begin, while the database stays in use.
+*
+* @param db_file A pointer to a pictdb_file
+* @param temp_filename Name of the new database file
+* @param gc Where the state of the collection is stored
+*
+* @return 0 or an error code if an error occured
+*/
+int gc_begin(struct pictdb_file* db_file, const char* temp_filename, struct online_gc* gc)
+{
+    //A segmented database is collected with segment_gc
+    if(db_file == NULL || temp_filename == NULL || gc == NULL || is_segmented(db_file)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    memset(gc, 0, sizeof(struct online_gc));
+    gc->temp_name = malloc(strlen(temp_filename) + 1);
+    gc->source.metadata = malloc(db_file->header.max_files * sizeof(struct pict_metadata));
+    if(gc->temp_name == NULL || (gc->source.metadata == NULL && db_file->header.max_files > 0)) {
+        free_gc(gc);
+        return ERR_OUT_OF_MEMORY;
+    }
+    strcpy(gc->temp_name, temp_filename);
+    memcpy(gc->source.metadata, db_file->metadata, db_file->header.max_files * sizeof(struct pict_metadata));
+    gc->source.header = db_file->header;
+    gc->source.fd = db_file->fd;
+
+    int check = track_changes(db_file);
+    if(check != 0) {
+        free_gc(gc);
+    }
+    return check;
+}
+
+/**
+* @brief Copy the contents referred to when the collection started.
+*
+* @param gc State of the collection
+*
+* @return 0 or an error code if an error occured
+*/
+int gc_copy(struct online_gc* gc)
+{
+    if(gc == NULL || gc->temp_name == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    initialize_pictdb(&gc->source, &gc->temp);
+    int check = do_create(gc->temp_name, &gc->temp);
+    if(check == 0) {
+        check = copy_contents(&gc->source, &gc->temp, &gc->moved, &gc->nb_moved);
+        gc->moved_allocated = gc->nb_moved;
+    }
+
+    //The metadata keeps its positions: the indexes stay valid
+    for(uint32_t i = 0; check == 0 && i < gc->source.header.max_files; i++) {
+        if(gc->source.metadata[i].is_valid == NON_EMPTY) {
+            struct pict_metadata* metadata = &gc->temp.metadata[i];
+            *metadata = gc->source.metadata[i];
+            for(size_t res = 0; res < NB_RES; res++) {
+                if(metadata->offset[res] != 0) {
+                    metadata->offset[res] = moved_offset(gc->moved, gc->nb_moved, metadata->offset[res]);
+                }
+            }
+            check = write_metadata(&gc->temp, i);
+        }
+    }
+    //Synced now, so that little is left to sync in gc_finish
+    if(check == 0) {
+        check = db_flush(&gc->temp);
+    }
+    if(check == 0) {
+        check = db_sync_file(&gc->temp);
+    }
+    return check;
+}
+
+/**
+* @brief Copy the metadata changed since the collection started, and switch
+* to the new database.
+*
+* @param db_file A pointer to a pictdb_file
+* @param filename Name of the database file
+* @param gc State of the collection
+*
+* @return 0 or an error code if an error occured
+*/
+int gc_finish(struct pictdb_file* db_file, const char* filename, struct online_gc* gc)
+{
+    if(db_file == NULL || filename == NULL || gc == NULL || gc->temp.metadata == NULL
+       || db_file->write_back.changed == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    struct pictdb_file* temp = &gc->temp;
+    const uint64_t* changed = db_file->write_back.changed;
+    int check = 0;
+    for(uint32_t i = 0; check == 0 && i < db_file->header.max_files; i++) {
+        if(!((changed[i / 64] >> (i % 64)) & 1)) {
+            continue;
+        }
+        struct pict_metadata* metadata = &temp->metadata[i];
+        memset(metadata, 0, sizeof(struct pict_metadata));
+        if(db_file->metadata[i].is_valid == NON_EMPTY) {
+            *metadata = db_file->metadata[i];
+            for(size_t res = 0; res < NB_RES && check == 0; res++) {
+                uint64_t offset = metadata->offset[res];
+                if(offset == 0) {
+                    continue;
+                }
+                metadata->offset[res] = moved_offset(gc->moved, gc->nb_moved, offset);
+                if(metadata->offset[res] == 0) {
+                    metadata->offset[res] = temp->file_size;
+                    check = copy_range(db_file, offset, metadata->size[res], temp);
+                    if(check == 0) {
+                        check = add_moved(gc, offset, metadata->offset[res], metadata->size[res]);
+                    }
+                }
+            }
+        }
+        if(check == 0) {
+            check = write_metadata(temp, i);
+        }
+    }
+    if(check == 0) {
+        temp->header = db_file->header;
+        temp->header.dead_bytes = 0;
+        check = write_header(temp);
+    }
+    if(check == 0) {
+        check = db_sync(temp);
+    }
+
+    //The records of the old journal must not be replayed on the new file
+    if(check == 0) {
+        check = db_flush(db_file);
+    }
+    if(check == 0 && db_file->journal.fd != -1) {
+        check = journal_checkpoint(db_file, 1);
+    }
+    if(check != 0) {
+        gc_abort(db_file, gc);
+        return check;
+    }
+
+    //Opened before the switch, so that a failure leaves everything as it was
+    struct pictdb_file fresh;
+    do_close(temp);
+    check = do_open_mmap(gc->temp_name, "rb+", &fresh);
+    if(check == 0 && rename(gc->temp_name, filename) != 0) {
+        check = ERR_IO;
+    }
+    if(check != 0) {
+        do_close(&fresh);
+        remove(gc->temp_name);
+        untrack_changes(db_file);
+        free_gc(gc);
+        return check;
+    }
+    free(fresh.journal.name);
+    check = journal_init(&fresh, filename);
+
+    //What only lives in memory is handed over
+    const struct write_back* write_back = &db_file->write_back;
+    (void)set_write_back(&fresh, write_back->batch, write_back->interval_ms, write_back->fsync_policy);
+    //The indexes hash the columns: without them, they are built again on first use
+    if(db_file->index.id_table != NULL && columns_build(&fresh) == 0) {
+        fresh.index = db_file->index;
+        memset(&db_file->index, 0, sizeof(struct pict_index));
+    }
+    fresh.dedup = db_file->dedup;
+    do_close(db_file);
+    *db_file = fresh;
+    free_gc(gc);
+    return check;
+}
+
+/**
+* @brief Give up a garbage collection.
+*
+* @param db_file A pointer to a pictdb_file
+* @param gc State of the collection
+*/
+void gc_abort(struct pictdb_file* db_file, struct online_gc* gc)
+{
+    if(db_file != NULL) {
+        untrack_changes(db_file);
+    }
+    if(gc != NULL) {
+        if(gc->temp.metadata != NULL) {
+            do_close(&gc->temp);
+            remove(gc->temp_name);
+        }
+        free_gc(gc);
+    }
+}
@@ -0,0 +1,257 @@
+/**
+ * @file db_grow.c
+ * @brief Growth of the metadata table of a pictDB.
+ *
+ * The table stays right after the header: the contents in the way of its
+ * new part are copied to the end of the file, and the metadata is made
+ * to refer to the copies before their old bytes are overwritten with the
+ * empty metadata. Only these contents are copied (none if the database is
+ * segmented), so the cost depends on the size of the new metadata, not on
+ * the size of the images.
+ *
+ * The new max_files is written last, in the header: until then, the
+ * database is the old one with a few dead bytes at its end, and nothing
+ * is to be recovered after a crash.
+ *
+ * @date 16 October 2026
+ */
+
+#define _POSIX_C_SOURCE 200809L // for mmap
+
+#include "pictDB.h"
+#include "db_index.h"
+#include "db_columns.h"
+#include "db_extent.h"
+#include "db_segment.h"
+#include "db_record.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h> // for mmap
+
+#define GROW_BUFFER (1 << 20)
+
+/**
+* @brief A content to move out of the new metadata.
+*/
+struct moved_content {
+    uint64_t old_offset;
+    uint64_t new_offset;
+    uint64_t size;
+};
+
+/**
+* @brief Compare two contents by offset, for qsort and bsearch.
+*/
+static int compare_contents(const void* a, const void* b)
+{
+    const struct moved_content* x = a;
+    const struct moved_content* y = b;
+    return x->old_offset < y->old_offset ? -1 : (x->old_offset > y->old_offset ? 1 : 0);
+}
+
+/**
+* @brief Copy the contents starting before the end of the new metadata to
+* the end of the file, and make the metadata refer to the copies.
+*/
+static int move_contents(struct pictdb_file* db_file, uint64_t table_end, char* buffer)
+{
+    //The contents in the way, each shared content once
+    size_t nb = 0;
+    for(uint32_t i = 0; i < db_file->header.max_files; i++) {
+        for(size_t res = 0; db_file->metadata[i].is_valid == NON_EMPTY && res < NB_RES; res++) {
+            nb += db_file->metadata[i].offset[res] != 0 && db_file->metadata[i].offset[res] < table_end;
+        }
+    }
+    if(nb == 0) {
+        return 0;
+    }
+    struct moved_content* contents = malloc(nb * sizeof(struct moved_content));
+    if(contents == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    nb = 0;
+    for(uint32_t i = 0; i < db_file->header.max_files; i++) {
+        const struct pict_metadata* metadata = &db_file->metadata[i];
+        for(size_t res = 0; metadata->is_valid == NON_EMPTY && res < NB_RES; res++) {
+            if(metadata->offset[res] != 0 && metadata->offset[res] < table_end) {
+                contents[nb].old_offset = metadata->offset[res];
+                contents[nb].size = metadata->size[res];
+                nb += 1;
+            }
+        }
+    }
+    qsort(contents, nb, sizeof(struct moved_content), compare_contents);
+    size_t nb_unique = 0;
+    for(size_t i = 0; i < nb; i++) {
+        if(nb_unique > 0 && contents[nb_unique - 1].old_offset == contents[i].old_offset) {
+            if(contents[i].size > contents[nb_unique - 1].size) {
+                contents[nb_unique - 1].size = contents[i].size;
+            }
+        } else {
+            contents[nb_unique++] = contents[i];
+        }
+    }
+
+    //Copied after the new metadata, even if the file ends before
+    uint64_t position = db_file->file_size > table_end ? db_file->file_size : table_end;
+    int check = 0;
+    for(size_t i = 0; i < nb_unique && check == 0; i++) {
+        contents[i].new_offset = position;
+        for(uint64_t done = 0; done < contents[i].size && check == 0; done += GROW_BUFFER) {
+            size_t n = contents[i].size - done < GROW_BUFFER ? contents[i].size - done : GROW_BUFFER;
+            check = db_pread(db_file, buffer, n, contents[i].old_offset + done);
+            if(check == 0) {
+                check = db_pwrite(db_file, buffer, n, position + done);
+            }
+        }
+        position += contents[i].size;
+    }
+    //The copies are on the disk before anything refers to them
+    if(check == 0) {
+        check = db_sync_file(db_file);
+    }
+
+    for(uint32_t i = 0; i < db_file->header.max_files && check == 0; i++) {
+        struct pict_metadata* metadata = &db_file->metadata[i];
+        int changed = 0;
+        for(size_t res = 0; metadata->is_valid == NON_EMPTY && res < NB_RES; res++) {
+            if(metadata->offset[res] != 0 && metadata->offset[res] < table_end) {
+                struct moved_content key = {metadata->offset[res], 0, 0};
+                const struct moved_content* content = bsearch(&key, contents, nb_unique,
+                                                              sizeof(struct moved_content), compare_contents);
+                metadata->offset[res] = content->new_offset;
+                changed = 1;
+            }
+        }
+        if(changed) {
+            check = write_metadata(db_file, i);
+        }
+    }
+    free(contents);
+    //Nothing refers to the old bytes on the disk from now on
+    return check == 0 ? db_sync(db_file) : check;
+}
+
+/**
+* @brief Make the in-memory metadata as large as the new table, the new
+* part being empty. The file must already be large enough.
+*/
+static int grow_in_memory(struct pictdb_file* db_file, uint32_t max_files)
+{
+    size_t table_size = (size_t)max_files * sizeof(struct pict_metadata);
+    if(db_file->map == NULL) {
+        struct pict_metadata* metadata = realloc(db_file->metadata, table_size);
+        if(metadata == NULL) {
+            return ERR_OUT_OF_MEMORY;
+        }
+        memset(&metadata[db_file->header.max_files], 0,
+               (size_t)(max_files - db_file->header.max_files) * sizeof(struct pict_metadata));
+        db_file->metadata = metadata;
+        return 0;
+    }
+    size_t map_size = sizeof(struct pictdb_header) + table_size;
+    void* map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, db_file->fd, 0);
+    if(map == MAP_FAILED) {
+        return ERR_IO;
+    }
+    munmap(db_file->map, db_file->map_size);
+    db_file->map = map;
+    db_file->map_size = map_size;
+    db_file->metadata = (struct pict_metadata*)((char*)map + sizeof(struct pictdb_header));
+    return 0;
+}
+
+/**
+ * @brief Give a database more metadata.
+ *
+ * @param db_file In memory structure with header and metadata.
+ * @param max_files The new number of metadata.
+ *
+ * @return 0 or an error code if an error occurs.
+ */
+int do_grow(struct pictdb_file* db_file, uint32_t max_files)
+{
+    if(db_file == NULL || db_file->fd < 0 || db_file->metadata == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if(max_files <= db_file->header.max_files || max_files > max_files_limit(&db_file->header)) {
+        return ERR_MAX_FILES;
+    }
+    //An online garbage collection works on a table of the old size
+    if(db_file->write_back.changed != NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    int check = db_sync(db_file);
+    if(check != 0) {
+        return check;
+    }
+    uint64_t old_end = table_end(&db_file->header, db_file->header.max_files);
+    uint64_t new_end = table_end(&db_file->header, max_files);
+    if(!is_segmented(db_file)) {
+        char* buffer = malloc(GROW_BUFFER);
+        check = buffer == NULL ? ERR_OUT_OF_MEMORY : move_contents(db_file, new_end, buffer);
+        free(buffer);
+    }
+
+    //The new metadata, empty, over the bytes nothing refers to anymore
+    if(check == 0) {
+        check = db_zero(db_file, old_end, new_end - old_end);
+    }
+    if(check == 0) {
+        check = db_sync_file(db_file);
+    }
+    if(check == 0) {
+        check = grow_in_memory(db_file, max_files);
+    }
+    if(check != 0) {
+        return check;
+    }
+    //The columns and indexes are of the old size: found again below, or on first use
+    int indexed = db_file->index.id_table != NULL;
+    index_free(db_file);
+    columns_free(db_file);
+
+    //The switch to the new table
+    db_file->header.max_files = max_files;
+    free(db_file->write_back.dirty);
+    db_file->write_back.dirty = NULL;
+    db_file->write_back.dirty_words = 0;
+    check = write_header(db_file);
+    if(check == 0) {
+        check = db_sync(db_file);
+    }
+
+    //The indexes and free extents are found again for the new table
+    if(check == 0 && indexed) {
+        check = index_build(db_file);
+    }
+    extent_free_all(db_file);
+    if(check == 0 && !is_segmented(db_file)) {
+        check = extent_build(db_file);
+    }
+    if(check == 0) {
+        check = db_sync(db_file);
+    }
+    return check;
+}
+
+/**
+ * @brief Double the metadata of a database an insertion found full.
+ *
+ * @param db_file In memory structure with header and metadata.
+ *
+ * @return 0 or an error code if an error occurs.
+ */
+int grow_when_full(struct pictdb_file* db_file)
+{
+    if(db_file == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    uint32_t limit = max_files_limit(&db_file->header);
+    uint32_t max_files = db_file->header.max_files;
+    //An online gc works on the old table, which keeps its size
+    if(max_files >= limit || db_file->write_back.changed != NULL) {
+        return ERR_FULL_DATABASE;
+    }
+    return do_grow(db_file, max_files <= limit / 2 ? 2 * max_files : limit);
+}
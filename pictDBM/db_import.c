@@ -0,0 +1,502 @@
+/**
+ * @file db_import.c
+ * @brief Bulk import of image files in a pictDB.
+ *
+ * Worker threads read the files and compute their SHA-256 and resolution;
+ * the calling thread takes the results in order, de-duplicates them with
+ * the in-memory indexes and copies the new contents into a large buffer,
+ * appended to the database in one write when it is full. In a segmented
+ * database, the buffer holds no more than the last segment has room for.
+ * The header and the metadata are written by a single db_flush at the end,
+ * unless a full database grows on the way.
+ *
+ * @date 16 October 2026
+ */
+
+#define _POSIX_C_SOURCE 200809L // for getline, pread
+
+#include "pictDB.h"
+#include "db_index.h"
+#include "image_content.h"
+#include "db_extent.h"
+#include "db_record.h"
+#include "db_segment.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define IMPORT_WINDOW 256              // files read ahead of the insertion
+#define IMPORT_BUFFER (16 * 1024 * 1024) // bytes appended per write
+
+/**
+* @brief A file to import, filled by the workers.
+*/
+struct import_item {
+    const char* path;
+    char* content;
+    size_t size;
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    uint32_t res_orig[2];
+    int error;
+    int ready;
+    uint32_t slot; // position in the metadata once inserted
+};
+
+/**
+* @brief Work shared by the workers and the inserting thread.
+*/
+struct import_work {
+    struct import_item* items;
+    size_t nb_items;
+    size_t next;      // next item to be read by a worker
+    size_t inserted;  // items already taken by the inserting thread
+    pthread_mutex_t lock;
+    pthread_cond_t ready; // an item is ready
+    pthread_cond_t room;  // the window moved forward
+};
+
+/**
+* @brief Read a whole file.
+* @param path Name of the file.
+* @param size Where the size of the file is stored.
+* @return The content of the file (to be freed), or NULL if an error occurs.
+*/
+static char* read_file(const char* path, size_t* size)
+{
+    int fd = open(path, O_RDONLY);
+    if(fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    char* content = NULL;
+    if(fstat(fd, &st) == 0 && st.st_size > 0) {
+        content = malloc(st.st_size);
+    }
+    size_t done = 0;
+    while(content != NULL && done < (size_t)st.st_size) {
+        ssize_t n = pread(fd, content + done, st.st_size - done, done);
+        if(n <= 0) {
+            free(content);
+            content = NULL;
+        } else {
+            done += n;
+        }
+    }
+    close(fd);
+    *size = done;
+    return content;
+}
+
+/**
+* @brief Read, hash and measure one file.
+* @param item The file.
+*/
+static void load_item(struct import_item* item)
+{
+    item->content = read_file(item->path, &item->size);
+    if(item->content == NULL) {
+        item->error = ERR_IO;
+        return;
+    }
+    (void)SHA256((unsigned char*)item->content, item->size, item->SHA);
+    uint32_t width = 0;
+    uint32_t height = 0;
+    item->error = get_resolution(&height, &width, item->content, item->size);
+    item->res_orig[0] = width;
+    item->res_orig[1] = height;
+}
+
+/**
+* @brief Worker thread: loads the files, at most IMPORT_WINDOW ahead of the
+* inserting thread.
+* @param arg The import_work.
+*/
+static void* import_worker(void* arg)
+{
+    struct import_work* work = arg;
+    pthread_mutex_lock(&work->lock);
+    for(;;) {
+        while(work->next < work->nb_items && work->next >= work->inserted + IMPORT_WINDOW) {
+            pthread_cond_wait(&work->room, &work->lock);
+        }
+        if(work->next >= work->nb_items) {
+            break;
+        }
+        struct import_item* item = &work->items[work->next];
+        work->next += 1;
+        pthread_mutex_unlock(&work->lock);
+
+        load_item(item);
+
+        pthread_mutex_lock(&work->lock);
+        item->ready = 1;
+        pthread_cond_broadcast(&work->ready);
+    }
+    pthread_mutex_unlock(&work->lock);
+    return NULL;
+}
+
+/**
+* @brief Append the buffered contents to the database.
+* @param db_file Pointer to a pictdb_file structure.
+* @param buffer The buffer.
+* @param len Number of bytes buffered, reset to 0.
+* @return 0 if no error occurs, otherwise an error.
+*/
+static int flush_buffer(struct pictdb_file* db_file, const char* buffer, size_t* len)
+{
+    if(*len == 0) {
+        return 0;
+    }
+    uint64_t offset = 0;
+    int check = db_append(db_file, buffer, *len, &offset);
+    *len = 0;
+    return check;
+}
+
+/**
+* @brief Number of bytes the buffer may hold: IMPORT_BUFFER, or less if the
+* last segment has less room left, a content being never split.
+* @param db_file Pointer to a pictdb_file structure.
+* @return The number of bytes.
+*/
+static size_t buffer_room(const struct pictdb_file* db_file)
+{
+    if(is_segmented(db_file) && segment_room(db_file) < IMPORT_BUFFER) {
+        return (size_t)segment_room(db_file);
+    }
+    return IMPORT_BUFFER;
+}
+
+/**
+* @brief Insert a loaded file in the database. Its content is not written
+* yet: it is either shared with an image already there, or added to the
+* buffer (or appended right away if it does not fit in the buffer).
+* @param db_file Pointer to a pictdb_file structure.
+* @param item The loaded file.
+* @param buffer The buffer.
+* @param buffered Number of bytes in the buffer.
+* @param stats Counters of the import.
+* @return 0 if no error occurs, otherwise an error.
+*/
+static int insert_item(struct pictdb_file* db_file, struct import_item* item,
+                       char* buffer, size_t* buffered, struct import_stats* stats)
+{
+    //The name of the file is the picture id
+    const char* pict_id = strrchr(item->path, '/');
+    pict_id = pict_id == NULL ? item->path : pict_id + 1;
+    if(pict_id[0] == '\0' || strlen(pict_id) > MAX_PIC_ID) {
+        return ERR_INVALID_PICID;
+    }
+    if(index_find_id(db_file, pict_id) != INDEX_NOT_FOUND) {
+        return ERR_DUPLICATE_ID;
+    }
+
+    uint32_t index = record_find_free(db_file, pict_id);
+    if(index == INDEX_NOT_FOUND) {
+        return ERR_FULL_DATABASE;
+    }
+
+    struct pict_metadata* metadata = &db_file->metadata[index];
+    memset(metadata, 0, sizeof(struct pict_metadata));
+    strncpy(metadata->pict_id, pict_id, MAX_PIC_ID);
+    memcpy(metadata->SHA, item->SHA, SHA256_DIGEST_LENGTH);
+    metadata->res_orig[0] = item->res_orig[0];
+    metadata->res_orig[1] = item->res_orig[1];
+
+    uint32_t same = index_find_sha(db_file, item->SHA, index);
+    if(same != INDEX_NOT_FOUND) {
+        for(size_t j = 0; j < NB_RES; j++) {
+            metadata->size[j] = db_file->metadata[same].size[j];
+            metadata->offset[j] = db_file->metadata[same].offset[j];
+        }
+        db_file->dedup.hits += 1;
+        db_file->dedup.saved_bytes += item->size;
+        stats->duplicates += 1;
+    } else {
+        size_t room = buffer_room(db_file);
+        if(*buffered + item->size > room) {
+            int check = flush_buffer(db_file, buffer, buffered);
+            if(check != 0) {
+                return check;
+            }
+            room = buffer_room(db_file);
+        }
+        metadata->size[RES_ORIG] = item->size;
+        //The buffer goes at the current end of the file
+        metadata->offset[RES_ORIG] = db_end(db_file) + *buffered;
+        if(item->size > room) {
+            int check = db_append(db_file, item->content, item->size, &metadata->offset[RES_ORIG]);
+            if(check != 0) {
+                return check;
+            }
+        } else {
+            memcpy(buffer + *buffered, item->content, item->size);
+            *buffered += item->size;
+        }
+        db_file->dedup.misses += 1;
+        stats->bytes_written += item->size;
+    }
+
+    metadata->is_valid = NON_EMPTY;
+    index_insert(db_file, index);
+    for(size_t res = 0; res < NB_RES; res++) {
+        (void)blob_ref(db_file, metadata->offset[res]);
+    }
+    item->slot = index;
+    //Only marked: the metadata is written with the others by db_flush
+    int check = write_metadata(db_file, index);
+    if(check != 0) {
+        return check;
+    }
+    db_file->header.num_files += 1;
+    db_file->header.db_version += 1;
+    stats->imported += 1;
+    return 0;
+}
+
+/**
+ * @brief Import several image files in a database, the name of each file
+ * being its picture id. Files which cannot be inserted are skipped.
+ *
+ * @param db_file Data base in which we add the images.
+ * @param files Names of the files.
+ * @param nb_files Number of files.
+ * @param nb_threads Number of threads reading the files.
+ * @param stats Where the counters of the import are stored.
+ *
+ * @return 0 or an error code if an error occurs (ERR_FULL_DATABASE if the
+ * database is full before the end and cannot grow).
+ */
+int do_import(struct pictdb_file* db_file, char* const files[], size_t nb_files,
+              size_t nb_threads, struct import_stats* stats)
+{
+    if(db_file == NULL || files == NULL || stats == NULL || nb_threads == 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    memset(stats, 0, sizeof(struct import_stats));
+    if(nb_files == 0) {
+        return 0;
+    }
+
+    struct import_work work;
+    memset(&work, 0, sizeof(work));
+    work.items = calloc(nb_files, sizeof(struct import_item));
+    char* buffer = malloc(IMPORT_BUFFER);
+    pthread_t* threads = calloc(nb_threads, sizeof(pthread_t));
+    if(work.items == NULL || buffer == NULL || threads == NULL) {
+        free(work.items);
+        free(buffer);
+        free(threads);
+        return ERR_OUT_OF_MEMORY;
+    }
+    for(size_t i = 0; i < nb_files; i++) {
+        work.items[i].path = files[i];
+        work.items[i].slot = INDEX_NOT_FOUND;
+    }
+    work.nb_items = nb_files;
+    pthread_mutex_init(&work.lock, NULL);
+    pthread_cond_init(&work.ready, NULL);
+    pthread_cond_init(&work.room, NULL);
+
+    size_t started = 0;
+    while(started < nb_threads && pthread_create(&threads[started], NULL, import_worker, &work) == 0) {
+        started += 1;
+    }
+
+    int check = started == 0 ? ERR_IO : 0;
+    size_t buffered = 0;
+    for(size_t i = 0; i < nb_files && check == 0; i++) {
+        struct import_item* item = &work.items[i];
+        pthread_mutex_lock(&work.lock);
+        while(!item->ready) {
+            pthread_cond_wait(&work.ready, &work.lock);
+        }
+        pthread_mutex_unlock(&work.lock);
+
+        stats->bytes_read += item->size;
+        //A file which cannot be read or measured is skipped, a database error stops the import
+        int error = item->error;
+        if(error == 0) {
+            error = insert_item(db_file, item, buffer, &buffered, stats);
+            //The growth may move contents: the buffered ones are written first
+            if(error == ERR_FULL_DATABASE && flush_buffer(db_file, buffer, &buffered) == 0
+               && grow_when_full(db_file) == 0) {
+                error = insert_item(db_file, item, buffer, &buffered, stats);
+            }
+            if(error == ERR_FULL_DATABASE || error == ERR_IO || error == ERR_OUT_OF_MEMORY) {
+                check = error;
+            }
+        }
+        if(error != 0 && check == 0) {
+            fprintf(stderr, "%s: %s\n", item->path, ERROR_MESSAGES[error]);
+            stats->skipped += 1;
+        }
+        free(item->content);
+        item->content = NULL;
+
+        pthread_mutex_lock(&work.lock);
+        work.inserted = i + 1;
+        pthread_cond_broadcast(&work.room);
+        pthread_mutex_unlock(&work.lock);
+    }
+
+    //Let the workers stop
+    pthread_mutex_lock(&work.lock);
+    work.next = nb_files;
+    pthread_cond_broadcast(&work.room);
+    pthread_mutex_unlock(&work.lock);
+    for(size_t i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for(size_t i = 0; i < nb_files; i++) {
+        free(work.items[i].content);
+    }
+
+    //What was inserted is written even if the import stopped early
+    int flushed = flush_buffer(db_file, buffer, &buffered);
+    if(flushed == 0) {
+        flushed = write_header(db_file);
+    }
+    if(flushed == 0) {
+        flushed = db_flush(db_file);
+    }
+    if(check == 0) {
+        check = flushed;
+    }
+
+    //Same policy as do_insert: the images are stored anyway
+    if(flushed == 0 && variants_policy(&db_file->header) == VARIANTS_SYNC) {
+        for(size_t i = 0; i < nb_files; i++) {
+            if(work.items[i].slot != INDEX_NOT_FOUND) {
+                (void)create_variants(db_file, work.items[i].slot, ALL_VARIANTS);
+            }
+        }
+    }
+
+    pthread_cond_destroy(&work.room);
+    pthread_cond_destroy(&work.ready);
+    pthread_mutex_destroy(&work.lock);
+    free(threads);
+    free(buffer);
+    free(work.items);
+    return check;
+}
+
+/**
+* @brief Add a copy of a name to a list of names.
+* @return 0 if no error occurs, otherwise an error.
+*/
+static int add_file(char*** files, size_t* nb_files, size_t* allocated, const char* name, size_t len)
+{
+    if(*nb_files == *allocated) {
+        size_t size = *allocated == 0 ? 64 : 2 * *allocated;
+        char** bigger = realloc(*files, size * sizeof(char*));
+        if(bigger == NULL) {
+            return ERR_OUT_OF_MEMORY;
+        }
+        *files = bigger;
+        *allocated = size;
+    }
+    char* copy = malloc(len + 1);
+    if(copy == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+    (*files)[*nb_files] = copy;
+    *nb_files += 1;
+    return 0;
+}
+
+/**
+* @brief Compare two names, for qsort.
+*/
+static int compare_names(const void* a, const void* b)
+{
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/**
+ * @brief List the files to import: the regular files of a directory (in
+ * alphabetical order), or the names listed in a file, one per line.
+ *
+ * @param source Name of the directory or of the list.
+ * @param files Where the list of names (to be freed with free_file_list) is stored.
+ * @param nb_files Where the number of names is stored.
+ *
+ * @return 0 or an error code if an error occurs.
+ */
+int list_import_files(const char* source, char*** files, size_t* nb_files)
+{
+    if(source == NULL || files == NULL || nb_files == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    *files = NULL;
+    *nb_files = 0;
+    size_t allocated = 0;
+    int check = 0;
+
+    DIR* dir = opendir(source);
+    if(dir != NULL) {
+        char path[4096];
+        struct dirent* entry;
+        while(check == 0 && (entry = readdir(dir)) != NULL) {
+            struct stat st;
+            int len = snprintf(path, sizeof(path), "%s/%s", source, entry->d_name);
+            if(entry->d_name[0] != '.' && len > 0 && (size_t)len < sizeof(path)
+               && stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+                check = add_file(files, nb_files, &allocated, path, len);
+            }
+        }
+        closedir(dir);
+        if(check == 0 && *nb_files > 0) {
+            qsort(*files, *nb_files, sizeof(char*), compare_names);
+        }
+    } else {
+        FILE* list = fopen(source, "r");
+        if(list == NULL) {
+            return ERR_IO;
+        }
+        char* line = NULL;
+        size_t line_size = 0;
+        ssize_t len;
+        while(check == 0 && (len = getline(&line, &line_size, list)) != -1) {
+            while(len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+                len -= 1;
+            }
+            if(len > 0) {
+                check = add_file(files, nb_files, &allocated, line, len);
+            }
+        }
+        free(line);
+        fclose(list);
+    }
+
+    if(check != 0) {
+        free_file_list(*files, *nb_files);
+        *files = NULL;
+        *nb_files = 0;
+    }
+    return check;
+}
+
+/**
+ * @brief Free a list of names made by list_import_files.
+ *
+ * @param files The names.
+ * @param nb_files Number of names.
+ */
+void free_file_list(char** files, size_t nb_files)
+{
+    if(files != NULL) {
+        for(size_t i = 0; i < nb_files; i++) {
+            free(files[i]);
+        }
+        free(files);
+    }
+}
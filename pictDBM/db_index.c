@@ -0,0 +1,331 @@
+/**
+ * @file db_index.c
+ * @brief In-memory indexes over the metadata of an opened pictDB.
+ *
+ * The indexes are open-addressing hash tables (linear probing) storing
+ * positions in the metadata array, one keyed by pict_id and one keyed by
+ * SHA (several positions may share a SHA after de-duplication). They are
+ * built on first use after do_open (so that opening a mapped database does
+ * not touch the whole metadata) and kept up to date by do_insert and
+ * do_delete, so that lookups do not depend on header.max_files anymore.
+ *
+ * A bitmap of the empty positions is kept alongside, so that do_insert
+ * finds a free slot by skipping whole 64-bit words.
+ *
+ * The hashes are read from the columns of the metadata (db_columns.c),
+ * built with the indexes: probing only compares the id itself, or the
+ * whole SHA, when the 32 bits of their hashes kept there match.
+ *
+ * @date 16 October 2026
+ */
+
+#include "pictDB.h"
+#include "db_index.h"
+#include "db_columns.h"
+#include <stdlib.h>
+#include <string.h>
+
+/**
+* @brief Hash function used for the positions stored in a table.
+*/
+typedef uint64_t (*slot_hash)(const struct pictdb_file* db_file, uint32_t index);
+
+/**
+* @brief FNV-1a hash of at most MAX_PIC_ID characters of a picture id.
+* @param pict_id String of char identifying the image.
+* @return The hash value.
+*/
+uint64_t index_hash_id(const char* pict_id)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for(size_t i = 0; i < MAX_PIC_ID && pict_id[i] != '\0'; i++) {
+        hash ^= (unsigned char) pict_id[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+* @brief Hash of the picture id stored at a given position.
+*/
+static uint64_t hash_slot_id(const struct pictdb_file* db_file, uint32_t index)
+{
+    return db_file->columns.id_hash[index];
+}
+
+/**
+* @brief Hash of the content stored at a given position. The SHA is already
+* uniformly distributed, its first bytes are enough.
+*/
+static uint64_t hash_slot_sha(const struct pictdb_file* db_file, uint32_t index)
+{
+    return db_file->columns.sha_prefix[index];
+}
+
+/**
+* @brief Add a position to a table.
+* @param table The table.
+* @param mask Capacity of the table minus one.
+* @param hash Hash of the element stored at index.
+* @param index Position in the metadata.
+*/
+static void table_insert(uint32_t* table, uint32_t mask, uint64_t hash, uint32_t index)
+{
+    uint32_t pos = (uint32_t)hash & mask;
+    while(table[pos] != INDEX_NOT_FOUND) {
+        pos = (pos + 1) & mask;
+    }
+    table[pos] = index;
+}
+
+/**
+* @brief Remove a position from a table by shifting back the following
+* elements of its cluster (no tombstones needed).
+* @param db_file Pointer to a pictdb_file structure.
+* @param table The table.
+* @param mask Capacity of the table minus one.
+* @param hash_of Hash function of the table.
+* @param hash Hash of the element stored at index.
+* @param index Position in the metadata.
+*/
+static void table_remove(const struct pictdb_file* db_file, uint32_t* table, uint32_t mask,
+                         slot_hash hash_of, uint64_t hash, uint32_t index)
+{
+    uint32_t hole = (uint32_t)hash & mask;
+    while(table[hole] != index) {
+        if(table[hole] == INDEX_NOT_FOUND) {
+            return;
+        }
+        hole = (hole + 1) & mask;
+    }
+
+    uint32_t pos = hole;
+    for(;;) {
+        pos = (pos + 1) & mask;
+        if(table[pos] == INDEX_NOT_FOUND) {
+            break;
+        }
+        uint32_t home = (uint32_t)hash_of(db_file, table[pos]) & mask;
+        //Move the element iff its home position is not between the hole and itself
+        int between = (hole <= pos) ? (hole < home && home <= pos) : (hole < home || home <= pos);
+        if(!between) {
+            table[hole] = table[pos];
+            hole = pos;
+        }
+    }
+    table[hole] = INDEX_NOT_FOUND;
+}
+
+/**
+* @brief Mark a position as empty or used in the bitmap of empty positions.
+* @param index Pointer to the indexes.
+* @param pos Position in the metadata.
+* @param empty 1 if the position becomes empty, 0 otherwise.
+*/
+static void set_free(struct pict_index* index, uint32_t pos, int empty)
+{
+    uint32_t word = pos / 64;
+    uint64_t bit = UINT64_C(1) << (pos % 64);
+    if(empty) {
+        index->free_slots[word] |= bit;
+        if(word < index->free_hint) {
+            index->free_hint = word;
+        }
+    } else {
+        index->free_slots[word] &= ~bit;
+    }
+}
+
+/**
+* @brief Build the indexes from the metadata of the database.
+* @param db_file Pointer to a pictdb_file structure with its metadata loaded.
+* @return 0 if no error occurs, otherwise an error.
+*/
+int index_build(struct pictdb_file* db_file)
+{
+    if(db_file == NULL || db_file->metadata == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    index_free(db_file);
+    int check = columns_ensure(db_file);
+    if(check != 0) {
+        return check;
+    }
+
+    //Capacity: power of two, at least twice max_files to keep the clusters short
+    uint32_t capacity = 16;
+    while(capacity < 2 * (uint64_t)db_file->header.max_files) {
+        capacity *= 2;
+    }
+
+    db_file->index.id_table = malloc(capacity * sizeof(uint32_t));
+    db_file->index.sha_table = malloc(capacity * sizeof(uint32_t));
+    db_file->index.free_words = (db_file->header.max_files + 63) / 64;
+    db_file->index.free_slots = calloc(db_file->index.free_words + 1, sizeof(uint64_t));
+    if(db_file->index.id_table == NULL || db_file->index.sha_table == NULL
+       || db_file->index.free_slots == NULL) {
+        index_free(db_file);
+        return ERR_OUT_OF_MEMORY;
+    }
+    memset(db_file->index.id_table, 0xff, capacity * sizeof(uint32_t));
+    memset(db_file->index.sha_table, 0xff, capacity * sizeof(uint32_t));
+    db_file->index.capacity = capacity;
+    db_file->index.free_hint = 0;
+
+    uint32_t mask = capacity - 1;
+    const struct pict_columns* columns = &db_file->columns;
+    for(uint32_t i = 0; i < db_file->header.max_files; i++) {
+        if((columns->valid[i / 64] >> (i % 64)) & 1) {
+            table_insert(db_file->index.id_table, mask, columns->id_hash[i], i);
+            table_insert(db_file->index.sha_table, mask, columns->sha_prefix[i], i);
+        } else {
+            set_free(&db_file->index, i, 1);
+        }
+    }
+    return 0;
+}
+
+/**
+* @brief Build the indexes if it was not done yet.
+* @param db_file Pointer to a pictdb_file structure.
+* @return 0 if the indexes are available, otherwise an error.
+*/
+static int index_ensure(struct pictdb_file* db_file)
+{
+    if(db_file->index.id_table != NULL) {
+        return 0;
+    }
+    return index_build(db_file);
+}
+
+/**
+* @brief Free the memory used by the indexes.
+* @param db_file Pointer to a pictdb_file structure.
+*/
+void index_free(struct pictdb_file* db_file)
+{
+    if(db_file != NULL) {
+        free(db_file->index.id_table);
+        db_file->index.id_table = NULL;
+        free(db_file->index.sha_table);
+        db_file->index.sha_table = NULL;
+        free(db_file->index.free_slots);
+        db_file->index.free_slots = NULL;
+        db_file->index.free_words = 0;
+        db_file->index.capacity = 0;
+    }
+}
+
+/**
+* @brief Find the position of a valid picture in the metadata.
+* @param db_file Pointer to a pictdb_file structure.
+* @param pict_id String of char identifying the image.
+* @return The position of the image, or INDEX_NOT_FOUND.
+*/
+uint32_t index_find_id(struct pictdb_file* db_file, const char* pict_id)
+{
+    if(db_file == NULL || pict_id == NULL || index_ensure(db_file) != 0) {
+        return INDEX_NOT_FOUND;
+    }
+    uint64_t hash = index_hash_id(pict_id);
+    uint32_t mask = db_file->index.capacity - 1;
+    uint32_t pos = (uint32_t)hash & mask;
+    while(db_file->index.id_table[pos] != INDEX_NOT_FOUND) {
+        uint32_t index = db_file->index.id_table[pos];
+        if(db_file->columns.id_hash[index] == (uint32_t)hash
+           && !strncmp(db_file->metadata[index].pict_id, pict_id, MAX_PIC_ID)) {
+            return index;
+        }
+        pos = (pos + 1) & mask;
+    }
+    return INDEX_NOT_FOUND;
+}
+
+/**
+* @brief Find a valid picture with the given content.
+* @param db_file Pointer to a pictdb_file structure.
+* @param SHA SHA-256 hash of the content.
+* @param except Position to ignore (the image being inserted).
+* @return The position of an image with this content, or INDEX_NOT_FOUND.
+*/
+uint32_t index_find_sha(struct pictdb_file* db_file, const unsigned char SHA[SHA256_DIGEST_LENGTH],
+                        uint32_t except)
+{
+    if(db_file == NULL || SHA == NULL || index_ensure(db_file) != 0) {
+        return INDEX_NOT_FOUND;
+    }
+    uint32_t hash = 0;
+    memcpy(&hash, SHA, sizeof(hash));
+    uint32_t mask = db_file->index.capacity - 1;
+    uint32_t pos = (uint32_t)hash & mask;
+    while(db_file->index.sha_table[pos] != INDEX_NOT_FOUND) {
+        uint32_t index = db_file->index.sha_table[pos];
+        if(index != except && db_file->columns.sha_prefix[index] == hash
+           && !memcmp(db_file->metadata[index].SHA, SHA, SHA256_DIGEST_LENGTH)) {
+            return index;
+        }
+        pos = (pos + 1) & mask;
+    }
+    return INDEX_NOT_FOUND;
+}
+
+/**
+* @brief Find an empty position in the metadata.
+* @param db_file Pointer to a pictdb_file structure.
+* @return The lowest empty position, or INDEX_NOT_FOUND if the database is full.
+*/
+uint32_t index_find_free(struct pictdb_file* db_file)
+{
+    if(db_file == NULL || index_ensure(db_file) != 0) {
+        return INDEX_NOT_FOUND;
+    }
+    struct pict_index* index = &db_file->index;
+    while(index->free_hint < index->free_words && index->free_slots[index->free_hint] == 0) {
+        index->free_hint += 1;
+    }
+    if(index->free_hint >= index->free_words) {
+        return INDEX_NOT_FOUND;
+    }
+    return index->free_hint * 64 + (uint32_t)__builtin_ctzll(index->free_slots[index->free_hint]);
+}
+
+/**
+* @brief Add a picture which just became valid to the indexes.
+* @param db_file Pointer to a pictdb_file structure.
+* @param index Position of the image in the metadata.
+*/
+void index_insert(struct pictdb_file* db_file, uint32_t index)
+{
+    if(db_file == NULL) {
+        return;
+    }
+    //A first build already takes the new picture into account
+    if(db_file->index.id_table == NULL) {
+        (void)index_ensure(db_file);
+        return;
+    }
+    //Not written yet: its columns are brought up to date first
+    columns_update(db_file, index, 1);
+    table_insert(db_file->index.id_table, db_file->index.capacity - 1,
+                 hash_slot_id(db_file, index), index);
+    table_insert(db_file->index.sha_table, db_file->index.capacity - 1,
+                 hash_slot_sha(db_file, index), index);
+    set_free(&db_file->index, index, 0);
+}
+
+/**
+* @brief Remove a picture from the indexes, before it is marked as invalid.
+* @param db_file Pointer to a pictdb_file structure.
+* @param index Position of the image in the metadata.
+*/
+void index_remove(struct pictdb_file* db_file, uint32_t index)
+{
+    if(db_file == NULL || index_ensure(db_file) != 0) {
+        return;
+    }
+    table_remove(db_file, db_file->index.id_table, db_file->index.capacity - 1,
+                 hash_slot_id, hash_slot_id(db_file, index), index);
+    table_remove(db_file, db_file->index.sha_table, db_file->index.capacity - 1,
+                 hash_slot_sha, hash_slot_sha(db_file, index), index);
+    set_free(&db_file->index, index, 1);
+}
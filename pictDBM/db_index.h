@@ -0,0 +1,84 @@
+/**
+ * @file db_index.h
+ * @brief In-memory indexes over the metadata of an opened pictDB.
+ *
+ * @date 16 October 2026
+ */
+
+#ifndef DB_INDEX_H
+#define DB_INDEX_H
+
+#include "pictDB.h"
+
+/* Returned by the lookup functions when no slot matches */
+#define INDEX_NOT_FOUND UINT32_MAX
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+* @brief Build the indexes from the metadata of the database. The lookup
+* functions call it themselves on first use.
+* @param db_file Pointer to a pictdb_file structure with its metadata loaded.
+* @return 0 if no error occurs, otherwise an error.
+*/
+int index_build(struct pictdb_file* db_file);
+
+/**
+* @brief Free the memory used by the indexes.
+* @param db_file Pointer to a pictdb_file structure.
+*/
+void index_free(struct pictdb_file* db_file);
+
+/**
+* @brief Find the position of a valid picture in the metadata.
+* @param db_file Pointer to a pictdb_file structure.
+* @param pict_id String of char identifying the image.
+* @return The position of the image, or INDEX_NOT_FOUND.
+*/
+uint32_t index_find_id(struct pictdb_file* db_file, const char* pict_id);
+
+/**
+* @brief Find a valid picture with the given content.
+* @param db_file Pointer to a pictdb_file structure.
+* @param SHA SHA-256 hash of the content.
+* @param except Position to ignore (the image being inserted).
+* @return The position of an image with this content, or INDEX_NOT_FOUND.
+*/
+uint32_t index_find_sha(struct pictdb_file* db_file, const unsigned char SHA[SHA256_DIGEST_LENGTH],
+                        uint32_t except);
+
+/**
+* @brief Hash of a picture id, the one stored in the compact records.
+* @param pict_id String of char identifying the image (at most MAX_PIC_ID
+* characters are hashed).
+* @return The hash value.
+*/
+uint64_t index_hash_id(const char* pict_id);
+
+/**
+* @brief Find an empty position in the metadata.
+* @param db_file Pointer to a pictdb_file structure.
+* @return The lowest empty position, or INDEX_NOT_FOUND if the database is full.
+*/
+uint32_t index_find_free(struct pictdb_file* db_file);
+
+/**
+* @brief Add a picture which just became valid to the indexes.
+* @param db_file Pointer to a pictdb_file structure.
+* @param index Position of the image in the metadata.
+*/
+void index_insert(struct pictdb_file* db_file, uint32_t index);
+
+/**
+* @brief Remove a picture from the indexes, before it is marked as invalid.
+* @param db_file Pointer to a pictdb_file structure.
+* @param index Position of the image in the metadata.
+*/
+void index_remove(struct pictdb_file* db_file, uint32_t index);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -8,19 +8,21 @@
 #include "pictDB.h"
 #include "image_content.h"
 #include "dedup.h"
+#include "db_index.h"
+#include "db_extent.h"
+#include "db_record.h"
 #include <string.h>
 
 /**
-* @brief Function that get the image resolution and write it in memory.
+* @brief Function that get the image resolution and write it in the metadata.
 *
 * @param img "table" of character (used as bytes).
 * @param size The image size.
-* @param db_file Data base in which we add the image.
-* @param index Position of the image.
+* @param metadata The metadata of the image.
 *
 * @return 0 or an error code if an error occurs.
 */
-int write_resolutions(const char* img, const size_t size, struct pictdb_file* db_file, size_t index)
+int write_resolutions(const char* img, const size_t size, struct pict_metadata* metadata)
 {
     uint32_t width;
     uint32_t height;
@@ -28,8 +30,8 @@ int write_resolutions(const char* img, const size_t size, struct pictdb_file* db
     if(return_value != 0) {
         return return_value;
     }
-    db_file->metadata[index].res_orig[0] = width;
-    db_file->metadata[index].res_orig[1] = height;
+    metadata->res_orig[0] = width;
+    metadata->res_orig[1] = height;
 
     return 0;
 }
@@ -37,64 +39,53 @@ int write_resolutions(const char* img, const size_t size, struct pictdb_file* db
 /**
 * @brief Function that update the memory when we insert an image.
 *
+* The metadata only goes to the table once the image is written: with a
+* mapped database, the table is the file.
+*
 * @param img "table" of character (used as bytes).
 * @param size The image size.
 * @param db_file Data base in which we add the image.
 * @param index Position of the image.
+* @param metadata The metadata of the image, its resolution already set.
 *
 * @return 0 or an error code if an error occurs.
 */
-int update_memory_and_content(const char* img, const size_t size, struct pictdb_file* db_file, size_t index)
+int update_memory_and_content(const char* img, const size_t size, struct pictdb_file* db_file, size_t index,
+                              struct pict_metadata* metadata)
 {
     int check = 0;
 
-    //We write the image at the end of the file iff it was not already there.
-    if(db_file->metadata[index].offset[RES_ORIG] == 0) {
-        //Cursor at the end of the file
-        if(fseek(db_file->fpdb, 0, SEEK_END) != 0) {
-            return ERR_IO;
-        }
-        //Get the cursor position before writing
-        long int cursorPosition = ftell(db_file->fpdb);
-        //Write the image at the end of the file.
-        if(fwrite(img, size, 1, db_file->fpdb) != 1) {
-            return ERR_IO;
+    //We write the image iff it was not already there.
+    if(metadata->offset[RES_ORIG] == 0) {
+        //Write the image in a free extent or at the end of the file and update the metadata.
+        check = db_write_content(db_file, img, size, &metadata->offset[RES_ORIG]);
+        if(check != 0) {
+            return check;
         }
-        //Update the metadata
-        db_file->metadata[index].offset[RES_ORIG] = cursorPosition;
-    }
-
-    //Write the resolutions in the new metadata
-    check = write_resolutions(img, size, db_file, index);
-    if (check != 0) {
-        return check;
     }
+    db_file->metadata[index] = *metadata;
 
     //Update the header
     db_file->header.num_files += 1;
     db_file->header.db_version += 1;
 
     //Write the uptaded header on the disk
-    if(fseek(db_file->fpdb, 0, SEEK_SET) != 0) {
-        return ERR_IO;
-    }
-    if(fwrite(&db_file->header, sizeof(struct pictdb_header), 1 , db_file->fpdb) != 1) {
-        return ERR_IO;
+    check = write_header(db_file);
+    if(check != 0) {
+        return check;
     }
 
     //Write the updated metadata on disk
-    if(fseek(db_file->fpdb, index * sizeof(struct pict_metadata), SEEK_CUR) != 0) {
-        return ERR_IO;
-    }
-    if(fwrite(&db_file->metadata[index], sizeof(struct pict_metadata), 1 , db_file->fpdb) != 1) {
-        return ERR_IO;
+    check = write_metadata(db_file, index);
+    if(check != 0) {
+        return check;
     }
-
-    return 0;
+    return db_commit(db_file);
 }
 
 /**
- * @brief Function that inserts an image in a data base.
+ * @brief Function that inserts an image in a data base. With the
+ * VARIANTS_SYNC policy, its thumbnail and small images are created too.
  *
  * @param img "table" of character (used as bytes).
  * @param size The image size.
@@ -114,42 +105,49 @@ int do_insert(const char* img, const size_t size, const char* pict_id, struct pi
     }
 
     //check that this pict_id does not already exist
-    for(size_t i = 0; i < db_file->header.max_files; i++) {
-        if(db_file->metadata[i].is_valid == NON_EMPTY) {
-            if(!strncmp(db_file->metadata[i].pict_id, pict_id, MAX_PIC_ID)) {
-                return ERR_DUPLICATE_ID;
-            }
-        }
+    if(index_find_id(db_file, pict_id) != INDEX_NOT_FOUND) {
+        return ERR_DUPLICATE_ID;
     }
 
-    size_t index = 0;
-
-    while(index < db_file->header.max_files && db_file->metadata[index].is_valid == NON_EMPTY) {
-        index += 1;
+    size_t index = record_find_free(db_file, pict_id);
+    if(index == INDEX_NOT_FOUND) {
+        return ERR_FULL_DATABASE;
     }
-    (void)SHA256((unsigned char *)img, size, db_file->metadata[index].SHA);
-    if(strncpy(db_file->metadata[index].pict_id, pict_id, MAX_PIC_ID) == NULL) {
+    struct pict_metadata metadata;
+    memset(&metadata, 0, sizeof(struct pict_metadata));
+    (void)SHA256((unsigned char *)img, size, metadata.SHA);
+    if(strncpy(metadata.pict_id, pict_id, MAX_PIC_ID) == NULL) {
         return ERR_INVALID_ARGUMENT;
     }
 
-    db_file->metadata[index].size[RES_ORIG] = size;
-    db_file->metadata[index].size[RES_THUMB] = 0;
-    db_file->metadata[index].size[RES_SMALL] = 0;
-    db_file->metadata[index].offset[RES_THUMB] = 0;
-    db_file->metadata[index].offset[RES_SMALL] = 0;
-    db_file->metadata[index].is_valid = NON_EMPTY;
+    metadata.size[RES_ORIG] = size;
+    metadata.is_valid = NON_EMPTY;
 
-    int check = 0;
-    check = do_name_and_content_dedup(db_file, index);
+    //Before anything is written or counted, so that an image which is not one leaves no trace
+    int check = write_resolutions(img, size, &metadata);
     if(check != 0) {
         return check;
     }
 
-    check = update_memory_and_content(img, size, db_file, index);
+    check = do_name_and_content_dedup(db_file, &metadata, index);
     if(check != 0) {
         return check;
     }
 
+    check = update_memory_and_content(img, size, db_file, index, &metadata);
+    if(check != 0) {
+        return check;
+    }
+
+    index_insert(db_file, index);
+    for(size_t res = 0; res < NB_RES; res++) {
+        (void)blob_ref(db_file, db_file->metadata[index].offset[res]);
+    }
+
+    //The image is stored anyway: if it cannot be resized now, it will be on read
+    if(variants_policy(&db_file->header) == VARIANTS_SYNC) {
+        (void)create_variants(db_file, index, ALL_VARIANTS);
+    }
     return 0;
 }
 
@@ -0,0 +1,392 @@
+/**
+ * @file db_journal.c
+ * @brief Write-ahead journal of the header and metadata of a pictDB.
+ *
+ * When the write-back syncs the database (fsync policy other than
+ * FSYNC_NONE), every flush first appends the new header and metadata to
+ * "<database>.journal", followed by a commit record, and syncs the journal
+ * once for the whole batch (with compact records, the pages holding the
+ * new metadata are appended instead, see db_record.c). The records are then written in place, which
+ * is only synced when the journal is checkpointed (truncated), once it is
+ * large enough or when the database is closed.
+ *
+ * The contents of the images are appended to the database and synced
+ * before the records which refer to them, so a committed record never
+ * points to missing bytes. After a crash, do_open writes the committed
+ * records in place again and recounts num_files from the valid metadata.
+ *
+ * @date 16 October 2026
+ */
+
+#define _POSIX_C_SOURCE 200809L // for pread, pwrite, fdatasync
+
+#include "pictDB.h"
+#include "db_segment.h"
+#include "db_record.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define JOURNAL_MAGIC      0x4C4E524Au // "JRNL"
+#define JOURNAL_HEADER     UINT32_MAX       // index of a header record
+#define JOURNAL_COMMIT     (UINT32_MAX - 1) // index of a commit record
+#define JOURNAL_CHECKPOINT (4 * 1024 * 1024) // journal size triggering a checkpoint
+
+/**
+* @brief Beginning of a journal record, followed by length bytes.
+*/
+struct journal_record {
+    uint32_t magic;
+    uint32_t index;    // position of the metadata (or page), JOURNAL_HEADER or JOURNAL_COMMIT
+    uint32_t length;   // size of what follows
+    uint32_t checksum; // of index, length and what follows
+};
+
+/**
+* @brief FNV-1a hash of a record, used to detect torn writes.
+*/
+static uint32_t record_checksum(uint32_t index, uint32_t length, const void* payload)
+{
+    uint32_t hash = 2166136261u;
+    const unsigned char* fields[2] = {(const unsigned char*)&index, (const unsigned char*)&length};
+    for(size_t f = 0; f < 2; f++) {
+        for(size_t i = 0; i < sizeof(uint32_t); i++) {
+            hash = (hash ^ fields[f][i]) * 16777619u;
+        }
+    }
+    const unsigned char* bytes = payload;
+    for(size_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+* @brief Add a record to a buffer of records.
+*/
+static char* put_record(char* dst, uint32_t index, const void* payload, uint32_t length)
+{
+    struct journal_record record = {JOURNAL_MAGIC, index, length, record_checksum(index, length, payload)};
+    memcpy(dst, &record, sizeof(record));
+    if(length > 0) {
+        memcpy(dst + sizeof(record), payload, length);
+    }
+    return dst + sizeof(record) + length;
+}
+
+/**
+* @brief Write a whole buffer at a given position of a file.
+*/
+static int pwrite_all(int fd, const void* buf, size_t len, uint64_t offset)
+{
+    const char* src = buf;
+    while(len > 0) {
+        ssize_t n = pwrite(fd, src, len, (off_t)offset);
+        if(n <= 0) {
+            return ERR_IO;
+        }
+        src += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/**
+* @brief Read a whole buffer at a given position of a file.
+*/
+static int pread_all(int fd, void* buf, size_t len, uint64_t offset)
+{
+    char* dst = buf;
+    while(len > 0) {
+        ssize_t n = pread(fd, dst, len, (off_t)offset);
+        if(n <= 0) {
+            return ERR_IO;
+        }
+        dst += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+/**
+* @brief Name of the journal of a database (to be freed).
+*/
+static char* journal_name(const char* file_name)
+{
+    size_t len = strlen(file_name);
+    char* name = malloc(len + sizeof(".journal"));
+    if(name != NULL) {
+        memcpy(name, file_name, len);
+        memcpy(name + len, ".journal", sizeof(".journal"));
+    }
+    return name;
+}
+
+/**
+ * @brief Prepare the journal of a database; nothing is created until the
+ * first journal_commit.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param file_name Name of the database file.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int journal_init(struct pictdb_file* db_file, const char* file_name)
+{
+    db_file->journal.fd = -1;
+    db_file->journal.size = 0;
+    db_file->journal.name = journal_name(file_name);
+    return db_file->journal.name == NULL ? ERR_OUT_OF_MEMORY : 0;
+}
+
+/**
+* @brief Apply the records of one committed change to the database file.
+*/
+static int apply_records(int fd, const struct pictdb_header* header, const char* records, const char* end)
+{
+    size_t unit = has_compact_records(header) ? RECORD_PAGE : sizeof(struct pict_metadata);
+    uint64_t nb_units = (table_end(header, header->max_files) - sizeof(struct pictdb_header)) / unit;
+    while(records < end) {
+        struct journal_record record;
+        memcpy(&record, records, sizeof(record));
+        const char* payload = records + sizeof(record);
+        int check = 0;
+        if(record.index == JOURNAL_HEADER) {
+            check = pwrite_all(fd, payload, record.length, 0);
+        } else if(record.index < nb_units) {
+            check = pwrite_all(fd, payload, record.length, sizeof(struct pictdb_header) + (uint64_t)record.index * unit);
+        }
+        if(check != 0) {
+            return check;
+        }
+        records = payload + record.length;
+    }
+    return 0;
+}
+
+/**
+* @brief Make num_files match the valid metadata, which may have reached
+* the disk without their header.
+*/
+static int recount_files(int fd)
+{
+    struct pictdb_header header;
+    int check = pread_all(fd, &header, sizeof(header), 0);
+    if(check != 0 || header.max_files > max_files_limit(&header)) {
+        return check != 0 ? check : ERR_IO;
+    }
+    size_t table_size = table_end(&header, header.max_files) - sizeof(header);
+    char* table = malloc(table_size);
+    if(table == NULL && table_size > 0) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    check = pread_all(fd, table, table_size, sizeof(header));
+    uint32_t valid = check == 0 ? count_valid(&header, table) : 0;
+    free(table);
+    if(check == 0 && valid != header.num_files) {
+        header.num_files = valid;
+        header.db_version += 1;
+        check = pwrite_all(fd, &header, sizeof(header), 0);
+    }
+    return check;
+}
+
+/**
+ * @brief Recover a database after a crash: the committed records of its
+ * journal are written in place, num_files is recounted, and the journal
+ * is removed. Nothing is done if there is no journal.
+ *
+ * @param file_name Name of the database file.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int journal_replay(const char* file_name)
+{
+    char* name = journal_name(file_name);
+    if(name == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    int journal = open(name, O_RDONLY);
+    if(journal == -1) {
+        free(name);
+        return 0;
+    }
+    int fd = open(file_name, O_RDWR);
+    struct stat st;
+    char* records = NULL;
+    int check = (fd == -1 || fstat(journal, &st) != 0) ? ERR_IO : 0;
+    if(check == 0 && st.st_size > 0) {
+        records = malloc(st.st_size);
+        check = records == NULL ? ERR_OUT_OF_MEMORY : pread_all(journal, records, st.st_size, 0);
+    }
+
+    struct pictdb_header header;
+    if(check == 0) {
+        check = pread_all(fd, &header, sizeof(header), 0);
+    }
+    //Apply each change whose commit record was reached, stop at the first torn record
+    size_t pos = 0;
+    size_t change = 0;
+    while(check == 0 && records != NULL && pos + sizeof(struct journal_record) <= (size_t)st.st_size) {
+        struct journal_record record;
+        memcpy(&record, records + pos, sizeof(record));
+        const char* payload = records + pos + sizeof(record);
+        if(record.magic != JOURNAL_MAGIC || record.length > (size_t)st.st_size - pos - sizeof(record)
+           || record.checksum != record_checksum(record.index, record.length, payload)) {
+            break;
+        }
+        if(record.index == JOURNAL_HEADER && record.length == sizeof(header)) {
+            memcpy(&header, payload, sizeof(header));
+        }
+        pos += sizeof(record) + record.length;
+        if(record.index == JOURNAL_COMMIT) {
+            check = apply_records(fd, &header, records + change, records + pos - sizeof(record));
+            change = pos;
+        }
+    }
+    free(records);
+
+    if(check == 0) {
+        check = recount_files(fd);
+    }
+    if(check == 0 && fdatasync(fd) != 0) {
+        check = ERR_IO;
+    }
+    if(check == 0) {
+        unlink(name);
+    }
+    if(fd != -1) {
+        close(fd);
+    }
+    close(journal);
+    free(name);
+    return check;
+}
+
+/**
+ * @brief Append the pending header and metadata to the journal, with a
+ * commit record, and sync it. The contents of the images are synced first.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int journal_commit(struct pictdb_file* db_file)
+{
+    struct journal* journal = &db_file->journal;
+    struct write_back* write_back = &db_file->write_back;
+    if(journal->name == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if(journal->fd == -1) {
+        journal->fd = open(journal->name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if(journal->fd == -1) {
+            return ERR_IO;
+        }
+        journal->size = 0;
+    }
+
+    int compact = has_compact_records(&db_file->header);
+    uint32_t nb_pages = (db_file->header.max_files + RECORDS_PER_PAGE - 1) / RECORDS_PER_PAGE;
+    uint32_t nb_dirty_pages = 0;
+    for(uint32_t page = 0; compact && write_back->nb_dirty > 0 && page < nb_pages; page++) {
+        nb_dirty_pages += record_page_dirty(write_back, page) != 0;
+    }
+    size_t len = sizeof(struct journal_record)
+                 + (compact ? nb_dirty_pages * (sizeof(struct journal_record) + RECORD_PAGE)
+                    : write_back->nb_dirty * (sizeof(struct journal_record) + sizeof(struct pict_metadata)));
+    if(write_back->header_dirty) {
+        len += sizeof(struct journal_record) + sizeof(struct pictdb_header);
+    }
+    char* records = malloc(len);
+    if(records == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    char* end = records;
+    int check = 0;
+    for(uint32_t page = 0; nb_dirty_pages > 0 && page < nb_pages && check == 0; page++) {
+        if(record_page_dirty(write_back, page) != 0) {
+            char encoded[RECORD_PAGE];
+            check = record_encode_page(db_file, page, encoded);
+            end = put_record(end, page, encoded, RECORD_PAGE);
+        }
+    }
+    for(uint32_t i = 0; !compact && write_back->nb_dirty > 0 && i < db_file->header.max_files; i++) {
+        if((write_back->dirty[i / 64] >> (i % 64)) & 1) {
+            end = put_record(end, i, &db_file->metadata[i], sizeof(struct pict_metadata));
+        }
+    }
+    if(write_back->header_dirty) {
+        end = put_record(end, JOURNAL_HEADER, &db_file->header, sizeof(struct pictdb_header));
+    }
+    end = put_record(end, JOURNAL_COMMIT, NULL, 0);
+
+    //The contents first: a committed record never refers to missing bytes
+    if(check == 0 && fdatasync(db_file->fd) != 0) {
+        check = ERR_IO;
+    }
+    if(check == 0) {
+        check = segment_sync(db_file);
+    }
+    if(check == 0) {
+        check = pwrite_all(journal->fd, records, end - records, journal->size);
+    }
+    if(check == 0 && fdatasync(journal->fd) != 0) {
+        check = ERR_IO;
+    }
+    if(check == 0) {
+        journal->size += end - records;
+    }
+    free(records);
+    return check;
+}
+
+/**
+ * @brief Sync the database file and empty the journal, if it is large
+ * enough (or always if force is 1).
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param force 1 to checkpoint whatever the size of the journal.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int journal_checkpoint(struct pictdb_file* db_file, int force)
+{
+    struct journal* journal = &db_file->journal;
+    if(journal->fd == -1 || journal->size == 0 || (!force && journal->size < JOURNAL_CHECKPOINT)) {
+        return 0;
+    }
+    int check = db_sync_file(db_file);
+    if(check != 0) {
+        return check;
+    }
+    if(ftruncate(journal->fd, 0) != 0 || fdatasync(journal->fd) != 0) {
+        return ERR_IO;
+    }
+    journal->size = 0;
+    return 0;
+}
+
+/**
+ * @brief Close the journal: after a checkpoint, it is removed; otherwise it
+ * is kept to be replayed by the next do_open.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ */
+void journal_close(struct pictdb_file* db_file)
+{
+    struct journal* journal = &db_file->journal;
+    if(journal->fd != -1) {
+        if(journal_checkpoint(db_file, 1) == 0) {
+            unlink(journal->name);
+        }
+        close(journal->fd);
+        journal->fd = -1;
+    }
+    free(journal->name);
+    journal->name = NULL;
+}
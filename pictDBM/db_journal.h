@@ -0,0 +1,70 @@
+/**
+ * @file db_journal.h
+ * @brief Write-ahead journal of the header and metadata of a pictDB.
+ *
+ * @date 16 October 2026
+ */
+#ifndef DB_JOURNAL_H
+#define DB_JOURNAL_H
+
+#include "pictDB.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Recover a database after a crash: the committed records of its
+ * journal are written in place, num_files is recounted, and the journal
+ * is removed. Nothing is done if there is no journal.
+ *
+ * @param file_name Name of the database file.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int journal_replay(const char* file_name);
+
+/**
+ * @brief Prepare the journal of a database; nothing is created until the
+ * first journal_commit.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param file_name Name of the database file.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int journal_init(struct pictdb_file* db_file, const char* file_name);
+
+/**
+ * @brief Append the pending header and metadata to the journal, with a
+ * commit record, and sync it. The contents of the images are synced first.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int journal_commit(struct pictdb_file* db_file);
+
+/**
+ * @brief Sync the database file and empty the journal, if it is large
+ * enough (or always if force is 1).
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param force 1 to checkpoint whatever the size of the journal.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int journal_checkpoint(struct pictdb_file* db_file, int force);
+
+/**
+ * @brief Close the journal: after a checkpoint, it is removed; otherwise it
+ * is kept to be replayed by the next do_open.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ */
+void journal_close(struct pictdb_file* db_file);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
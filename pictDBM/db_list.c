@@ -7,10 +7,32 @@
  */
 
 #include "pictDB.h"
+#include "db_columns.h"
+#include <inttypes.h> // for PRIu64
 #include <string.h>
 #include <stdlib.h>
 #include <json-c/json.h>
 
+/**
+ * @brief Next valid metadata, from the columns when they are built (a
+ * server builds them with its indexes), from the metadata otherwise.
+ *
+ * @param file In memory structure with header and metadata.
+ * @param index Position from which to look.
+ *
+ * @return The position, or max_files if there is none.
+ */
+static size_t next_valid(const struct pictdb_file* file, size_t index)
+{
+    if(file->columns.valid != NULL) {
+        return column_next_valid(&file->columns, (uint32_t)index);
+    }
+    while(index < file->header.max_files && file->metadata[index].is_valid != NON_EMPTY) {
+        index += 1;
+    }
+    return index;
+}
+
 /**
  * @brief Displays pictDB metadata.
  * @brief format in which we return the output.
@@ -23,11 +45,10 @@ const char* do_list (const struct pictdb_file* file, enum do_list_mode format)
 {
     if(format == STDOUT) {
         print_header(&file->header);
+        printf("LIVE BYTES: %" PRIu64 "\t\tDEAD BYTES: %" PRIu64 "\n", live_bytes(file), file->header.dead_bytes);
         if(file->header.num_files != 0) {
-            for(size_t i = 0; i < file->header.max_files ; i++) {
-                if(file->metadata[i].is_valid == NON_EMPTY) {
-                    print_metadata(&file->metadata[i]);
-                }
+            for(size_t i = next_valid(file, 0); i < file->header.max_files; i = next_valid(file, i + 1)) {
+                print_metadata(&file->metadata[i]);
             }
         } else {
             printf("<< empty database >>\n");
@@ -37,11 +58,9 @@ const char* do_list (const struct pictdb_file* file, enum do_list_mode format)
         struct json_object* object = json_object_new_object();
         struct json_object* array = json_object_new_array();
 
-        for(size_t i = 0; i < file->header.max_files ; i++) {
-            if(file->metadata[i].is_valid != EMPTY) {
-                struct json_object* string =  json_object_new_string(file->metadata[i].pict_id);
-                json_object_array_add(array, string);
-            }
+        for(size_t i = next_valid(file, 0); i < file->header.max_files; i = next_valid(file, i + 1)) {
+            struct json_object* string =  json_object_new_string(file->metadata[i].pict_id);
+            json_object_array_add(array, string);
         }
         json_object_object_add(object, "Pictures", array);
         const char* string = json_object_to_json_string(object);
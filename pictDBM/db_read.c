@@ -6,9 +6,32 @@
  */
 #include "pictDB.h"
 #include "image_content.h" //for lazily_resize
+#include "db_index.h" //for index_find_id
 #include <string.h>
 #include <stdlib.h>
 
+/**
+* @brief Function that tells whether do_read has to create the image before
+* reading it (and thus writes to the database).
+*
+* @param pict_id String of char identifying the image.
+* @param res Code of an image resolution.
+* @param db_file Data base.
+*
+* @return 1 if the image must be created, 0 otherwise (also if it does not exist).
+*/
+int read_needs_resize(const char* pict_id, const int res, struct pictdb_file* db_file)
+{
+    if(pict_id == NULL || db_file == NULL || res < 0 || res >= NB_RES) {
+        return 0;
+    }
+    uint32_t index = index_find_id(db_file, pict_id);
+    if(index == INDEX_NOT_FOUND) {
+        return 0;
+    }
+    return db_file->metadata[index].offset[res] == 0 || db_file->metadata[index].size[res] == 0;
+}
+
 /**
 * @brief Function that read an image and copies it in a "table" of bytes.
 *
@@ -26,16 +49,9 @@ int do_read(const char* pict_id, const int res, char** data, uint32_t* pict_size
         return ERR_INVALID_ARGUMENT;
     }
     int check = 0;
-    size_t index = 0;   //Position of the image to delete
-    while(strcmp(pict_id, db_file->metadata[index].pict_id) != 0 && index < db_file->header.max_files) {
-        index += 1;
-        while(db_file->metadata[index].is_valid == EMPTY && index < db_file->header.max_files) { //Skip the non valid metadatas
-            index += 1;
-        }
-    }
+    size_t index = index_find_id(db_file, pict_id);   //Position of the image to read
 
-    //If index == db_file->header.max_files, the image is not in the metadatas
-    if(index >= db_file->header.max_files) {
+    if(index == INDEX_NOT_FOUND) {
         return ERR_FILE_NOT_FOUND;
     }
 
@@ -46,10 +62,6 @@ int do_read(const char* pict_id, const int res, char** data, uint32_t* pict_size
         }
     }
 
-    if(fseek(db_file->fpdb, db_file->metadata[index].offset[res], SEEK_SET) != 0) {
-        return ERR_IO;
-    }
-
     //Taille de l'image connue avec lazily_resize
     *pict_size = db_file->metadata[index].size[res];
 
@@ -58,8 +70,10 @@ int do_read(const char* pict_id, const int res, char** data, uint32_t* pict_size
         return ERR_OUT_OF_MEMORY;
     }
 
-    if(fread(p, *pict_size, 1, db_file->fpdb) != 1) {
-        return ERR_IO;
+    check = db_pread(db_file, p, *pict_size, db_file->metadata[index].offset[res]);
+    if(check != 0) {
+        free(p);
+        return check;
     }
     *data = p;
 
@@ -0,0 +1,328 @@
+/**
+ * @file db_record.c
+ * @brief Compact records of the metadata of a pictDB.
+ *
+ * Most of a struct pict_metadata is its picture id buffer, while ids are
+ * short. With FLAG_COMPACT, the table after the header is made of pages
+ * of RECORD_PAGE bytes: RECORDS_PER_PAGE fixed records (struct
+ * pict_record: hash of the id, SHA, offsets, sizes, valid flag), followed
+ * by the heap of the ids of these records. The metadata thus takes
+ * RECORD_PAGE / RECORDS_PER_PAGE bytes per picture on the disk and in the
+ * page cache, and do_open reads the table in large reads.
+ *
+ * A page is written whole, its heap packed again from the in-memory
+ * metadata each time (an empty record is all zeros): the heap never holds
+ * garbage, nothing refers to another page, and the journal records pages
+ * instead of metadata. A new picture only goes in a page whose heap has
+ * room for its id (record_find_free).
+ *
+ * In memory, the metadata is the usual struct pict_metadata, decoded when
+ * the database is opened; the older format is still read and written as
+ * it was.
+ *
+ * @date 16 October 2026
+ */
+
+#define _POSIX_C_SOURCE 200809L // for strnlen
+
+#include "pictDB.h"
+#include "db_record.h"
+#include "db_index.h"
+#include <stddef.h> // for offsetof
+#include <stdlib.h>
+#include <string.h>
+
+#define RECORDS_BUFFER (256 * RECORD_PAGE) // pages read or written at once
+
+/**
+ * @brief Tell whether the metadata of a database is stored as compact records.
+ *
+ * @param header The header of the database.
+ *
+ * @return 1 if it is, 0 otherwise.
+ */
+int has_compact_records(const struct pictdb_header* header)
+{
+    return (header->flags & HEADER_MAGIC_MASK) == HEADER_MAGIC && (header->flags & FLAG_COMPACT) != 0;
+}
+
+/**
+* @brief Number of pages of a table of compact records.
+*/
+static uint32_t nb_pages(uint32_t max_files)
+{
+    return (max_files + RECORDS_PER_PAGE - 1) / RECORDS_PER_PAGE;
+}
+
+/**
+ * @brief End of the metadata in the database file.
+ *
+ * @param header The header of the database.
+ * @param max_files Number of metadata.
+ *
+ * @return The position.
+ */
+uint64_t table_end(const struct pictdb_header* header, uint32_t max_files)
+{
+    if(has_compact_records(header)) {
+        return sizeof(struct pictdb_header) + (uint64_t)nb_pages(max_files) * RECORD_PAGE;
+    }
+    return sizeof(struct pictdb_header) + (uint64_t)max_files * sizeof(struct pict_metadata);
+}
+
+/**
+ * @brief Position in the database file of the offset of one resolution of
+ * a metadata.
+ *
+ * @param header The header of the database.
+ * @param index Position of the metadata.
+ * @param res Code of the resolution.
+ *
+ * @return The position.
+ */
+uint64_t offset_position(const struct pictdb_header* header, uint32_t index, size_t res)
+{
+    if(has_compact_records(header)) {
+        return sizeof(struct pictdb_header) + (uint64_t)(index / RECORDS_PER_PAGE) * RECORD_PAGE
+               + (index % RECORDS_PER_PAGE) * sizeof(struct pict_record)
+               + offsetof(struct pict_record, offset) + res * sizeof(uint64_t);
+    }
+    return sizeof(struct pictdb_header) + (uint64_t)index * sizeof(struct pict_metadata)
+           + offsetof(struct pict_metadata, offset) + res * sizeof(uint64_t);
+}
+
+/**
+ * @brief Number of valid metadata in a table read from the disk.
+ *
+ * @param header The header of the database.
+ * @param table The bytes following the header, up to table_end.
+ *
+ * @return The number of valid metadata.
+ */
+uint32_t count_valid(const struct pictdb_header* header, const void* table)
+{
+    uint32_t valid = 0;
+    for(uint32_t i = 0; i < header->max_files; i++) {
+        if(has_compact_records(header)) {
+            const struct pict_record* records =
+                (const struct pict_record*)((const char*)table + (size_t)(i / RECORDS_PER_PAGE) * RECORD_PAGE);
+            valid += records[i % RECORDS_PER_PAGE].is_valid == NON_EMPTY;
+        } else {
+            valid += ((const struct pict_metadata*)table)[i].is_valid == NON_EMPTY;
+        }
+    }
+    return valid;
+}
+
+/**
+ * @brief Dirty metadata of a page, as bits of the bitmap of the write-back.
+ *
+ * @param write_back The write-back of the database.
+ * @param page Number of the page.
+ *
+ * @return The bits.
+ */
+uint64_t record_page_dirty(const struct write_back* write_back, uint32_t page)
+{
+    uint32_t first = page * RECORDS_PER_PAGE;
+    if(write_back->dirty == NULL || first / 64 >= write_back->dirty_words) {
+        return 0;
+    }
+    return (write_back->dirty[first / 64] >> (first % 64)) & ((UINT64_C(1) << RECORDS_PER_PAGE) - 1);
+}
+
+/**
+ * @brief Make the page of compact records of some in-memory metadata.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param page Number of the page.
+ * @param dst Where the RECORD_PAGE bytes are stored.
+ *
+ * @return 0 if no errors, ERR_FULL_DATABASE if the ids do not fit.
+ */
+int record_encode_page(const struct pictdb_file* db_file, uint32_t page, void* dst)
+{
+    memset(dst, 0, RECORD_PAGE);
+    struct pict_record* records = dst;
+    char* heap = (char*)dst + RECORDS_PER_PAGE * sizeof(struct pict_record);
+    size_t used = 0;
+    for(uint32_t slot = 0; slot < RECORDS_PER_PAGE; slot++) {
+        uint32_t i = page * RECORDS_PER_PAGE + slot;
+        if(i >= db_file->header.max_files || db_file->metadata[i].is_valid != NON_EMPTY) {
+            continue;
+        }
+        const struct pict_metadata* metadata = &db_file->metadata[i];
+        size_t length = strnlen(metadata->pict_id, MAX_PIC_ID);
+        if(used + length > RECORD_HEAP) {
+            return ERR_FULL_DATABASE;
+        }
+        struct pict_record* record = &records[slot];
+        record->id_hash = index_hash_id(metadata->pict_id);
+        memcpy(record->SHA, metadata->SHA, SHA256_DIGEST_LENGTH);
+        memcpy(record->offset, metadata->offset, sizeof(record->offset));
+        memcpy(record->size, metadata->size, sizeof(record->size));
+        memcpy(record->res_orig, metadata->res_orig, sizeof(record->res_orig));
+        record->id_offset = (uint16_t)used;
+        record->id_length = (uint8_t)length;
+        record->is_valid = NON_EMPTY;
+        memcpy(heap + used, metadata->pict_id, length);
+        used += length;
+    }
+    return 0;
+}
+
+/**
+* @brief Decode a page of compact records into the in-memory metadata.
+*/
+static int decode_page(struct pictdb_file* db_file, uint32_t page, const char* src)
+{
+    const struct pict_record* records = (const struct pict_record*)src;
+    const char* heap = src + RECORDS_PER_PAGE * sizeof(struct pict_record);
+    for(uint32_t slot = 0; slot < RECORDS_PER_PAGE; slot++) {
+        uint32_t i = page * RECORDS_PER_PAGE + slot;
+        const struct pict_record* record = &records[slot];
+        if(i >= db_file->header.max_files || record->is_valid != NON_EMPTY) {
+            continue;
+        }
+        if(record->id_length > MAX_PIC_ID || record->id_offset + (size_t)record->id_length > RECORD_HEAP) {
+            return ERR_IO;
+        }
+        struct pict_metadata* metadata = &db_file->metadata[i];
+        memcpy(metadata->pict_id, heap + record->id_offset, record->id_length);
+        metadata->pict_id[record->id_length] = '\0';
+        memcpy(metadata->SHA, record->SHA, SHA256_DIGEST_LENGTH);
+        memcpy(metadata->offset, record->offset, sizeof(metadata->offset));
+        memcpy(metadata->size, record->size, sizeof(metadata->size));
+        memcpy(metadata->res_orig, record->res_orig, sizeof(metadata->res_orig));
+        metadata->is_valid = NON_EMPTY;
+    }
+    return 0;
+}
+
+/**
+ * @brief Read the compact records of a database into newly allocated metadata.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int records_read(struct pictdb_file* db_file)
+{
+    db_file->metadata = calloc(db_file->header.max_files, sizeof(struct pict_metadata));
+    if(db_file->metadata == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    uint32_t pages = nb_pages(db_file->header.max_files);
+    char* buffer = malloc(pages < RECORDS_BUFFER / RECORD_PAGE ? (size_t)pages * RECORD_PAGE : RECORDS_BUFFER);
+    if(buffer == NULL && pages > 0) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    int check = 0;
+    for(uint32_t first = 0; first < pages && check == 0; first += RECORDS_BUFFER / RECORD_PAGE) {
+        uint32_t n = pages - first < RECORDS_BUFFER / RECORD_PAGE ? pages - first : RECORDS_BUFFER / RECORD_PAGE;
+        check = db_pread(db_file, buffer, (size_t)n * RECORD_PAGE,
+                         sizeof(struct pictdb_header) + (uint64_t)first * RECORD_PAGE);
+        for(uint32_t page = 0; page < n && check == 0; page++) {
+            check = decode_page(db_file, first + page, buffer + (size_t)page * RECORD_PAGE);
+        }
+    }
+    free(buffer);
+    return check;
+}
+
+/**
+ * @brief Write consecutive pages of compact records.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param first Number of the first page.
+ * @param end Number of the page after the last one.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int records_write(struct pictdb_file* db_file, uint32_t first, uint32_t end)
+{
+    uint32_t per_write = RECORDS_BUFFER / RECORD_PAGE;
+    char* buffer = malloc(end - first < per_write ? (size_t)(end - first) * RECORD_PAGE : RECORDS_BUFFER);
+    if(buffer == NULL) {
+        return first == end ? 0 : ERR_OUT_OF_MEMORY;
+    }
+    int check = 0;
+    for(uint32_t page = first; page < end && check == 0; page += per_write) {
+        uint32_t n = end - page < per_write ? end - page : per_write;
+        for(uint32_t i = 0; i < n && check == 0; i++) {
+            check = record_encode_page(db_file, page + i, buffer + (size_t)i * RECORD_PAGE);
+        }
+        if(check == 0) {
+            check = db_pwrite(db_file, buffer, (size_t)n * RECORD_PAGE,
+                              sizeof(struct pictdb_header) + (uint64_t)page * RECORD_PAGE);
+        }
+    }
+    free(buffer);
+    return check;
+}
+
+/**
+* @brief Bytes of the heap of a page not used by its valid metadata.
+*/
+static size_t heap_room(const struct pictdb_file* db_file, uint32_t page)
+{
+    size_t used = 0;
+    for(uint32_t i = page * RECORDS_PER_PAGE; i < (page + 1) * RECORDS_PER_PAGE && i < db_file->header.max_files; i++) {
+        if(db_file->metadata[i].is_valid == NON_EMPTY) {
+            used += strnlen(db_file->metadata[i].pict_id, MAX_PIC_ID);
+        }
+    }
+    return used < RECORD_HEAP ? RECORD_HEAP - used : 0;
+}
+
+/**
+ * @brief First position from index on where a new picture id fits.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param index Position from which to look.
+ * @param pict_id The picture id to store.
+ *
+ * @return The position, max_files or more if there is none.
+ */
+uint32_t record_fit(const struct pictdb_file* db_file, uint32_t index, const char* pict_id)
+{
+    if(!has_compact_records(&db_file->header)) {
+        return index;
+    }
+    size_t length = strnlen(pict_id, MAX_PIC_ID);
+    while(index < db_file->header.max_files && heap_room(db_file, index / RECORDS_PER_PAGE) < length) {
+        index = (index / RECORDS_PER_PAGE + 1) * RECORDS_PER_PAGE;
+    }
+    return index;
+}
+
+/**
+ * @brief Find an empty position in the metadata where a new picture id fits.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param pict_id The picture id to store.
+ *
+ * @return The position, or INDEX_NOT_FOUND if there is none.
+ */
+uint32_t record_find_free(struct pictdb_file* db_file, const char* pict_id)
+{
+    uint32_t index = index_find_free(db_file);
+    if(index == INDEX_NOT_FOUND || !has_compact_records(&db_file->header)) {
+        return index;
+    }
+    size_t length = strnlen(pict_id, MAX_PIC_ID);
+    const struct pict_index* free_index = &db_file->index;
+    while(heap_room(db_file, index / RECORDS_PER_PAGE) < length) {
+        //The next empty position of a later page
+        index = (index / RECORDS_PER_PAGE + 1) * RECORDS_PER_PAGE;
+        uint64_t word = 0;
+        while(index / 64 < free_index->free_words && (word = free_index->free_slots[index / 64] >> (index % 64)) == 0) {
+            index = (index / 64 + 1) * 64;
+        }
+        if(index / 64 >= free_index->free_words) {
+            return INDEX_NOT_FOUND;
+        }
+        index += (uint32_t)__builtin_ctzll(word);
+    }
+    return index;
+}
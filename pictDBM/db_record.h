@@ -0,0 +1,128 @@
+/**
+ * @file db_record.h
+ * @brief On-disk format of the metadata of a pictDB.
+ *
+ * @date 16 October 2026
+ */
+#ifndef DB_RECORD_H
+#define DB_RECORD_H
+
+#include "pictDB.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Tell whether the metadata of a database is stored as compact
+ * records (FLAG_COMPACT).
+ *
+ * @param header The header of the database.
+ *
+ * @return 1 if it is, 0 otherwise.
+ */
+int has_compact_records(const struct pictdb_header* header);
+
+/**
+ * @brief End of the metadata in the database file, where the data starts.
+ *
+ * @param header The header of the database (for its format).
+ * @param max_files Number of metadata.
+ *
+ * @return The position.
+ */
+uint64_t table_end(const struct pictdb_header* header, uint32_t max_files);
+
+/**
+ * @brief Position in the database file of the offset of one resolution of
+ * a metadata.
+ *
+ * @param header The header of the database.
+ * @param index Position of the metadata.
+ * @param res Code of the resolution.
+ *
+ * @return The position.
+ */
+uint64_t offset_position(const struct pictdb_header* header, uint32_t index, size_t res);
+
+/**
+ * @brief Number of valid metadata in a table read from the disk.
+ *
+ * @param header The header of the database.
+ * @param table The table_end(header, header->max_files) - sizeof(header)
+ * bytes following the header.
+ *
+ * @return The number of valid metadata.
+ */
+uint32_t count_valid(const struct pictdb_header* header, const void* table);
+
+/**
+ * @brief Dirty metadata of a page, as bits of the bitmap of the write-back.
+ *
+ * @param write_back The write-back of the database.
+ * @param page Number of the page.
+ *
+ * @return The bits (0 if nothing in the page is to be written).
+ */
+uint64_t record_page_dirty(const struct write_back* write_back, uint32_t page);
+
+/**
+ * @brief Make the page of compact records of some in-memory metadata.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param page Number of the page.
+ * @param dst Where the RECORD_PAGE bytes are stored.
+ *
+ * @return 0 if no errors, ERR_FULL_DATABASE if the ids do not fit.
+ */
+int record_encode_page(const struct pictdb_file* db_file, uint32_t page, void* dst);
+
+/**
+ * @brief Read the compact records of a database whose header was just
+ * read, into newly allocated metadata.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int records_read(struct pictdb_file* db_file);
+
+/**
+ * @brief Write consecutive pages of compact records, one write per MiB.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param first Number of the first page.
+ * @param end Number of the page after the last one.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int records_write(struct pictdb_file* db_file, uint32_t first, uint32_t end);
+
+/**
+ * @brief First position from index on where a new picture id fits: the
+ * position itself, unless the heap of its page is too full (only with
+ * compact records). The positions after index must be empty.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param index Position from which to look.
+ * @param pict_id The picture id to store.
+ *
+ * @return The position, max_files or more if there is none.
+ */
+uint32_t record_fit(const struct pictdb_file* db_file, uint32_t index, const char* pict_id);
+
+/**
+ * @brief Find an empty position in the metadata where a new picture id
+ * fits (index_find_free, unless the heap of its page is too full).
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param pict_id The picture id to store.
+ *
+ * @return The position, or INDEX_NOT_FOUND if there is none.
+ */
+uint32_t record_find_free(struct pictdb_file* db_file, const char* pict_id);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
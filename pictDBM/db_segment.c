@@ -0,0 +1,709 @@
+/**
+ * @file db_segment.c
+ * @brief Data files of a segmented pictDB.
+ *
+ * With FLAG_SEGMENTED, the database file only holds the header and the
+ * metadata. The contents are appended to "<db>.seg.1", "<db>.seg.2", ...
+ * a new segment being started once the last one reached the size given
+ * by the header (1 GiB by default). Their offsets hold the number of the
+ * segment in the upper bits (see SEGMENT_OFFSET), so that the metadata
+ * still refers to them with a single offset. The bytes of a deleted
+ * content are given back to the file system, as in a single file, but
+ * never reused: the segments are only appended to.
+ *
+ * The garbage is collected one segment at a time: its live contents are
+ * appended to the last segment, the metadata is made to refer to the
+ * copies, and the segment is removed once the metadata is written. The
+ * others are not read, and the database is only blocked for that time.
+ * Only the segments with enough garbage are collected: a few dead bytes
+ * are not worth copying the whole segment.
+ *
+ * @date 16 October 2026
+ */
+
+#define _DEFAULT_SOURCE // for fdatasync, DIR
+
+#include "pictDB.h"
+#include "db_segment.h"
+#include "db_extent.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h> // for snprintf
+#include <dirent.h> // for opendir
+#include <sys/stat.h> // for fstat
+#include <fcntl.h> // for open
+#include <unistd.h> // for pread, pwrite
+
+#define MAX_SEGMENTS ((1u << (64 - SEGMENT_BITS)) - 1)
+#define SEGMENT_COPY (1 << 20) // bytes appended at once by segment_gc
+
+/**
+* @brief A content of the collected segment.
+*/
+struct live_blob {
+    uint64_t old_offset;
+    uint64_t new_offset;
+    uint64_t size;
+};
+
+/********************************************************************//**
+ * Whether the contents are in segments.
+ */
+int is_segmented(const struct pictdb_file* db_file)
+{
+    return db_file != NULL && db_file->segments.base != NULL;
+}
+
+/**
+* @brief Name of a segment, to be freed by the caller.
+*/
+static char* segment_name(const char* base, uint32_t number)
+{
+    size_t len = strlen(base) + sizeof(".seg.") + 10;
+    char* name = malloc(len);
+    if(name != NULL) {
+        snprintf(name, len, "%s.seg.%u", base, number);
+    }
+    return name;
+}
+
+/**
+* @brief Make room for the segments up to a number.
+*/
+static int reserve(struct segments* segments, uint32_t number)
+{
+    if(number > MAX_SEGMENTS) {
+        return ERR_FULL_DATABASE;
+    }
+    if(number <= segments->allocated) {
+        return 0;
+    }
+    uint32_t bigger = segments->allocated == 0 ? 16 : 2 * segments->allocated;
+    while(bigger < number) {
+        bigger *= 2;
+    }
+    int* fds = realloc(segments->fds, bigger * sizeof(int));
+    if(fds == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    segments->fds = fds;
+    uint64_t* sizes = realloc(segments->sizes, bigger * sizeof(uint64_t));
+    if(sizes == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    segments->sizes = sizes;
+    for(uint32_t i = segments->allocated; i < bigger; i++) {
+        segments->fds[i] = -1;
+        segments->sizes[i] = 0;
+    }
+    segments->allocated = bigger;
+    return 0;
+}
+
+/**
+* @brief Start using segments, as the header asks.
+*/
+static int segments_init(struct pictdb_file* db_file, const char* file_name)
+{
+    memset(&db_file->segments, 0, sizeof(struct segments));
+    db_file->segments.base = malloc(strlen(file_name) + 1);
+    if(db_file->segments.base == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    strcpy(db_file->segments.base, file_name);
+    uint32_t shift = (db_file->header.flags & FLAG_SEGMENT_SIZE) >> SEGMENT_SIZE_SHIFT;
+    if(shift == 0) {
+        shift = DEFAULT_SEGMENT_SHIFT;
+    } else if(shift >= SEGMENT_BITS) {
+        shift = SEGMENT_BITS - 1;
+    }
+    db_file->segments.limit = UINT64_C(1) << shift;
+    return 0;
+}
+
+/**
+* @brief Call a function on every segment of a database found in its
+* directory.
+*/
+static int for_each_segment(struct pictdb_file* db_file, const char* file_name, int flags,
+                            int (*found)(struct pictdb_file*, const char*, uint32_t, int))
+{
+    const char* slash = strrchr(file_name, '/');
+    const char* prefix = slash == NULL ? file_name : slash + 1;
+    size_t dir_len = slash == NULL ? 0 : (size_t)(slash - file_name) + 1;
+    char* dir_name = malloc(dir_len + 2);
+    if(dir_name == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    if(dir_len == 0) {
+        strcpy(dir_name, ".");
+    } else {
+        memcpy(dir_name, file_name, dir_len);
+        dir_name[dir_len] = '\0';
+    }
+    DIR* dir = opendir(dir_name);
+    free(dir_name);
+    if(dir == NULL) {
+        return ERR_IO;
+    }
+
+    size_t prefix_len = strlen(prefix);
+    int check = 0;
+    struct dirent* entry = NULL;
+    while(check == 0 && (entry = readdir(dir)) != NULL) {
+        const char* suffix = entry->d_name + prefix_len;
+        if(strncmp(entry->d_name, prefix, prefix_len) != 0 || strncmp(suffix, ".seg.", 5) != 0) {
+            continue;
+        }
+        char* end = NULL;
+        unsigned long number = strtoul(suffix + 5, &end, 10);
+        if(suffix[5] < '1' || suffix[5] > '9' || *end != '\0' || number > MAX_SEGMENTS) {
+            continue;
+        }
+        char* name = segment_name(file_name, (uint32_t)number);
+        check = name == NULL ? ERR_OUT_OF_MEMORY : found(db_file, name, (uint32_t)number, flags);
+        free(name);
+    }
+    closedir(dir);
+    return check;
+}
+
+/**
+* @brief Open a segment found by segments_open.
+*/
+static int open_segment(struct pictdb_file* db_file, const char* name, uint32_t number, int flags)
+{
+    struct segments* segments = &db_file->segments;
+    int check = reserve(segments, number);
+    if(check != 0) {
+        return check;
+    }
+    int fd = open(name, flags);
+    struct stat st;
+    if(fd == -1 || fstat(fd, &st) != 0) {
+        if(fd != -1) {
+            close(fd);
+        }
+        return ERR_IO;
+    }
+    segments->fds[number - 1] = fd;
+    segments->sizes[number - 1] = st.st_size;
+    return 0;
+}
+
+/**
+ * @brief Open the segments of a database whose header was just read.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param file_name Name of the database file.
+ * @param flags O_RDONLY or O_RDWR.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int segments_open(struct pictdb_file* db_file, const char* file_name, int flags)
+{
+    if(!(db_file->header.flags & FLAG_SEGMENTED)) {
+        return 0;
+    }
+    int check = segments_init(db_file, file_name);
+    if(check != 0) {
+        return check;
+    }
+    check = for_each_segment(db_file, file_name, flags, open_segment);
+    if(check != 0) {
+        return check;
+    }
+    //The last one found is the one written to
+    struct segments* segments = &db_file->segments;
+    for(uint32_t i = segments->allocated; i > 0 && segments->count == 0; i--) {
+        if(segments->fds[i - 1] != -1) {
+            segments->count = i;
+        }
+    }
+    return 0;
+}
+
+/**
+* @brief Remove a segment of a previous database.
+*/
+static int remove_segment(struct pictdb_file* db_file, const char* name, uint32_t number, int flags)
+{
+    (void)db_file;
+    (void)number;
+    (void)flags;
+    return unlink(name) == 0 ? 0 : ERR_IO;
+}
+
+/**
+ * @brief Start the segments of a database being created.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param file_name Name of the database file.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int segments_create(struct pictdb_file* db_file, const char* file_name)
+{
+    int check = for_each_segment(db_file, file_name, 0, remove_segment);
+    if(check != 0 || !(db_file->header.flags & FLAG_SEGMENTED)) {
+        return check;
+    }
+    return segments_init(db_file, file_name);
+}
+
+/**
+ * @brief Close the segments and free their memory.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ */
+void segments_close(struct pictdb_file* db_file)
+{
+    struct segments* segments = &db_file->segments;
+    for(uint32_t i = 0; i < segments->allocated; i++) {
+        if(segments->fds[i] != -1) {
+            close(segments->fds[i]);
+        }
+    }
+    free(segments->base);
+    free(segments->fds);
+    free(segments->sizes);
+    memset(segments, 0, sizeof(struct segments));
+}
+
+/**
+ * @brief File descriptor of the segment holding an offset.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param offset Segment offset.
+ *
+ * @return The file descriptor, -1 if there is no such segment.
+ */
+int segment_fd(const struct pictdb_file* db_file, uint64_t offset)
+{
+    uint32_t number = SEGMENT_NUMBER(offset);
+    if(number == 0 || number > db_file->segments.count) {
+        return -1;
+    }
+    return db_file->segments.fds[number - 1];
+}
+
+/**
+ * @brief Read bytes of a segment.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param buf Destination of the bytes.
+ * @param len Number of bytes to read.
+ * @param offset Segment offset of the bytes.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int segment_pread(const struct pictdb_file* db_file, void* buf, size_t len, uint64_t offset)
+{
+    int fd = segment_fd(db_file, offset);
+    if(fd == -1) {
+        return ERR_IO;
+    }
+    char* dst = buf;
+    uint64_t position = SEGMENT_POSITION(offset);
+    while(len > 0) {
+        ssize_t n = pread(fd, dst, len, (off_t)position);
+        if(n <= 0) {
+            return ERR_IO;
+        }
+        dst += n;
+        len -= n;
+        position += n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Write bytes to a segment.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param buf Bytes to write.
+ * @param len Number of bytes to write.
+ * @param offset Segment offset of the bytes.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int segment_pwrite(struct pictdb_file* db_file, const void* buf, size_t len, uint64_t offset)
+{
+    int fd = segment_fd(db_file, offset);
+    if(fd == -1) {
+        return ERR_IO;
+    }
+    const char* src = buf;
+    uint64_t position = SEGMENT_POSITION(offset);
+    while(len > 0) {
+        ssize_t n = pwrite(fd, src, len, (off_t)position);
+        if(n <= 0) {
+            return ERR_IO;
+        }
+        src += n;
+        len -= n;
+        position += n;
+    }
+    uint64_t* size = &db_file->segments.sizes[SEGMENT_NUMBER(offset) - 1];
+    if(position > *size) {
+        *size = position;
+    }
+    return 0;
+}
+
+/**
+* @brief Whether the next append starts a new segment.
+*/
+static int segment_full(const struct segments* segments)
+{
+    return segments->count == 0 || segments->sizes[segments->count - 1] >= segments->limit;
+}
+
+/**
+* @brief Start a new segment, the last one being synced first: from now
+* on, only the last segment may have contents not on the disk.
+*/
+static int segment_roll(struct pictdb_file* db_file)
+{
+    struct segments* segments = &db_file->segments;
+    int check = segment_sync(db_file);
+    if(check == 0) {
+        check = reserve(segments, segments->count + 1);
+    }
+    if(check != 0) {
+        return check;
+    }
+    char* name = segment_name(segments->base, segments->count + 1);
+    if(name == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    int fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    free(name);
+    if(fd == -1) {
+        return ERR_IO;
+    }
+    segments->fds[segments->count] = fd;
+    segments->sizes[segments->count] = 0;
+    segments->count += 1;
+    return 0;
+}
+
+/**
+ * @brief Write bytes at the end of the last segment.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param buf Bytes to write.
+ * @param len Number of bytes to write.
+ * @param offset Where the segment offset of the bytes is stored.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int segment_append(struct pictdb_file* db_file, const void* buf, size_t len, uint64_t* offset)
+{
+    if(segment_full(&db_file->segments)) {
+        int check = segment_roll(db_file);
+        if(check != 0) {
+            return check;
+        }
+    }
+    uint64_t position = segment_end(db_file);
+    int check = segment_pwrite(db_file, buf, len, position);
+    if(check != 0) {
+        return check;
+    }
+    *offset = position;
+    return 0;
+}
+
+/**
+ * @brief Segment offset of the bytes the next segment_append will write.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ *
+ * @return The offset.
+ */
+uint64_t segment_end(const struct pictdb_file* db_file)
+{
+    const struct segments* segments = &db_file->segments;
+    if(segment_full(segments)) {
+        return SEGMENT_OFFSET(segments->count + 1, 0);
+    }
+    return SEGMENT_OFFSET(segments->count, segments->sizes[segments->count - 1]);
+}
+
+/**
+ * @brief Number of bytes the last segment may still take.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ *
+ * @return The number of bytes.
+ */
+uint64_t segment_room(const struct pictdb_file* db_file)
+{
+    const struct segments* segments = &db_file->segments;
+    if(segment_full(segments)) {
+        return segments->limit;
+    }
+    return segments->limit - segments->sizes[segments->count - 1];
+}
+
+/**
+ * @brief Sync the last segment to the disk.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int segment_sync(struct pictdb_file* db_file)
+{
+    const struct segments* segments = &db_file->segments;
+    if(segments->count == 0 || segments->fds[segments->count - 1] == -1) {
+        return 0;
+    }
+    return fdatasync(segments->fds[segments->count - 1]) == 0 ? 0 : ERR_IO;
+}
+
+/**
+ * @brief Total size of the segments.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ *
+ * @return The number of bytes.
+ */
+uint64_t segments_size(const struct pictdb_file* db_file)
+{
+    uint64_t total = 0;
+    for(uint32_t i = 0; i < db_file->segments.count; i++) {
+        total += db_file->segments.sizes[i];
+    }
+    return total;
+}
+
+/**
+* @brief Compare two contents by offset, for qsort.
+*/
+static int compare_blobs(const void* a, const void* b)
+{
+    const struct live_blob* x = a;
+    const struct live_blob* y = b;
+    return x->old_offset < y->old_offset ? -1 : (x->old_offset > y->old_offset ? 1 : 0);
+}
+
+/**
+* @brief The contents referred to by valid metadata, sorted by offset, each
+* shared content once.
+*/
+static int live_blobs(const struct pictdb_file* db_file, struct live_blob** blobs, size_t* nb_blobs)
+{
+    size_t nb = 0;
+    for(uint32_t i = 0; i < db_file->header.max_files; i++) {
+        for(size_t res = 0; db_file->metadata[i].is_valid == NON_EMPTY && res < NB_RES; res++) {
+            nb += db_file->metadata[i].offset[res] != 0;
+        }
+    }
+    struct live_blob* list = malloc((nb > 0 ? nb : 1) * sizeof(struct live_blob));
+    if(list == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    nb = 0;
+    for(uint32_t i = 0; i < db_file->header.max_files; i++) {
+        const struct pict_metadata* metadata = &db_file->metadata[i];
+        for(size_t res = 0; metadata->is_valid == NON_EMPTY && res < NB_RES; res++) {
+            if(metadata->offset[res] != 0) {
+                list[nb].old_offset = metadata->offset[res];
+                list[nb].new_offset = 0;
+                list[nb].size = metadata->size[res];
+                nb += 1;
+            }
+        }
+    }
+    qsort(list, nb, sizeof(struct live_blob), compare_blobs);
+
+    size_t nb_unique = 0;
+    for(size_t i = 0; i < nb; i++) {
+        if(nb_unique > 0 && list[nb_unique - 1].old_offset == list[i].old_offset) {
+            if(list[i].size > list[nb_unique - 1].size) {
+                list[nb_unique - 1].size = list[i].size;
+            }
+        } else {
+            list[nb_unique++] = list[i];
+        }
+    }
+    *blobs = list;
+    *nb_blobs = nb_unique;
+    return 0;
+}
+
+/**
+* @brief Append the contents of a segment (a slice of the sorted list) to
+* the last segment, consecutive contents in one write.
+*/
+static int copy_blobs(struct pictdb_file* db_file, struct live_blob* blobs, size_t nb_blobs)
+{
+    char* buffer = NULL;
+    size_t buffer_size = 0;
+    int check = 0;
+    size_t first = 0;
+    while(first < nb_blobs && check == 0) {
+        uint64_t length = blobs[first].size;
+        size_t end = first + 1;
+        while(end < nb_blobs && blobs[end].old_offset == blobs[end - 1].old_offset + blobs[end - 1].size
+              && length + blobs[end].size <= SEGMENT_COPY) {
+            length += blobs[end].size;
+            end += 1;
+        }
+        if(length > buffer_size) {
+            char* bigger = realloc(buffer, length);
+            if(bigger == NULL) {
+                check = ERR_OUT_OF_MEMORY;
+                break;
+            }
+            buffer = bigger;
+            buffer_size = length;
+        }
+        uint64_t position = 0;
+        check = segment_pread(db_file, buffer, length, blobs[first].old_offset);
+        if(check == 0) {
+            check = segment_append(db_file, buffer, length, &position);
+        }
+        for(size_t i = first; i < end && check == 0; i++) {
+            blobs[i].new_offset = position + (blobs[i].old_offset - blobs[first].old_offset);
+        }
+        first = end;
+    }
+    free(buffer);
+    return check;
+}
+
+/**
+ * @brief Collect the garbage of one segment.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param min_dead Percentage of dead bytes a segment needs to be collected.
+ * @param collected Where 1 is stored if a segment was collected, 0 otherwise.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int segment_gc(struct pictdb_file* db_file, uint32_t min_dead, int* collected)
+{
+    if(!is_segmented(db_file) || collected == NULL || min_dead > 100) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    *collected = 0;
+    //The deletions are written first: the metadata is what is on the disk
+    int check = db_sync(db_file);
+    if(check != 0) {
+        return check;
+    }
+    struct live_blob* blobs = NULL;
+    size_t nb_blobs = 0;
+    check = live_blobs(db_file, &blobs, &nb_blobs);
+    if(check != 0) {
+        return check;
+    }
+
+    //The segment with the most garbage, if it has enough, and its slice of the list
+    struct segments* segments = &db_file->segments;
+    uint32_t victim = 0;
+    uint64_t victim_dead = 0;
+    size_t victim_first = 0;
+    size_t victim_end = 0;
+    size_t first = 0;
+    for(uint32_t number = 1; number <= segments->count; number++) {
+        size_t end = first;
+        uint64_t live = 0;
+        while(end < nb_blobs && SEGMENT_NUMBER(blobs[end].old_offset) == number) {
+            live += blobs[end].size;
+            end += 1;
+        }
+        uint64_t size = segments->sizes[number - 1];
+        if(segments->fds[number - 1] != -1 && size > live && size - live > victim_dead
+           && (size - live) * 100 >= (uint64_t)min_dead * size) {
+            victim = number;
+            victim_dead = size - live;
+            victim_first = first;
+            victim_end = end;
+        }
+        first = end;
+    }
+    if(victim == 0) {
+        free(blobs);
+        return 0;
+    }
+
+    //The last segment is sealed first, its contents cannot be appended to itself
+    if(victim == segments->count) {
+        check = segment_roll(db_file);
+    }
+    if(check == 0) {
+        check = copy_blobs(db_file, &blobs[victim_first], victim_end - victim_first);
+    }
+    if(check == 0) {
+        check = segment_sync(db_file);
+    }
+
+    //The metadata refers to the copies from now on
+    for(uint32_t i = 0; i < db_file->header.max_files && check == 0; i++) {
+        struct pict_metadata* metadata = &db_file->metadata[i];
+        int changed = 0;
+        for(size_t res = 0; metadata->is_valid == NON_EMPTY && res < NB_RES; res++) {
+            if(metadata->offset[res] != 0 && SEGMENT_NUMBER(metadata->offset[res]) == victim) {
+                struct live_blob key = {metadata->offset[res], 0, 0};
+                const struct live_blob* blob = bsearch(&key, &blobs[victim_first], victim_end - victim_first,
+                                                       sizeof(struct live_blob), compare_blobs);
+                if(blob != NULL) {
+                    metadata->offset[res] = blob->new_offset;
+                    changed = 1;
+                }
+            }
+        }
+        if(changed) {
+            check = write_metadata(db_file, i);
+        }
+    }
+    free(blobs);
+    if(check == 0) {
+        db_file->header.dead_bytes -= victim_dead < db_file->header.dead_bytes ? victim_dead : db_file->header.dead_bytes;
+        check = write_header(db_file);
+    }
+    if(check == 0) {
+        check = db_sync(db_file);
+    }
+    //The references are counted again from the new offsets
+    extent_free_all(db_file);
+    if(check != 0) {
+        return check;
+    }
+
+    //Nothing refers to the segment any more
+    char* name = segment_name(segments->base, victim);
+    if(name == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    close(segments->fds[victim - 1]);
+    segments->fds[victim - 1] = -1;
+    segments->sizes[victim - 1] = 0;
+    check = unlink(name) == 0 ? 0 : ERR_IO;
+    free(name);
+    if(check == 0) {
+        *collected = 1;
+    }
+    return check;
+}
+
+/**
+ * @brief Collect the segments with enough garbage, one after the other.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int segments_gc(struct pictdb_file* db_file)
+{
+    int collected = 1;
+    int check = 0;
+    while(check == 0 && collected) {
+        check = segment_gc(db_file, SEGMENT_GC_MIN, &collected);
+    }
+    return check;
+}
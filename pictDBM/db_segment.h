@@ -0,0 +1,174 @@
+/**
+ * @file db_segment.h
+ * @brief Data files of a segmented pictDB.
+ *
+ * @date 16 October 2026
+ */
+#ifndef DB_SEGMENT_H
+#define DB_SEGMENT_H
+
+#include "pictDB.h"
+
+#define SEGMENT_GC_MIN 25 // percentage of dead bytes for segments_gc to collect a segment
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @brief Tell whether the contents of a database are in segments.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ *
+ * @return 1 if they are, 0 otherwise.
+ */
+int is_segmented(const struct pictdb_file* db_file);
+
+/**
+ * @brief Open the segments of a database whose header was just read
+ * (nothing is done if it is not segmented).
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param file_name Name of the database file.
+ * @param flags O_RDONLY or O_RDWR.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int segments_open(struct pictdb_file* db_file, const char* file_name, int flags);
+
+/**
+ * @brief Start the segments of a database being created: those of a
+ * previous database with this name are removed.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param file_name Name of the database file.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int segments_create(struct pictdb_file* db_file, const char* file_name);
+
+/**
+ * @brief Close the segments and free their memory.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ */
+void segments_close(struct pictdb_file* db_file);
+
+/**
+ * @brief Read bytes of a segment.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param buf Destination of the bytes.
+ * @param len Number of bytes to read.
+ * @param offset Segment offset of the bytes (see SEGMENT_OFFSET).
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int segment_pread(const struct pictdb_file* db_file, void* buf, size_t len, uint64_t offset);
+
+/**
+ * @brief Write bytes to a segment.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param buf Bytes to write.
+ * @param len Number of bytes to write.
+ * @param offset Segment offset of the bytes (see SEGMENT_OFFSET).
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int segment_pwrite(struct pictdb_file* db_file, const void* buf, size_t len, uint64_t offset);
+
+/**
+ * @brief Write bytes at the end of the last segment, a new one being
+ * started once the last one reached the size limit. The bytes of one call
+ * are never split.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param buf Bytes to write.
+ * @param len Number of bytes to write.
+ * @param offset Where the segment offset of the bytes is stored.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int segment_append(struct pictdb_file* db_file, const void* buf, size_t len, uint64_t* offset);
+
+/**
+ * @brief Segment offset of the bytes the next segment_append will write.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ *
+ * @return The offset.
+ */
+uint64_t segment_end(const struct pictdb_file* db_file);
+
+/**
+ * @brief Number of bytes the last segment may still take before it reaches
+ * the size limit (the whole limit if the next segment_append starts a new
+ * one).
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ *
+ * @return The number of bytes.
+ */
+uint64_t segment_room(const struct pictdb_file* db_file);
+
+/**
+ * @brief File descriptor of the segment holding an offset.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param offset Segment offset.
+ *
+ * @return The file descriptor, -1 if there is no such segment.
+ */
+int segment_fd(const struct pictdb_file* db_file, uint64_t offset);
+
+/**
+ * @brief Sync the last segment to the disk (the others were synced when
+ * the next one was started). Nothing is done if the database is not
+ * segmented.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int segment_sync(struct pictdb_file* db_file);
+
+/**
+ * @brief Total size of the segments.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ *
+ * @return The number of bytes.
+ */
+uint64_t segments_size(const struct pictdb_file* db_file);
+
+/**
+ * @brief Collect the garbage of one segment: the one with the most dead
+ * bytes, if they make at least min_dead percent of it. Its live contents
+ * are appended to the last segment, the metadata is made to refer to the
+ * copies and the segment is removed. The last segment is first sealed if
+ * it is the one. Each call only blocks the database for one segment.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param min_dead Percentage of dead bytes a segment needs to be collected.
+ * @param collected Where 1 is stored if a segment was collected, 0 if
+ * none had enough garbage.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int segment_gc(struct pictdb_file* db_file, uint32_t min_dead, int* collected);
+
+/**
+ * @brief Collect the segments with at least SEGMENT_GC_MIN percent of dead
+ * bytes, one after the other.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int segments_gc(struct pictdb_file* db_file);
+
+#ifdef __cplusplus
+}
+#endif
+#endif
@@ -6,13 +6,28 @@
  * @date 2 Nov 2015
  */
 
+#define _POSIX_C_SOURCE 200809L // for pread, pwrite
+#define _DEFAULT_SOURCE // for flock
+
 #include "pictDB.h"
+#include "db_index.h"
+#include "db_columns.h"
+#include "db_journal.h"
+#include "db_extent.h"
+#include "db_compact.h"
+#include "db_segment.h"
+#include "db_record.h"
 #include <stdint.h> // for uint8_t
 #include <stdio.h> // for sprintf
 #include <inttypes.h> // for PRIu
 #include <openssl/sha.h> // for SHA256_DIGEST_LENGTH
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h> // for mmap
+#include <sys/stat.h> // for fstat
+#include <sys/file.h> // for flock
+#include <unistd.h> // for pread, pwrite
+#include <fcntl.h> // for open
 
 /********************************************************************//**
  * Human-readable SHA
@@ -44,6 +59,15 @@ void print_header (const struct pictdb_header* header)
     printf("MAX IMAGES: %" PRIu32 "\n", header->max_files);
     printf("THUMBNAIL: %" PRIu16 " x %" PRIu16 "\t", header->res_resized[2*RES_THUMB], header->res_resized[(2*RES_THUMB)+1]);
     printf("SMALL: %" PRIu16 " x %" PRIu16 "\n", header->res_resized[2*RES_SMALL], header->res_resized[(2*RES_SMALL)+1]);
+    static const char* const policies[] = {"lazy", "sync", "background"};
+    printf("VARIANTS: %s\n", policies[variants_policy(header)]);
+    if((header->flags & HEADER_MAGIC_MASK) == HEADER_MAGIC && (header->flags & FLAG_SEGMENTED)) {
+        uint32_t shift = (header->flags & FLAG_SEGMENT_SIZE) >> SEGMENT_SIZE_SHIFT;
+        printf("SEGMENT SIZE: %" PRIu64 " MiB\n", (UINT64_C(1) << (shift == 0 ? DEFAULT_SEGMENT_SHIFT : shift)) >> 20);
+    }
+    if(has_compact_records(header)) {
+        printf("RECORDS: compact\n");
+    }
     printf("***********DATABASE HEADER END***********\n");
     printf("*****************************************\n");
 }
@@ -70,53 +94,306 @@ void print_metadata (const struct pict_metadata* metadata)
     printf("*****************************************\n");
 }
 
+/**
+ * @brief Convert a fopen-like opening mode to open(2) flags
+ *
+ * @param const char* opening_mode ("rb", "rb+", "w+b", ...)
+ *
+ * @return the flags, or -1 if the mode is not supported.
+ */
+static int open_flags(const char* opening_mode)
+{
+    int update = strchr(opening_mode, '+') != NULL;
+    switch(opening_mode[0]) {
+    case 'r':
+        return update ? O_RDWR : O_RDONLY;
+    case 'w':
+        return (update ? O_RDWR : O_WRONLY) | O_CREAT | O_TRUNC;
+    default:
+        return -1;
+    }
+}
+
+/**
+ * @brief Open a database file. A writable one is locked as long as it is
+ * open, so that a single process writes it (and replays its journal); with
+ * O_TRUNC, it is only truncated once locked.
+ *
+ * @param const char* file_name name of the file
+ * @param int flags open(2) flags
+ *
+ * @return the file descriptor, or -1 if the file cannot be opened or is
+ * written by another process.
+ */
+int db_open_file(const char* file_name, int flags)
+{
+    int fd = open(file_name, flags & ~O_TRUNC, 0666);
+    if(fd == -1 || (flags & O_ACCMODE) == O_RDONLY) {
+        return fd;
+    }
+    if(flock(fd, LOCK_EX | LOCK_NB) != 0 || ((flags & O_TRUNC) && ftruncate(fd, 0) != 0)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Reset the fields of a pictdb_file before opening it
+ *
+ * @param pictdb_file* A pointer to a structure in memory with header and metadata.
+ */
+static void init_pictdb_file(struct pictdb_file* db_file)
+{
+    db_file->fd = -1;
+    db_file->file_size = 0;
+    db_file->metadata = NULL;
+    db_file->map = NULL;
+    db_file->map_size = 0;
+    db_file->index.id_table = NULL;
+    db_file->index.sha_table = NULL;
+    db_file->index.free_slots = NULL;
+    memset(&db_file->columns, 0, sizeof(db_file->columns));
+    memset(&db_file->dedup, 0, sizeof(db_file->dedup));
+    init_write_back(db_file);
+    db_file->journal.name = NULL;
+    db_file->journal.fd = -1;
+    db_file->journal.size = 0;
+    memset(&db_file->extents, 0, sizeof(db_file->extents));
+    memset(&db_file->segments, 0, sizeof(db_file->segments));
+}
+
+/**
+ * @brief Open the database file and read its header
+ *
+ * @param const char* file_name name of the file
+ * @param const char* opening_mode of the file
+ * @param pictdb_file* A pointer to a structure in memory with header and metadata.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+static int open_and_read_header(const char* file_name, const char* opening_mode, struct pictdb_file* db_file)
+{
+    init_pictdb_file(db_file);
+
+    int flags = open_flags(opening_mode);
+    if(flags == -1) {
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    db_file->fd = db_open_file(file_name, flags);
+    if(db_file->fd == -1) {
+        return ERR_IO;
+    }
+
+    //Changes committed to the journal before a crash are written first, by
+    //the process writing the database only: a reader sees the database as
+    //it was before them, and the journal of a running writer is left alone
+    int check = 0;
+    if((flags & O_ACCMODE) != O_RDONLY && !(flags & O_TRUNC)) {
+        check = journal_replay(file_name);
+        if(check == 0) {
+            //Then the move of an interrupted compaction
+            check = compact_recover(file_name);
+        }
+        if(check != 0) {
+            return check;
+        }
+    }
+    check = journal_init(db_file, file_name);
+    if(check != 0) {
+        return check;
+    }
+
+    struct stat st;
+    if(fstat(db_file->fd, &st) != 0) {
+        return ERR_IO;
+    }
+    db_file->file_size = st.st_size;
+
+    check = db_pread(db_file, &db_file->header, sizeof(struct pictdb_header), 0);
+    if(check != 0) {
+        return check;
+    }
+
+    //Older databases have garbage in flags and dead_bytes: no option set,
+    //dead_bytes counted again once the free extents are found
+    if((db_file->header.flags & HEADER_MAGIC_MASK) != HEADER_MAGIC) {
+        db_file->header.flags = HEADER_MAGIC;
+        db_file->header.dead_bytes = 0;
+    }
+
+    //Check that header.max_files is not too large before reading
+    if(db_file->header.max_files > max_files_limit(&db_file->header)) {
+        return ERR_IO;
+    }
+    return segments_open(db_file, file_name, flags & O_ACCMODE);
+}
+
 /**
  * @brief Open a pictdb_file and read its content (header and metadatas)
  *
- * @param pictdb_file* A pointer to a structure in memory with header and meaq
- dgdgedtadata.
  * @param const char* file_name name of the file
  * @param const char* opening_mode of the file
+ * @param pictdb_file* A pointer to a structure in memory with header and metadata.
  *
  * @return 0 if no errors, otherwise an error.
  */
 int do_open(const char* file_name, const char* opening_mode, struct pictdb_file* db_file)
 {
-    size_t header_result = 0;
-    size_t metadata_result = 0;
-    //Initialize the pointer to NULL
-    db_file->metadata = NULL;
+    int check = open_and_read_header(file_name, opening_mode, db_file);
+    if(check != 0) {
+        return check;
+    }
+
+    if(has_compact_records(&db_file->header)) {
+        return records_read(db_file);
+    }
+
+    //Once header.max_files is initialize, we allocate the memory
+    db_file->metadata = calloc(db_file->header.max_files, sizeof(struct pict_metadata));
+    if(db_file->metadata == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    return db_pread(db_file, db_file->metadata, db_file->header.max_files * sizeof(struct pict_metadata),
+                    sizeof(struct pictdb_header));
+}
+
+/**
+ * @brief Open a pictdb_file and map its header and metadata in memory
+ *
+ * @param const char* file_name name of the file
+ * @param const char* opening_mode of the file
+ * @param pictdb_file* A pointer to a structure in memory with header and metadata.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int do_open_mmap(const char* file_name, const char* opening_mode, struct pictdb_file* db_file)
+{
+    int check = open_and_read_header(file_name, opening_mode, db_file);
+    if(check != 0) {
+        return check;
+    }
 
-    db_file->fpdb = fopen(file_name, opening_mode);
-    if(db_file->fpdb == NULL) {
+    //Compact records are not struct pict_metadata: they are read and decoded
+    if(has_compact_records(&db_file->header)) {
+        return records_read(db_file);
+    }
+
+    size_t map_size = sizeof(struct pictdb_header) + db_file->header.max_files * sizeof(struct pict_metadata);
+    if(db_file->file_size < map_size) {
         return ERR_IO;
-    } else {
+    }
 
-        header_result = fread(&db_file->header, sizeof(struct pictdb_header), 1, db_file->fpdb);
+    //Mapped privately: the metadata only reaches the file through the
+    //write-back, after the journal and the contents it refers to
+    void* map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, db_file->fd, 0);
+    if(map == MAP_FAILED) {
+        return ERR_IO;
+    }
+    db_file->map = map;
+    db_file->map_size = map_size;
+    db_file->metadata = (struct pict_metadata*)((char*)map + sizeof(struct pictdb_header));
+    return 0;
+}
 
-        if(header_result != 1) {
+/**
+ * @brief Read bytes of the database file at a given position, without
+ * moving any shared cursor (safe to call from several threads)
+ *
+ * @param pictdb_file* A pointer to a structure in memory with header and metadata.
+ * @param void* buf Destination of the bytes.
+ * @param size_t len Number of bytes to read.
+ * @param uint64_t offset Position in the file.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int db_pread(const struct pictdb_file* db_file, void* buf, size_t len, uint64_t offset)
+{
+    if(offset >= SEGMENT_OFFSET(1, 0) && is_segmented(db_file)) {
+        return segment_pread(db_file, buf, len, offset);
+    }
+    char* dst = buf;
+    while(len > 0) {
+        ssize_t n = pread(db_file->fd, dst, len, (off_t)offset);
+        if(n <= 0) {
             return ERR_IO;
         }
+        dst += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
 
-        //Check that header.max_files <= MAX_MAX_FILES before reading
-        if(db_file->header.max_files > MAX_MAX_FILES) {
+/**
+ * @brief Write bytes to the database file at a given position
+ *
+ * @param pictdb_file* A pointer to a structure in memory with header and metadata.
+ * @param const void* buf Bytes to write.
+ * @param size_t len Number of bytes to write.
+ * @param uint64_t offset Position in the file.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int db_pwrite(struct pictdb_file* db_file, const void* buf, size_t len, uint64_t offset)
+{
+    if(offset >= SEGMENT_OFFSET(1, 0) && is_segmented(db_file)) {
+        return segment_pwrite(db_file, buf, len, offset);
+    }
+    const char* src = buf;
+    while(len > 0) {
+        ssize_t n = pwrite(db_file->fd, src, len, (off_t)offset);
+        if(n <= 0) {
             return ERR_IO;
         }
+        src += n;
+        len -= n;
+        offset += n;
+    }
+    if(offset > db_file->file_size) {
+        db_file->file_size = offset;
+    }
+    return 0;
+}
 
-        //Once header.max_files is initialize, we allocate the memory
-        db_file->metadata = calloc(db_file->header.max_files, sizeof(struct pict_metadata));
-        if(db_file->metadata == NULL) {
-            return ERR_OUT_OF_MEMORY;
-        }
-
-        metadata_result = fread(db_file->metadata, sizeof(struct pict_metadata), db_file->header.max_files, db_file->fpdb);
-        if (metadata_result != db_file->header.max_files) {
-            return ERR_IO;
-        }
+/**
+ * @brief Write bytes at the end of the database file
+ *
+ * @param pictdb_file* A pointer to a structure in memory with header and metadata.
+ * @param const void* buf Bytes to write.
+ * @param size_t len Number of bytes to write.
+ * @param uint64_t* offset Where the position of the bytes is stored.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int db_append(struct pictdb_file* db_file, const void* buf, size_t len, uint64_t* offset)
+{
+    if(is_segmented(db_file)) {
+        return segment_append(db_file, buf, len, offset);
+    }
+    uint64_t position = db_file->file_size;
+    int check = db_pwrite(db_file, buf, len, position);
+    if(check != 0) {
+        return check;
     }
+    *offset = position;
     return 0;
 }
 
+/**
+ * @brief Position of the bytes the next db_append will write
+ *
+ * @param pictdb_file* A pointer to a structure in memory with header and metadata.
+ *
+ * @return the offset.
+ */
+uint64_t db_end(const struct pictdb_file* db_file)
+{
+    return is_segmented(db_file) ? segment_end(db_file) : db_file->file_size;
+}
+
 /**
  * @brief Close the file of the pictdb_file structure
  *
@@ -125,13 +402,26 @@ int do_open(const char* file_name, const char* opening_mode, struct pictdb_file*
 void do_close(struct pictdb_file* db_file)
 {
     if(db_file != NULL) {
-        if(db_file->fpdb != NULL) {
-            fclose(db_file->fpdb);
+        //Pending changes are written, there is no one to report an error to
+        (void)db_flush(db_file);
+        journal_close(db_file);
+        free_write_back(db_file);
+        extent_free_all(db_file);
+        segments_close(db_file);
+        if(db_file->fd >= 0) {
+            close(db_file->fd);
+            db_file->fd = -1;
         }
-        if(db_file->metadata != NULL) {
+        if(db_file->map != NULL) {
+            munmap(db_file->map, db_file->map_size);
+            db_file->map = NULL;
+            db_file->metadata = NULL;
+        } else if(db_file->metadata != NULL) {
             free(db_file->metadata);
             db_file->metadata = NULL;
         }
+        index_free(db_file);
+        columns_free(db_file);
     }
 }
 
@@ -157,6 +447,47 @@ int resolution_atoi(const char* resolution)
     return -1;
 }
 
+/********************************************************************//**
+ * Variants policy of a database.
+ */
+int variants_policy(const struct pictdb_header* header)
+{
+    if(header == NULL || (header->flags & HEADER_MAGIC_MASK) != HEADER_MAGIC) {
+        return VARIANTS_LAZY;
+    }
+    int policy = header->flags & FLAG_VARIANTS;
+    return policy == VARIANTS_SYNC || policy == VARIANTS_BACKGROUND ? policy : VARIANTS_LAZY;
+}
+
+/********************************************************************//**
+ * Largest max_files of a database.
+ */
+uint32_t max_files_limit(const struct pictdb_header* header)
+{
+    if((header->flags & HEADER_MAGIC_MASK) == HEADER_MAGIC && (header->flags & FLAG_SEGMENTED)) {
+        return MAX_MAX_FILES_SEGMENTED;
+    }
+    return MAX_MAX_FILES;
+}
+
+/********************************************************************//**
+ * Variants policy code from its name.
+ */
+int variants_policy_atoi(const char* policy)
+{
+    if(policy == NULL) {
+        return -1;
+    }
+    if(!strcmp(policy, "lazy")) {
+        return VARIANTS_LAZY;
+    } else if(!strcmp(policy, "sync")) {
+        return VARIANTS_SYNC;
+    } else if(!strcmp(policy, "background")) {
+        return VARIANTS_BACKGROUND;
+    }
+    return -1;
+}
+
 
 
 
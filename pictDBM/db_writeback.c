@@ -0,0 +1,373 @@
+/**
+ * @file db_writeback.c
+ * @brief Write-back of the header and metadata of an opened pictDB.
+ *
+ * write_header and write_metadata only mark what changed. Each change
+ * (an insertion, a deletion, a resize) ends with db_commit, which writes
+ * everything pending once enough changes are gathered or the oldest one is
+ * too old: the header in one write, and each run of consecutive metadata
+ * in one write. Unless the fsync policy is FSYNC_NONE, they are first
+ * committed to the journal (see db_journal.c), synced once per write.
+ *
+ * By default every change is written right away and never synced, as
+ * before the write-back existed.
+ *
+ * @date 16 October 2026
+ */
+
+#define _POSIX_C_SOURCE 200809L // for clock_gettime, fdatasync
+
+#include "pictDB.h"
+#include "db_journal.h"
+#include "db_extent.h"
+#include "db_segment.h"
+#include "db_record.h"
+#include "db_columns.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h> // for fdatasync
+
+/**
+* @brief Current time in milliseconds, from an arbitrary origin.
+*/
+static uint64_t now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/**
+ * @brief Reset the write-back of a pictdb_file: nothing pending, every
+ * change written right away, no fsync.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ */
+void init_write_back(struct pictdb_file* db_file)
+{
+    memset(&db_file->write_back, 0, sizeof(db_file->write_back));
+    db_file->write_back.batch = 1;
+    db_file->write_back.fsync_policy = FSYNC_NONE;
+}
+
+/**
+ * @brief Free the memory used by the write-back (pending changes are lost).
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ */
+void free_write_back(struct pictdb_file* db_file)
+{
+    if(db_file != NULL) {
+        free(db_file->write_back.dirty);
+        db_file->write_back.dirty = NULL;
+        db_file->write_back.dirty_words = 0;
+        untrack_changes(db_file);
+    }
+}
+
+/**
+ * @brief Choose when the changes are written and synced.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ * @param batch Number of changes gathered before writing them (1: right away).
+ * @param interval_ms Maximal age of a pending change in milliseconds (0: no limit).
+ * @param fsync_policy FSYNC_NONE, FSYNC_BATCH or FSYNC_ALWAYS.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int set_write_back(struct pictdb_file* db_file, uint32_t batch, uint32_t interval_ms, int fsync_policy)
+{
+    if(db_file == NULL || batch == 0
+       || (fsync_policy != FSYNC_NONE && fsync_policy != FSYNC_BATCH && fsync_policy != FSYNC_ALWAYS)) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    db_file->write_back.batch = batch;
+    db_file->write_back.interval_ms = interval_ms;
+    db_file->write_back.fsync_policy = fsync_policy;
+    return 0;
+}
+
+/**
+ * @brief Start remembering which metadata change, until untrack_changes
+ * (see write_back.changed).
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int track_changes(struct pictdb_file* db_file)
+{
+    untrack_changes(db_file);
+    db_file->write_back.changed = calloc((db_file->header.max_files + 63) / 64 + 1, sizeof(uint64_t));
+    return db_file->write_back.changed == NULL ? ERR_OUT_OF_MEMORY : 0;
+}
+
+/**
+ * @brief Stop remembering which metadata change.
+ *
+ * @param db_file A pointer to a structure in memory with header and metadata.
+ */
+void untrack_changes(struct pictdb_file* db_file)
+{
+    free(db_file->write_back.changed);
+    db_file->write_back.changed = NULL;
+}
+
+/**
+* @brief Remember when the oldest pending change was made.
+*/
+static void mark_pending(struct write_back* write_back)
+{
+    if(!write_back->header_dirty && write_back->nb_dirty == 0) {
+        write_back->since_ms = now_ms();
+    }
+}
+
+/**
+ * @brief Mark the in-memory header as to be written to the database file.
+ *
+ * @param pictdb_file* A pointer to a structure in memory with header and metadata.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int write_header(struct pictdb_file* db_file)
+{
+    mark_pending(&db_file->write_back);
+    db_file->write_back.header_dirty = 1;
+    return 0;
+}
+
+/**
+ * @brief Mark one in-memory metadata as to be written to the database file.
+ *
+ * @param pictdb_file* A pointer to a structure in memory with header and metadata.
+ * @param size_t index Position of the metadata to write.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int write_metadata(struct pictdb_file* db_file, size_t index)
+{
+    return write_metadata_range(db_file, index, 1);
+}
+
+/**
+ * @brief Mark consecutive in-memory metadata as to be written to the database file.
+ *
+ * @param pictdb_file* A pointer to a structure in memory with header and metadata.
+ * @param size_t first Position of the first metadata to write.
+ * @param size_t count Number of metadata to write.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int write_metadata_range(struct pictdb_file* db_file, size_t first, size_t count)
+{
+    if(first > db_file->header.max_files || count > db_file->header.max_files - first) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    struct write_back* write_back = &db_file->write_back;
+    if(write_back->dirty == NULL) {
+        write_back->dirty_words = (db_file->header.max_files + 63) / 64;
+        write_back->dirty = calloc(write_back->dirty_words + 1, sizeof(uint64_t));
+        if(write_back->dirty == NULL) {
+            write_back->dirty_words = 0;
+            return ERR_OUT_OF_MEMORY;
+        }
+    }
+    mark_pending(write_back);
+    for(size_t i = first; i < first + count; i++) {
+        uint64_t bit = UINT64_C(1) << (i % 64);
+        if(!(write_back->dirty[i / 64] & bit)) {
+            write_back->dirty[i / 64] |= bit;
+            write_back->nb_dirty += 1;
+        }
+        if(write_back->changed != NULL) {
+            write_back->changed[i / 64] |= bit;
+        }
+    }
+    columns_update(db_file, first, count);
+    return 0;
+}
+
+/**
+* @brief Write the pages of compact records holding pending metadata, one
+* write per run of consecutive pages.
+*/
+static int write_dirty_pages(struct pictdb_file* db_file)
+{
+    struct write_back* write_back = &db_file->write_back;
+    uint32_t pages = (db_file->header.max_files + RECORDS_PER_PAGE - 1) / RECORDS_PER_PAGE;
+    uint32_t page = 0;
+    while(write_back->nb_dirty > 0 && page < pages) {
+        if(record_page_dirty(write_back, page) == 0) {
+            page += 1;
+            continue;
+        }
+        uint32_t end = page;
+        uint64_t bits = 0;
+        while(end < pages && (bits = record_page_dirty(write_back, end)) != 0) {
+            uint32_t first = end * RECORDS_PER_PAGE;
+            write_back->dirty[first / 64] &= ~(bits << (first % 64));
+            write_back->nb_dirty -= __builtin_popcountll(bits);
+            end += 1;
+        }
+        int check = records_write(db_file, page, end);
+        if(check != 0) {
+            return check;
+        }
+        page = end;
+    }
+    return 0;
+}
+
+/**
+* @brief Write the pending metadata, one write per run of consecutive positions.
+*/
+static int write_dirty_metadata(struct pictdb_file* db_file)
+{
+    if(has_compact_records(&db_file->header)) {
+        return write_dirty_pages(db_file);
+    }
+    struct write_back* write_back = &db_file->write_back;
+    uint32_t i = 0;
+    while(write_back->nb_dirty > 0 && i < db_file->header.max_files) {
+        uint64_t word = write_back->dirty[i / 64] >> (i % 64);
+        if(word == 0) {
+            i = (i / 64 + 1) * 64;
+            continue;
+        }
+        i += __builtin_ctzll(word);
+        uint32_t end = i;
+        while(end < db_file->header.max_files && (write_back->dirty[end / 64] >> (end % 64)) & 1) {
+            write_back->dirty[end / 64] &= ~(UINT64_C(1) << (end % 64));
+            end += 1;
+        }
+        write_back->nb_dirty -= end - i;
+        int check = db_pwrite(db_file, &db_file->metadata[i], (end - i) * sizeof(struct pict_metadata),
+                              sizeof(struct pictdb_header) + (uint64_t)i * sizeof(struct pict_metadata));
+        if(check != 0) {
+            return check;
+        }
+        i = end;
+    }
+    return 0;
+}
+
+/**
+ * @brief Sync the database file to the disk.
+ *
+ * @param pictdb_file* A pointer to a structure in memory with header and metadata.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int db_sync_file(struct pictdb_file* db_file)
+{
+    if(fdatasync(db_file->fd) != 0) {
+        return ERR_IO;
+    }
+    return segment_sync(db_file);
+}
+
+/**
+ * @brief Write everything pending. Unless the fsync policy is FSYNC_NONE,
+ * it is committed to the journal first.
+ *
+ * @param pictdb_file* A pointer to a structure in memory with header and metadata.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int db_flush(struct pictdb_file* db_file)
+{
+    if(db_file == NULL || db_file->fd < 0) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    struct write_back* write_back = &db_file->write_back;
+    if(!write_back->header_dirty && write_back->nb_dirty == 0) {
+        return 0;
+    }
+
+    int journaled = write_back->fsync_policy != FSYNC_NONE && db_file->journal.name != NULL;
+    int check = journaled ? journal_commit(db_file) : 0;
+
+    //The metadata before the header: the header only counts valid metadata
+    if(check == 0) {
+        check = write_dirty_metadata(db_file);
+    }
+    if(check == 0 && write_back->header_dirty) {
+        check = db_pwrite(db_file, &db_file->header, sizeof(struct pictdb_header), 0);
+    }
+    if(check != 0) {
+        return check;
+    }
+    write_back->header_dirty = 0;
+    write_back->pending = 0;
+    //The deleted images are not referred to on the disk anymore
+    extent_release_pending(db_file);
+
+    //What is written in place is synced when the journal is emptied
+    return journaled ? journal_checkpoint(db_file, 0) : 0;
+}
+
+/**
+ * @brief Write everything pending and sync the file, whatever the fsync policy.
+ *
+ * @param pictdb_file* A pointer to a structure in memory with header and metadata.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int db_sync(struct pictdb_file* db_file)
+{
+    int check = db_flush(db_file);
+    if(check != 0) {
+        return check;
+    }
+    if(db_file->journal.fd != -1) {
+        return journal_checkpoint(db_file, 1);
+    }
+    return db_sync_file(db_file);
+}
+
+/**
+ * @brief Write everything pending if the oldest pending change is older
+ * than the interval of the write-back.
+ *
+ * @param pictdb_file* A pointer to a structure in memory with header and metadata.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int db_flush_if_due(struct pictdb_file* db_file)
+{
+    if(db_file == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    struct write_back* write_back = &db_file->write_back;
+    if(!write_back->header_dirty && write_back->nb_dirty == 0) {
+        return 0;
+    }
+    if(write_back->interval_ms == 0 || now_ms() - write_back->since_ms < write_back->interval_ms) {
+        return 0;
+    }
+    return db_flush(db_file);
+}
+
+/**
+ * @brief End a change of the database: everything pending is written when
+ * the batch is full, when the oldest pending change is older than the
+ * interval, or always with FSYNC_ALWAYS.
+ *
+ * @param pictdb_file* A pointer to a structure in memory with header and metadata.
+ *
+ * @return 0 if no errors, otherwise an error.
+ */
+int db_commit(struct pictdb_file* db_file)
+{
+    if(db_file == NULL) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    struct write_back* write_back = &db_file->write_back;
+    write_back->pending += 1;
+    if(write_back->pending >= write_back->batch || write_back->fsync_policy == FSYNC_ALWAYS) {
+        return db_flush(db_file);
+    }
+    return db_flush_if_due(db_file);
+}
@@ -14,12 +14,13 @@ extern "C" {
 #endif
 
 /**
-* @brief Compare two values of SHA-hash.
-* @param a the first SHA-hash.
-* @param b the second SHA-hash.
-* @return 0 if they are identical, 1 otherwise.
+* @brief De-deplicate two images with the same content.
+* @param db_file Pointer to a pictdb_file structure.
+* @param metadata The metadata of the given image, not in the table yet.
+* @param index Position the given image is to take.
+* @return 0 if we made a de-deplication or if no duplicata, else, an error code.
 */
-int do_name_and_content_dedup(struct pictdb_file* db_file, uint32_t index);
+int do_name_and_content_dedup(struct pictdb_file* db_file, struct pict_metadata* metadata, uint32_t index);
 
 #ifdef __cplusplus
 }
@@ -2,12 +2,20 @@
  * @file image_content.c
  * @brief Resize an existing image.
  *
+ * The resized images are created in three steps, so that a server can
+ * resize without holding the lock of the database: the original is read
+ * (variants_prepare), resized and encoded (variants_resize, which does
+ * not use the database), then written (variants_store).
+ *
  * @date 29 April 2016
  */
 
 #include "pictDB.h"
+#include "image_content.h"
+#include "db_extent.h"
 #include <vips/vips.h>
 #include <stdlib.h>
+#include <string.h>
 
 /**
 * @brief Compute the ratio between the old resolution and the new one.
@@ -26,105 +34,275 @@ double shrink_value(VipsImage *image,
 }
 
 /**
-* @brief create a new image from an existing one but in a different resolution.
-* @param res Index of the new resolution.
-* @param db_file Pointer to a pictdb_file structure.
-* @param index Postion of the existing image in the metadata.
-* @return O if no error occurs, otherwise an error.
+* @brief Load a JPEG image resized to fit in a given box.
+*
+* With libvips >= 8.6, vips_thumbnail_buffer lets libjpeg decode the image
+* directly at 1/2, 1/4 or 1/8 of its size (shrink-on-load) before the final
+* resize, so the full-size image is never held in memory.
+*
+* @param content The JPEG image.
+* @param len Size of the JPEG image.
+* @param width Maximum width of the result.
+* @param height Maximum height of the result.
+* @param resized Where the resized image is stored (to be unreferenced).
+* @return 0 if no error occurs, otherwise an error.
 */
-int create_image(const int res, struct pictdb_file* db_file, size_t index)
+static int load_resized(void* content, size_t len, int width, int height, VipsImage** resized)
 {
-    int return_value_fseek = fseek(db_file->fpdb, db_file->metadata[index].offset[RES_ORIG], SEEK_SET);
-    if(return_value_fseek != 0) {
-        return ERR_IO;
-    }
-
-    size_t len = db_file->metadata[index].size[RES_ORIG];
-    char* content = malloc(len);
-    if(content == NULL) {
-        return ERR_OUT_OF_MEMORY;
-    }
-
-    int check = fread(content, len, 1, db_file->fpdb);
-    if(check != 1) {
-        return ERR_IO;
+#if VIPS_MAJOR_VERSION > 8 || (VIPS_MAJOR_VERSION == 8 && VIPS_MINOR_VERSION >= 6)
+    if(vips_thumbnail_buffer(content, len, resized, width, "height", height, NULL)) {
+        return ERR_VIPS;
     }
-
+    return 0;
+#else
     //Used to load
     VipsImage* original;
 
-    //some place to do the job
-    VipsObject* process = VIPS_OBJECT( vips_image_new() );
-
-    //we want 1 new images
-    VipsImage** thumbs = (VipsImage**) vips_object_local_array(process, 1 );
-
     //Load the image
     if(vips_jpegload_buffer(content, len, &original, NULL) ) {
         return ERR_VIPS;
     }
 
     //Compute the resizing ratio.
-    double ratio = shrink_value(original, db_file->header.res_resized[2*res], db_file->header.res_resized[2*res + 1]);
+    double ratio = shrink_value(original, width, height);
+    int check = 0;
 
     //Check VIPS_Version
-#if VIPS_MAJOR_VERSION > 7 || (VIPS_MAJOR_VERSION == 7 && MINOR_VERSION > 40)
-    check = vips_resize(original, &thumbs[0], ratio, NULL);
-    if(check != 0) {
+#if VIPS_MAJOR_VERSION > 7 || (VIPS_MAJOR_VERSION == 7 && VIPS_MINOR_VERSION > 40)
+    check = vips_resize(original, resized, ratio, NULL);
+#else
+    if (ratio < 1.0) {
+        ratio = (int) (1./ratio) + 1.0;
+        check = vips_shrink(original, resized, ratio, ratio, NULL);
+    } else {
+        //Already small enough
+        *resized = original;
+        return 0;
+    }
+#endif
+    g_object_unref(original);
+    return check != 0 ? ERR_VIPS : 0;
+#endif
+}
+
+/**
+* @brief Resize an image already in memory to fit in a given box.
+* @param image The image.
+* @param width Maximum width of the result.
+* @param height Maximum height of the result.
+* @param resized Where the resized image is stored (to be unreferenced).
+* @return 0 if no error occurs, otherwise an error.
+*/
+static int resize_loaded(VipsImage* image, int width, int height, VipsImage** resized)
+{
+#if VIPS_MAJOR_VERSION > 8 || (VIPS_MAJOR_VERSION == 8 && VIPS_MINOR_VERSION >= 6)
+    if(vips_thumbnail_image(image, resized, width, "height", height, NULL)) {
+        return ERR_VIPS;
+    }
+#elif VIPS_MAJOR_VERSION > 7 || (VIPS_MAJOR_VERSION == 7 && VIPS_MINOR_VERSION > 40)
+    if(vips_resize(image, resized, shrink_value(image, width, height), NULL)) {
         return ERR_VIPS;
     }
 #else
+    double ratio = shrink_value(image, width, height);
     if (ratio < 1.0) {
         ratio = (int) (1./ratio) + 1.0;
-        check = vips_shrink(original, &thumbs[0], ratio, ratio, NULL);
-        if(check != 0) {
+        if(vips_shrink(image, resized, ratio, ratio, NULL)) {
             return ERR_VIPS;
         }
+    } else {
+        //Already small enough
+        g_object_ref(image);
+        *resized = image;
     }
 #endif
+    return 0;
+}
 
-    char* newContent;
+/**
+* @brief Read the original of an image, if some of the resized images asked
+* for are missing. Reads the database only: a read lock is enough.
+* @param db_file Pointer to a pictdb_file structure.
+* @param index Postion of the existing image in the metadata.
+* @param resolutions Set of VARIANT(res) for the resolutions to create;
+*        those which already exist are skipped.
+* @param variants Where the original is stored (nothing is stored if no
+*        resolution is missing), to be freed with variants_free.
+* @return 0 if no error occurs, otherwise an error.
+*/
+int variants_prepare(const struct pictdb_file* db_file, size_t index, unsigned int resolutions,
+                     struct variants* variants)
+{
+    memset(variants, 0, sizeof(struct variants));
+    if(db_file == NULL || index >= db_file->header.max_files) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    const struct pict_metadata* metadata = &db_file->metadata[index];
+    int missing = 0;
+    for(int res = 0; res < NB_RES; res++) {
+        variants->wanted[res] = res != RES_ORIG && (resolutions & VARIANT(res))
+                                && metadata->size[res] == 0 && metadata->offset[res] == 0;
+        missing = missing || variants->wanted[res];
+    }
+    if(!missing) {
+        return 0;
+    }
 
-    //Save the resized image.
-    if(vips_jpegsave_buffer(thumbs[0], (void**)&newContent, &len, NULL)) {
-        return ERR_VIPS;
+    memcpy(variants->box, db_file->header.res_resized, sizeof(variants->box));
+    variants->orig_offset = metadata->offset[RES_ORIG];
+    variants->original_size = metadata->size[RES_ORIG];
+    variants->original = malloc(variants->original_size);
+    if(variants->original == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    int check = db_pread(db_file, variants->original, variants->original_size, variants->orig_offset);
+    if(check != 0) {
+        free(variants->original);
+        variants->original = NULL;
     }
+    return check;
+}
 
-    //write to the end of the file.
-    return_value_fseek = fseek(db_file->fpdb, 0, SEEK_END);
-    if(return_value_fseek != 0) {
-        return ERR_IO;
+/**
+* @brief Resize and encode the original read by variants_prepare, decoding
+* it only once: when both resolutions are missing, the thumbnail is
+* derived from the small image (if it is at least as large). The database
+* is not used, no lock is needed.
+* @param variants The original, and where the encoded images are stored.
+* @return 0 if no error occurs, otherwise an error.
+*/
+int variants_resize(struct variants* variants)
+{
+    if(variants->original == NULL) {
+        return 0;
     }
-    long int cursorPosition = ftell(db_file->fpdb);
+    const uint16_t* box = variants->box;
+    void* content = variants->original;
+    size_t len = variants->original_size;
+    VipsImage* images[NB_RES] = {NULL};
+    //The largest one is loaded from the original, with shrink-on-load
+    int first = variants->wanted[RES_SMALL] ? RES_SMALL : RES_THUMB;
+    int check = load_resized(content, len, box[2*first], box[2*first + 1], &images[first]);
+
+    if(check == 0 && first == RES_SMALL && variants->wanted[RES_THUMB]) {
+        if(box[2*RES_SMALL] >= box[2*RES_THUMB] && box[2*RES_SMALL + 1] >= box[2*RES_THUMB + 1]) {
+            check = resize_loaded(images[RES_SMALL], box[2*RES_THUMB], box[2*RES_THUMB + 1], &images[RES_THUMB]);
+        } else {
+            check = load_resized(content, len, box[2*RES_THUMB], box[2*RES_THUMB + 1], &images[RES_THUMB]);
+        }
+    }
+    free(variants->original);
+    variants->original = NULL;
+
+    for(int res = 0; res < NB_RES; res++) {
+        if(images[res] != NULL) {
+            if(check == 0 && vips_jpegsave_buffer(images[res], &variants->content[res], &variants->size[res], NULL)) {
+                check = ERR_VIPS;
+            }
+            g_object_unref(images[res]);
+        }
+    }
+    return check;
+}
 
-    check = fwrite(newContent, len, 1, db_file->fpdb);
-    if(check != 1) {
-        return ERR_IO;
+/**
+* @brief Write the images encoded by variants_resize and their metadata,
+* unless the image was deleted or replaced since variants_prepare. The
+* resolutions created meanwhile are kept.
+* @param db_file Pointer to a pictdb_file structure.
+* @param index Postion of the existing image in the metadata.
+* @param variants The encoded images.
+* @return 0 if no error occurs, otherwise an error.
+*/
+int variants_store(struct pictdb_file* db_file, size_t index, const struct variants* variants)
+{
+    int resized = 0;
+    for(int res = 0; res < NB_RES; res++) {
+        resized = resized || variants->content[res] != NULL;
+    }
+    if(!resized) {
+        return 0;
+    }
+    if(db_file == NULL || index >= db_file->header.max_files) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    struct pict_metadata* metadata = &db_file->metadata[index];
+    if(metadata->is_valid != NON_EMPTY || metadata->offset[RES_ORIG] != variants->orig_offset) {
+        return ERR_FILE_NOT_FOUND;
     }
 
-    free(content);
-    content = NULL;
-    g_free(newContent);
-    g_object_unref( process );
-    //Update image in memory
-    db_file->metadata[index].offset[res] = cursorPosition;
-    db_file->metadata[index].size[res] = len;
+    int check = 0;
+    int written = 0;
+    for(int res = 0; res < NB_RES && check == 0; res++) {
+        if(variants->content[res] != NULL && metadata->size[res] == 0 && metadata->offset[res] == 0) {
+            //write in a free extent or at the end of the file.
+            check = db_write_content(db_file, variants->content[res], variants->size[res], &metadata->offset[res]);
+            if(check == 0) {
+                metadata->size[res] = (uint32_t)variants->size[res];
+                check = blob_ref(db_file, metadata->offset[res]);
+                written = 1;
+            }
+        }
+    }
+    if(check != 0 || !written) {
+        return check;
+    }
 
-    //Update the metadata in file
-    return_value_fseek = fseek(db_file->fpdb, sizeof(struct pictdb_header) + index * sizeof(struct pict_metadata), SEEK_SET);
-    if(return_value_fseek != 0) {
-        return ERR_IO;
+    //Update the metadata in file (and dead_bytes, if free space was reused)
+    check = write_header(db_file);
+    if(check == 0) {
+        check = write_metadata(db_file, index);
     }
-    check = fwrite(&db_file->metadata[index], sizeof(struct pict_metadata), 1, db_file->fpdb);
-    if(check != 1) {
-        return ERR_IO;
+    if(check != 0) {
+        return check;
     }
+    return db_commit(db_file);
+}
 
-    return 0;
+/**
+* @brief Free what variants_prepare and variants_resize allocated.
+* @param variants The resized images.
+*/
+void variants_free(struct variants* variants)
+{
+    free(variants->original);
+    variants->original = NULL;
+    for(int res = 0; res < NB_RES; res++) {
+        if(variants->content[res] != NULL) {
+            g_free(variants->content[res]);
+            variants->content[res] = NULL;
+        }
+    }
 }
 
 /**
-* @brief Resize an existing image.
+* @brief Create several resized images from an existing one, decoding the
+* original only once. When both are asked for, the thumbnail is derived
+* from the small image (if it is at least as large), and the metadata is
+* written once for all of them.
+* @param db_file Pointer to a pictdb_file structure.
+* @param index Postion of the existing image in the metadata.
+* @param resolutions Set of VARIANT(res) for the resolutions to create;
+*        those which already exist are skipped.
+* @return O if no error occurs, otherwise an error.
+*/
+int create_variants(struct pictdb_file* db_file, size_t index, unsigned int resolutions)
+{
+    struct variants variants;
+    int check = variants_prepare(db_file, index, resolutions, &variants);
+    if(check == 0) {
+        check = variants_resize(&variants);
+    }
+    if(check == 0) {
+        check = variants_store(db_file, index, &variants);
+    }
+    variants_free(&variants);
+    return check;
+}
+
+/**
+* @brief Resize an existing image. The other resized image is created in the
+* same pass if it is missing too.
 * @param res Index of the new resolution.
 * @param db_file Pointer to a pictdb_file structure.
 * @param index Postion of the existing image in the metadata.
@@ -155,7 +333,71 @@ int lazily_resize(const int res, struct pictdb_file* db_file, size_t index)
     }
 
     //0 if no error occured !
-    return create_image(res, db_file, index);
+    return create_variants(db_file, index, ALL_VARIANTS);
+}
+
+/**
+* @brief Read the dimensions of a JPEG image from its SOFn segment, without
+* decoding it: the markers are walked until the frame header, the
+* entropy-coded data is never touched.
+*
+* @param height Pointer which store the address of the height.
+* @param width Pointer which store the address of the width.
+* @param buffer Pointer to the memory region where the JPEG image is stored.
+* @param size size of the memory region where the JPEG image is stored.
+*
+* @return 0 if the dimensions were found, 1 otherwise.
+*/
+static int parse_jpeg_resolution(uint32_t* height, uint32_t* width, const unsigned char* buffer, size_t size)
+{
+    //SOI marker
+    if(size < 4 || buffer[0] != 0xFF || buffer[1] != 0xD8) {
+        return 1;
+    }
+
+    size_t pos = 2;
+    while(pos + 4 <= size) {
+        if(buffer[pos] != 0xFF) {
+            return 1;
+        }
+        //Markers may be preceded by fill bytes
+        while(pos < size && buffer[pos] == 0xFF) {
+            pos += 1;
+        }
+        if(pos >= size) {
+            return 1;
+        }
+        unsigned char marker = buffer[pos];
+        pos += 1;
+
+        //Standalone markers have no length
+        if(marker == 0x01 || (marker >= 0xD0 && marker <= 0xD8)) {
+            continue;
+        }
+        //No frame header before the scan or the end of the image
+        if(marker == 0xD9 || marker == 0xDA || pos + 2 > size) {
+            return 1;
+        }
+
+        size_t length = ((size_t)buffer[pos] << 8) | buffer[pos + 1];
+        if(length < 2) {
+            return 1;
+        }
+
+        //SOF0..SOF15, except DHT (C4), JPG (C8) and DAC (CC)
+        if(marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+            //length (2), precision (1), height (2), width (2)
+            if(length < 7 || pos + 7 > size) {
+                return 1;
+            }
+            *height = ((uint32_t)buffer[pos + 3] << 8) | buffer[pos + 4];
+            *width = ((uint32_t)buffer[pos + 5] << 8) | buffer[pos + 6];
+            //A zero height is defined later by a DNL marker: let vips handle it
+            return (*height == 0 || *width == 0) ? 1 : 0;
+        }
+        pos += length;
+    }
+    return 1;
 }
 
 /**
@@ -173,7 +415,12 @@ int get_resolution(uint32_t* height, uint32_t* width, const char* image_buffer,
     if(image_buffer == NULL || height == NULL || width == NULL) {
         return ERR_INVALID_ARGUMENT;
     }
-    //Used to load
+
+    if(parse_jpeg_resolution(height, width, (const unsigned char*)image_buffer, image_size) == 0) {
+        return 0;
+    }
+
+    //Fallback for the images the parser does not understand
     VipsImage* original;
 
     //Load the image
@@ -181,14 +428,9 @@ int get_resolution(uint32_t* height, uint32_t* width, const char* image_buffer,
         return ERR_VIPS;
     }
 
-    int w = vips_image_get_width(original);
-    int h = vips_image_get_height(original);
-
-    *height = h;
-    *width = w;
+    *height = vips_image_get_height(original);
+    *width = vips_image_get_width(original);
+    g_object_unref(original);
 
     return 0;
 }
-
-
-
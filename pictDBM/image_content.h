@@ -10,12 +10,80 @@
 
 #include "pictDB.h"
 
+/* Sets of resolutions for create_variants */
+#define VARIANT(res) (1u << (res))
+#define ALL_VARIANTS (VARIANT(RES_THUMB) | VARIANT(RES_SMALL))
+
+/**
+* @brief Resized images created from an existing one, see variants_prepare.
+*/
+struct variants {
+    int wanted[NB_RES];                 // resolutions missing when prepared
+    uint16_t box[2*(NB_RES-1)];         // header.res_resized
+    uint64_t orig_offset;               // of the original they are made from
+    char* original;                     // its content, until resized
+    size_t original_size;
+    void* content[NB_RES];              // encoded images (g_free)
+    size_t size[NB_RES];
+};
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 /**
-* @brief Resize an existing image.
+* @brief Create several resized images from an existing one, decoding the
+* original only once and writing the metadata once.
+* @param db_file Pointer to a pictdb_file structure.
+* @param index Postion of the existing image in the metadata.
+* @param resolutions Set of VARIANT(res) for the resolutions to create;
+*        those which already exist are skipped.
+* @return O if no error occurs, otherwise an error.
+*/
+int create_variants(struct pictdb_file* db_file, size_t index, unsigned int resolutions);
+
+/**
+* @brief Read the original of an image, if some of the resized images asked
+* for are missing. Reads the database only: a read lock is enough.
+* @param db_file Pointer to a pictdb_file structure.
+* @param index Postion of the existing image in the metadata.
+* @param resolutions Set of VARIANT(res) for the resolutions to create;
+*        those which already exist are skipped.
+* @param variants Where the original is stored (nothing is stored if no
+*        resolution is missing), to be freed with variants_free.
+* @return 0 if no error occurs, otherwise an error.
+*/
+int variants_prepare(const struct pictdb_file* db_file, size_t index, unsigned int resolutions,
+                     struct variants* variants);
+
+/**
+* @brief Resize and encode the original read by variants_prepare. The
+* database is not used, no lock is needed.
+* @param variants The original, and where the encoded images are stored.
+* @return 0 if no error occurs, otherwise an error.
+*/
+int variants_resize(struct variants* variants);
+
+/**
+* @brief Write the images encoded by variants_resize and their metadata,
+* unless the image was deleted or replaced since variants_prepare. The
+* resolutions created meanwhile are kept.
+* @param db_file Pointer to a pictdb_file structure.
+* @param index Postion of the existing image in the metadata.
+* @param variants The encoded images.
+* @return 0 if no error occurs, otherwise an error.
+*/
+int variants_store(struct pictdb_file* db_file, size_t index, const struct variants* variants);
+
+/**
+* @brief Free what variants_prepare and variants_resize allocated.
+* @param variants The resized images.
+*/
+void variants_free(struct variants* variants);
+
+/**
+* @brief Resize an existing image. The other resized image is created in the
+* same pass if it is missing too.
 * @param res Index of the new resolution.
 * @param db_file Pointer to a pictdb_file structure.
 * @param index Postion of the existing image in the metadata.
@@ -11,6 +11,10 @@
  * because it should be stored as raw bytes appended at the end of the
  * database file and addressed by offsets in the metadata structure.
  *
+ * With FLAG_COMPACT, the metadata is stored as pages of compact
+ * records instead, the picture ids being kept apart (see db_record.c);
+ * it is the same struct pict_metadata once in memory.
+ *
  * @author Mia Primorac
  * @date 2 Nov 2015
  */
@@ -21,7 +25,7 @@
 #include "error.h" /* not needed here, but provides it as required by
                     * all functions of this lib.
                     */
-#include <stdio.h> // for FILE
+#include <stdio.h> // for size_t
 #include <stdint.h> // for uint32_t, uint64_t
 #include <openssl/sha.h> // for SHA256_DIGEST_LENGTH
 
@@ -31,6 +35,7 @@
 #define MAX_DB_NAME 31  // max. size of a PictDB name
 #define MAX_PIC_ID 127  // max. size of a picture id
 #define MAX_MAX_FILES 100000  // will be increased later in the project
+#define MAX_MAX_FILES_SEGMENTED (1u << 24) // with FLAG_SEGMENTED, the file only holds the metadata
 
 /* For is_valid in pictdb_metadata */
 #define EMPTY 0
@@ -42,6 +47,29 @@
 #define RES_ORIG  2
 #define NB_RES    3
 
+/* For flags in pictdb_header. This field was left uninitialized by the
+ * older versions: the options only count when the upper half holds the tag. */
+#define HEADER_MAGIC      0x50440000u // "PD"
+#define HEADER_MAGIC_MASK 0xFFFF0000u
+#define FLAG_VARIANTS     0x00000003u // variants policy, see below
+#define FLAG_SEGMENTED    0x00000004u // contents in "<db>.seg.N" files, see db_segment.c
+#define FLAG_COMPACT      0x00000008u // metadata stored as pages of struct pict_record
+#define FLAG_SEGMENT_SIZE 0x00003F00u // log2 of the size of a segment (0: default)
+#define SEGMENT_SIZE_SHIFT 8          // position of FLAG_SEGMENT_SIZE
+#define DEFAULT_SEGMENT_SHIFT 30      // 1 GiB
+
+/* Offsets of the contents of a segmented database: segment number (from 1)
+ * in the upper bits, position in the segment in the lower ones. */
+#define SEGMENT_BITS 40
+#define SEGMENT_OFFSET(number, position) (((uint64_t)(number) << SEGMENT_BITS) | (uint64_t)(position))
+#define SEGMENT_NUMBER(offset)   ((uint32_t)((offset) >> SEGMENT_BITS))
+#define SEGMENT_POSITION(offset) ((offset) & ((UINT64_C(1) << SEGMENT_BITS) - 1))
+
+/* Variants policy: when the thumbnail and small images are created */
+#define VARIANTS_LAZY       0 // by do_read, on the first read of each image
+#define VARIANTS_SYNC       1 // by do_insert
+#define VARIANTS_BACKGROUND 2 // by the server, right after the insertion
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -55,8 +83,8 @@ struct pictdb_header {
     uint32_t num_files;
     uint32_t max_files;
     uint16_t res_resized[2*(NB_RES-1)];
-    uint32_t unused_32;
-    uint64_t unused_64;
+    uint32_t flags; // HEADER_MAGIC | options
+    uint64_t dead_bytes; // bytes of the data no valid metadata refers to
 };
 
 /**
@@ -71,13 +99,177 @@ struct pict_metadata {
     uint16_t is_valid;
     uint16_t unused_16;
 };
+
+/**
+* @brief Metadata of an image as stored with FLAG_COMPACT: the
+* picture id is in the heap of the page holding the record.
+*/
+struct pict_record {
+    uint64_t id_hash; // index_hash_id of pict_id
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    uint64_t offset[NB_RES];
+    uint32_t size[NB_RES];
+    uint32_t res_orig[2];
+    uint16_t id_offset; // position of pict_id in the heap of the page
+    uint8_t id_length;  // without the final '\0'
+    uint8_t is_valid;
+};
+
+/* A page of compact records: RECORDS_PER_PAGE records, then the heap of
+ * their picture ids, one after the other without '\0'. */
+#define RECORD_PAGE      4096
+#define RECORDS_PER_PAGE 32
+#define RECORD_HEAP      (RECORD_PAGE - RECORDS_PER_PAGE * sizeof(struct pict_record))
+/**
+* @brief In-memory indexes over the metadata, see db_index.h.
+*/
+struct pict_index {
+    uint32_t* id_table;  // positions in the metadata, hashed by pict_id
+    uint32_t* sha_table; // positions in the metadata, hashed by SHA
+    uint32_t capacity;   // number of entries of each table (power of two)
+    uint64_t* free_slots; // bitmap of the empty positions in the metadata
+    uint32_t free_words;  // number of words of the bitmap
+    uint32_t free_hint;   // no empty position in the words before this one
+};
+
+/**
+* @brief In-memory copy of the fields of the metadata scanned most, one
+* array per field, see db_columns.h.
+*/
+struct pict_columns {
+    uint64_t* valid;      // bitmap of the valid metadata, NULL until built
+    uint32_t* id_hash;    // low bits of index_hash_id of each picture id
+    uint32_t* sha_prefix; // first bytes of each SHA
+    uint32_t count;       // number of metadata copied
+};
+
+/**
+* @brief Counters of the content de-duplication since the database was opened.
+*/
+struct dedup_stats {
+    uint64_t hits;        // inserted images whose content was already stored
+    uint64_t misses;      // inserted images with a new content
+    uint64_t saved_bytes; // bytes not written thanks to the hits
+};
+
+/* fsync policies of the write-back */
+#define FSYNC_NONE   0 // left to the system
+#define FSYNC_BATCH  1 // after each write of the pending changes
+#define FSYNC_ALWAYS 2 // after each change (which is then written right away)
+
+/**
+* @brief Changes of the header and metadata not written yet, see db_writeback.c.
+*/
+struct write_back {
+    uint64_t* dirty;       // bitmap of the metadata to write
+    uint32_t dirty_words;  // number of words of the bitmap
+    uint32_t nb_dirty;     // number of metadata to write
+    int header_dirty;      // 1 if the header must be written
+    uint32_t pending;      // changes committed since the last write
+    uint64_t since_ms;     // time of the oldest change not written
+    uint32_t batch;        // write once this many changes are committed
+    uint32_t interval_ms;  // or once the oldest is this old (0: no limit)
+    int fsync_policy;
+    uint64_t* changed;     // bitmap of the metadata changed since track_changes, or NULL
+};
+
+/**
+* @brief A range of bytes of the database file.
+*/
+struct extent {
+    uint64_t offset;
+    uint64_t size;
+};
+
+/**
+* @brief Number of pictures referring to each content, see db_extent.c.
+*/
+struct blob_refs {
+    uint64_t* offsets; // hashed positions of the contents, 0 if unused
+    uint32_t* counts;
+    uint32_t capacity; // power of two
+    uint32_t used;
+    int built;         // 0 until the first deletion
+};
+
+/**
+* @brief Ranges of the database file no picture refers to, see db_extent.c.
+*/
+struct free_extents {
+    struct extent* free;    // sorted by offset, never adjacent
+    size_t nb_free;
+    size_t allocated;
+    struct extent* pending; // freed by changes not written yet
+    size_t nb_pending;
+    size_t pending_allocated;
+    int built;              // 0 until the first allocation
+    struct blob_refs refs;
+};
+
+/**
+* @brief Data files of a segmented database, see db_segment.c.
+*/
+struct segments {
+    char* base;         // name of the database file, NULL if not segmented
+    int* fds;           // by number - 1, -1 once collected
+    uint64_t* sizes;
+    uint32_t count;     // highest number, the one written to
+    uint32_t allocated;
+    uint64_t limit;     // size from which new contents go to a new segment
+};
+
+/**
+* @brief Write-ahead journal of the database, see db_journal.c.
+*/
+struct journal {
+    char* name;    // <database>.journal
+    int fd;        // -1 until the first record
+    uint64_t size; // bytes of records since the last checkpoint
+};
+
 /**
 * @brief Describe a picture with the file, metadata and the header.
 */
 struct pictdb_file {
-    FILE* fpdb;
+    int fd;              // database file, accessed with positional I/O only
+    uint64_t file_size;  // current end of the file, where new content is appended
     struct pictdb_header header;
-    struct pict_metadata* metadata;
+    struct pict_metadata* metadata; // points into map when opened with do_open_mmap
+    void* map;       // mapping of the header and metadata, NULL if not mapped
+    size_t map_size;
+    struct pict_index index;
+    struct pict_columns columns;
+    struct dedup_stats dedup;
+    struct write_back write_back;
+    struct journal journal;
+    struct free_extents extents;
+    struct segments segments;
+};
+
+struct moved_blob;
+
+/**
+* @brief A garbage collection running while the database is used, see
+* db_gbcollect.c.
+*/
+struct online_gc {
+    struct pictdb_file source; // header and metadata when it started, same file
+    struct pictdb_file temp;   // the new database, with the same positions
+    char* temp_name;
+    struct moved_blob* moved;  // contents already copied, sorted by old offset
+    size_t nb_moved;
+    size_t moved_allocated;
+};
+
+/**
+* @brief Counters of a bulk import.
+*/
+struct import_stats {
+    size_t imported;        // images inserted
+    size_t duplicates;      // of which sharing the content of another image
+    size_t skipped;         // files which could not be inserted
+    uint64_t bytes_read;    // bytes read from the files
+    uint64_t bytes_written; // bytes appended to the database
 };
 
 /**
@@ -113,7 +305,8 @@ const char* do_list (const struct pictdb_file* file, enum do_list_mode format);
 
 /**
  * @brief Creates the database called db_filename. Writes the header and the
- *        preallocated empty metadata array to database file.
+ *        empty metadata array (sparse, without writing it) to database file.
+ *        The metadata is then mapped in memory, as with do_open_mmap.
  *
  * @param db_file In memory structure with header and metadata.
  */
@@ -121,7 +314,9 @@ int do_create(const char* file_name, struct pictdb_file* db_file);
 
 /**
  * @brief Open the file, read the header and metadata and write them
- *       in the picdb_file struct.
+ *       in the picdb_file struct. A writable database is locked until
+ *       do_close (ERR_IO if another process writes it), and its journal
+ *       replayed; a read-only open leaves the journal alone.
  *
  * @param  const char* : the file name
  * @param  const char* : opening mode
@@ -131,6 +326,206 @@ int do_create(const char* file_name, struct pictdb_file* db_file);
  */
 int do_open(const char* file_name, const char* opening_mode, struct pictdb_file* db_file);
 
+/**
+ * @brief Open the file and map the header and metadata in memory instead of
+ *        reading them, so that pages are only loaded when they are used.
+ *        The mapping is private: metadata updates are written by the
+ *        write-back, as with do_open. Compact records are read as with
+ *        do_open instead.
+ *
+ * @param  const char* : the file name
+ * @param  const char* : opening mode
+ * @param  const struct picdb_file* db_file : struct where we store the mapped data
+ *
+ * @return 0 if opened correctly, an error otherwise
+ */
+int do_open_mmap(const char* file_name, const char* opening_mode, struct pictdb_file* db_file);
+
+/**
+ * @brief Open a database file. A writable one is locked (flock) as long as
+ *        it is open, so that a single process writes it and replays its
+ *        journal; with O_TRUNC, it is only truncated once locked.
+ *
+ * @param file_name Name of the file.
+ * @param flags open(2) flags.
+ *
+ * @return the file descriptor, or -1 if the file cannot be opened or is
+ *         written by another process.
+ */
+int db_open_file(const char* file_name, int flags);
+
+/**
+ * @brief Read bytes of the database file at a given position. Does not
+ *        depend on any shared cursor, so it can be called from several threads.
+ *
+ * @param db_file In memory structure with header and metadata.
+ * @param buf Destination of the bytes.
+ * @param len Number of bytes to read.
+ * @param offset Position in the file.
+ *
+ * @return 0 if read correctly, an error otherwise
+ */
+int db_pread(const struct pictdb_file* db_file, void* buf, size_t len, uint64_t offset);
+
+/**
+ * @brief Write bytes to the database file at a given position.
+ *
+ * @param db_file In memory structure with header and metadata.
+ * @param buf Bytes to write.
+ * @param len Number of bytes to write.
+ * @param offset Position in the file.
+ *
+ * @return 0 if written correctly, an error otherwise
+ */
+int db_pwrite(struct pictdb_file* db_file, const void* buf, size_t len, uint64_t offset);
+
+/**
+ * @brief Write bytes at the end of the database file (or of the last
+ * segment, see db_segment.c).
+ *
+ * @param db_file In memory structure with header and metadata.
+ * @param buf Bytes to write.
+ * @param len Number of bytes to write.
+ * @param offset Where the position of the written bytes is stored.
+ *
+ * @return 0 if written correctly, an error otherwise
+ */
+int db_append(struct pictdb_file* db_file, const void* buf, size_t len, uint64_t* offset);
+
+/**
+ * @brief Position of the bytes the next db_append will write.
+ *
+ * @param db_file In memory structure with header and metadata.
+ *
+ * @return The offset.
+ */
+uint64_t db_end(const struct pictdb_file* db_file);
+
+/**
+ * @brief Mark the in-memory header as to be written to the database file
+ * (see db_commit).
+ *
+ * @param db_file In memory structure with header and metadata.
+ *
+ * @return 0 if no error occurs, an error otherwise
+ */
+int write_header(struct pictdb_file* db_file);
+
+/**
+ * @brief Mark the in-memory metadata of one picture as to be written to the
+ * database file (see db_commit).
+ *
+ * @param db_file In memory structure with header and metadata.
+ * @param index Position of the metadata.
+ *
+ * @return 0 if no error occurs, an error otherwise
+ */
+int write_metadata(struct pictdb_file* db_file, size_t index);
+
+/**
+ * @brief Mark the in-memory metadata of consecutive pictures as to be
+ * written to the database file (see db_commit).
+ *
+ * @param db_file In memory structure with header and metadata.
+ * @param first Position of the first metadata.
+ * @param count Number of metadata.
+ *
+ * @return 0 if no error occurs, an error otherwise
+ */
+int write_metadata_range(struct pictdb_file* db_file, size_t first, size_t count);
+
+/**
+ * @brief Reset the write-back: nothing pending, every change written right
+ * away, no fsync.
+ *
+ * @param db_file In memory structure with header and metadata.
+ */
+void init_write_back(struct pictdb_file* db_file);
+
+/**
+ * @brief Free the memory used by the write-back.
+ *
+ * @param db_file In memory structure with header and metadata.
+ */
+void free_write_back(struct pictdb_file* db_file);
+
+/**
+ * @brief Choose when the changes are written and synced.
+ *
+ * @param db_file In memory structure with header and metadata.
+ * @param batch Number of changes gathered before writing them (1: right away).
+ * @param interval_ms Maximal age of a pending change in milliseconds (0: no limit).
+ * @param fsync_policy FSYNC_NONE, FSYNC_BATCH or FSYNC_ALWAYS.
+ *
+ * @return 0 if no error occurs, an error otherwise
+ */
+int set_write_back(struct pictdb_file* db_file, uint32_t batch, uint32_t interval_ms, int fsync_policy);
+
+/**
+ * @brief Start remembering which metadata change (write_back.changed).
+ *
+ * @param db_file In memory structure with header and metadata.
+ *
+ * @return 0 if no error occurs, an error otherwise
+ */
+int track_changes(struct pictdb_file* db_file);
+
+/**
+ * @brief Stop remembering which metadata change.
+ *
+ * @param db_file In memory structure with header and metadata.
+ */
+void untrack_changes(struct pictdb_file* db_file);
+
+/**
+ * @brief End a change of the database: the pending header and metadata are
+ * written once the batch is full or the oldest change is too old.
+ *
+ * @param db_file In memory structure with header and metadata.
+ *
+ * @return 0 if no error occurs, an error otherwise
+ */
+int db_commit(struct pictdb_file* db_file);
+
+/**
+ * @brief Write the pending header and metadata (consecutive metadata in one
+ * write). Unless the fsync policy is FSYNC_NONE, they are first committed
+ * to the journal.
+ *
+ * @param db_file In memory structure with header and metadata.
+ *
+ * @return 0 if no error occurs, an error otherwise
+ */
+int db_flush(struct pictdb_file* db_file);
+
+/**
+ * @brief db_flush if the oldest pending change is older than the interval.
+ *
+ * @param db_file In memory structure with header and metadata.
+ *
+ * @return 0 if no error occurs, an error otherwise
+ */
+int db_flush_if_due(struct pictdb_file* db_file);
+
+/**
+ * @brief Sync the database file (header, metadata and contents) and the
+ * last segment to the disk.
+ *
+ * @param db_file In memory structure with header and metadata.
+ *
+ * @return 0 if no error occurs, an error otherwise
+ */
+int db_sync_file(struct pictdb_file* db_file);
+
+/**
+ * @brief Write the pending header and metadata and sync the file, whatever
+ * the fsync policy.
+ *
+ * @param db_file In memory structure with header and metadata.
+ *
+ * @return 0 if no error occurs, an error otherwise
+ */
+int db_sync(struct pictdb_file* db_file);
 
 /**
  * @brief close the file contained in the struct picdb_file.
@@ -159,6 +554,33 @@ int do_delete(const char* picture_name, struct pictdb_file* db_file);
  */
 int resolution_atoi(const char* resolution);
 
+/**
+ * @brief Function that get the variants policy of a database.
+ *
+ * @param header The header of the database.
+ *
+ * @return VARIANTS_LAZY, VARIANTS_SYNC or VARIANTS_BACKGROUND.
+ */
+int variants_policy(const struct pictdb_header* header);
+
+/**
+ * @brief Function that get the variants policy code associated with its name.
+ *
+ * @param policy The policy name (lazy, sync or background).
+ *
+ * @return The policy code, or -1 if the name is unknown.
+ */
+int variants_policy_atoi(const char* policy);
+
+/**
+ * @brief Function that get the largest max_files of a database.
+ *
+ * @param header The header of the database.
+ *
+ * @return MAX_MAX_FILES_SEGMENTED if the database is segmented, MAX_MAX_FILES otherwise.
+ */
+uint32_t max_files_limit(const struct pictdb_header* header);
+
 /**
 * @brief Function that read an image and copies it in a "table" of bytes.
 *
@@ -172,6 +594,18 @@ int resolution_atoi(const char* resolution);
 */
 int do_read(const char* pict_id, const int res, char** data, uint32_t* pict_size, struct pictdb_file* db_file);
 
+/**
+* @brief Function that tells whether do_read has to create the image before
+* reading it (and thus writes to the database).
+*
+* @param pict_id String of char identifying the image.
+* @param res Code of an image resolution.
+* @param db_file Data base.
+*
+* @return 1 if the image must be created, 0 otherwise.
+*/
+int read_needs_resize(const char* pict_id, const int res, struct pictdb_file* db_file);
+
 /**
  * @brief Function that inserts an image in a data base.
  *
@@ -192,6 +626,161 @@ int do_insert(const char* img, const size_t size, const char* pict_id, struct pi
 */
 int do_gbcollect(struct pictdb_file* db_file, const char* filename, const char* temp_filename);
 
+/**
+ * @brief Convert a database to compact records (FLAG_COMPACT),
+ * as a garbage collection to a new file which then replaces it. Nothing
+ * is done if its records are already compact.
+ *
+ * @param db_file In memory structure with header and metadata.
+ * @param filename Name of the database file.
+ * @param temp_filename Name of the new database file.
+ *
+ * @return 0 or an error code if an error occurs (ERR_FULL_DATABASE if
+ * the picture ids do not fit in the pages).
+ */
+int do_convert(struct pictdb_file* db_file, const char* filename, const char* temp_filename);
+
+/**
+ * @brief Compact a database in place, without a second file: the contents
+ * are slid towards the beginning of the data and the file is truncated.
+ * An interrupted compaction is recovered by do_open.
+ *
+ * @param db_file In memory structure with header and metadata.
+ * @param file_name Name of the database file.
+ *
+ * @return 0 or an error code if an error occurs.
+ */
+int do_compact(struct pictdb_file* db_file, const char* file_name);
+
+/**
+ * @brief Give a database more metadata: the contents in the way of the new
+ * metadata are moved to the end of the file, the others stay where they
+ * are. The new max_files is written last, so an interrupted growth leaves
+ * the database as it was.
+ *
+ * @param db_file In memory structure with header and metadata.
+ * @param max_files The new number of metadata (more than the current one).
+ *
+ * @return 0 or an error code if an error occurs.
+ */
+int do_grow(struct pictdb_file* db_file, uint32_t max_files);
+
+/**
+ * @brief Double the metadata of a database an insertion found full, up to
+ * the largest max_files of its layout.
+ *
+ * @param db_file In memory structure with header and metadata.
+ *
+ * @return 0 or an error code if an error occurs (ERR_FULL_DATABASE if it
+ * cannot grow: at its largest, or while an online gc runs).
+ */
+int grow_when_full(struct pictdb_file* db_file);
+
+/**
+ * @brief Number of bytes of the data still referred to by valid metadata.
+ *
+ * @param db_file In memory structure with header and metadata.
+ *
+ * @return The number of bytes.
+ */
+uint64_t live_bytes(const struct pictdb_file* db_file);
+
+/**
+ * @brief Number of bytes of the data, referred to or not.
+ *
+ * @param db_file In memory structure with header and metadata.
+ *
+ * @return The number of bytes.
+ */
+uint64_t data_bytes(const struct pictdb_file* db_file);
+
+/**
+ * @brief Start a garbage collection while the database stays in use: the
+ * metadata is copied and its changes are tracked from now on. The caller
+ * must have exclusive access.
+ *
+ * @param db_file In memory structure with header and metadata.
+ * @param temp_filename Name of the new database file.
+ * @param gc Where the state of the collection is stored.
+ *
+ * @return 0 or an error code if an error occurs.
+ */
+int gc_begin(struct pictdb_file* db_file, const char* temp_filename, struct online_gc* gc);
+
+/**
+ * @brief Copy the contents the metadata referred to when gc_begin was
+ * called. Nothing is locked: db_file is only read, through positions
+ * which were valid then.
+ *
+ * @param gc State of the collection.
+ *
+ * @return 0 or an error code if an error occurs.
+ */
+int gc_copy(struct online_gc* gc);
+
+/**
+ * @brief End a garbage collection: the metadata changed since gc_begin is
+ * copied with its contents, the new file replaces the old one and db_file
+ * is switched to it. The caller must have exclusive access; if an error
+ * occurs, db_file is left as it was.
+ *
+ * @param db_file In memory structure with header and metadata.
+ * @param filename Name of the database file.
+ * @param gc State of the collection (freed).
+ *
+ * @return 0 or an error code if an error occurs.
+ */
+int gc_finish(struct pictdb_file* db_file, const char* filename, struct online_gc* gc);
+
+/**
+ * @brief Give up a garbage collection: the new file is removed. The caller
+ * must have exclusive access.
+ *
+ * @param db_file In memory structure with header and metadata.
+ * @param gc State of the collection (freed).
+ */
+void gc_abort(struct pictdb_file* db_file, struct online_gc* gc);
+
+/**
+ * @brief Import several image files in a database, the name of each file
+ * being its picture id. The files are read, hashed and measured by
+ * nb_threads threads; the new contents are appended in large writes and
+ * the metadata is written once at the end, or when the database found full
+ * has to grow (see grow_when_full). Files which cannot be inserted are
+ * skipped.
+ *
+ * @param db_file Data base in which we add the images.
+ * @param files Names of the files.
+ * @param nb_files Number of files.
+ * @param nb_threads Number of threads reading the files.
+ * @param stats Where the counters of the import are stored.
+ *
+ * @return 0 or an error code if an error occurs (ERR_FULL_DATABASE if the
+ * database is full before the end and cannot grow).
+ */
+int do_import(struct pictdb_file* db_file, char* const files[], size_t nb_files,
+              size_t nb_threads, struct import_stats* stats);
+
+/**
+ * @brief List the files to import: the regular files of a directory (in
+ * alphabetical order), or the names listed in a file, one per line.
+ *
+ * @param source Name of the directory or of the list.
+ * @param files Where the list of names (to be freed with free_file_list) is stored.
+ * @param nb_files Where the number of names is stored.
+ *
+ * @return 0 or an error code if an error occurs.
+ */
+int list_import_files(const char* source, char*** files, size_t* nb_files);
+
+/**
+ * @brief Free a list of names made by list_import_files.
+ *
+ * @param files The names.
+ * @param nb_files Number of names.
+ */
+void free_file_list(char** files, size_t nb_files);
+
 
 
 #ifdef __cplusplus
@@ -8,6 +8,8 @@
  * @date 2 Nov 2015
  */
 
+#define _POSIX_C_SOURCE 200809L // for clock_gettime, sysconf
+
 #include "pictDB.h"
 #include "image_content.h"
 #include "pictDBM_tools.h"
@@ -15,6 +17,9 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h> // for PRIu64
+#include <time.h>
+#include <unistd.h>
 #include <vips/vips.h>
 
 /* Some macros that define default values */
@@ -24,7 +29,9 @@
 #define DEFAULT_NUMBER_FILES 10
 #define DEFAULT_THUMB_RES 64
 #define DEFAULT_SMALL_RES 256
-#define NUMBER_OF_COMMAND 7
+#define NUMBER_OF_COMMAND 12
+#define MAX_IMPORT_THREADS 64
+#define MAX_SEGMENT_SIZE (1 << 19) // MiB, the offsets in a segment have 39 bits
 #define MAX_FILE_NAME 1024
 
 /**
@@ -57,7 +64,7 @@ int do_list_cmd(int args, char *argv[])
 
     const char* filename = argv[1];
 
-    return_value = do_open(filename, "rb", &myfile);
+    return_value = do_open_mmap(filename, "rb", &myfile);
 
     if(return_value == 0) {
         do_list(&myfile, STDOUT);
@@ -124,6 +131,9 @@ int do_create_cmd(int args, char *argv[])
     uint16_t thumb_resY = DEFAULT_THUMB_RES;
     uint16_t small_resX = DEFAULT_SMALL_RES;
     uint16_t small_resY = DEFAULT_SMALL_RES;
+    int variants = VARIANTS_LAZY;
+    uint32_t segment_shift = 0;
+    int compact = 0;
 
     //Local variable to check if the argument weren't false
     size_t check_max_file = 0;
@@ -136,7 +146,7 @@ int do_create_cmd(int args, char *argv[])
         if(!strcmp(argv[index], "-max_files")) {
             if(index < args - 1) {
                 //Give the following argument to initialize max_files
-                check_max_file = initialise_max_files(&max_files, argv[index+1], MAX_NUMBER_FILES);
+                check_max_file = initialise_max_files(&max_files, argv[index+1], MAX_MAX_FILES_SEGMENTED);
                 if(check_max_file != 0) {
                     return ERR_MAX_FILES;
                 }
@@ -170,11 +180,49 @@ int do_create_cmd(int args, char *argv[])
                 return ERR_RESOLUTIONS;
             }
             index += 3;
+        }
+        //Check if a -variants option is given
+        else if(!strcmp(argv[index], "-variants")) {
+            if(index < args - 1) {
+                variants = variants_policy_atoi(argv[index+1]);
+                if(variants == -1) {
+                    return ERR_INVALID_ARGUMENT;
+                }
+            } else {
+                return ERR_INVALID_ARGUMENT;
+            }
+            index += 2;
+        }
+        //Check if a -segment_size option is given
+        else if(!strcmp(argv[index], "-segment_size")) {
+            if(index < args - 1) {
+                //Rounded up to a power of two
+                uint32_t mib = atouint32(argv[index+1]);
+                if(mib == 0 || mib > MAX_SEGMENT_SIZE) {
+                    return ERR_INVALID_ARGUMENT;
+                }
+                segment_shift = 20;
+                while((UINT64_C(1) << segment_shift) < ((uint64_t)mib << 20)) {
+                    segment_shift += 1;
+                }
+            } else {
+                return ERR_INVALID_ARGUMENT;
+            }
+            index += 2;
+        }
+        //Check if a -compact option is given
+        else if(!strcmp(argv[index], "-compact")) {
+            compact = 1;
+            index += 1;
             //If an invalid option is given
         } else {
             return ERR_INVALID_ARGUMENT;
         }
     }
+    //Only a segmented database goes past MAX_NUMBER_FILES
+    if(segment_shift == 0 && max_files > MAX_NUMBER_FILES) {
+        return ERR_MAX_FILES;
+    }
 
     puts("Create");
 
@@ -185,6 +233,13 @@ int do_create_cmd(int args, char *argv[])
     file.header.res_resized[2*RES_SMALL] = small_resX;
     file.header.res_resized[2*RES_SMALL+1] = small_resY;
     file.header.max_files = max_files;
+    file.header.flags = variants;
+    if(segment_shift != 0) {
+        file.header.flags |= FLAG_SEGMENTED | (segment_shift << SEGMENT_SIZE_SHIFT);
+    }
+    if(compact) {
+        file.header.flags |= FLAG_COMPACT;
+    }
     int return_value;
     return_value = do_create(filename, &file);
     do_close(&file);
@@ -203,19 +258,35 @@ int help(int args, char* argv[])
     printf("      options are:\n");
     printf("          -max_files <MAX_FILES>: maximum number of files.\n");
     printf("                                  default value is %d\n", DEFAULT_NUMBER_FILES);
-    printf("                                  maximum value is %d\n", MAX_NUMBER_FILES);
+    printf("                                  maximum value is %d (%u if segmented)\n", MAX_NUMBER_FILES, MAX_MAX_FILES_SEGMENTED);
     printf("          -thumb_res <X_RES> <Y_RES>: resolution for thumbnail images.\n");
     printf("                                  default value is %dx%d\n", DEFAULT_THUMB_RES, DEFAULT_THUMB_RES);
     printf("                                  maximum value is %dx%d\n", MAX_THUMB_RES, MAX_THUMB_RES);
     printf("          -small_res <X_RES> <Y_RES>: resolution for small images.\n");
     printf("                                  default value is %dx%d\n", DEFAULT_SMALL_RES, DEFAULT_SMALL_RES);
     printf("                                  maximum value is %dx%d\n", MAX_SMALL_RES, MAX_SMALL_RES);
+    printf("          -variants <lazy|sync|background>: when thumbnail and small images are created:\n");
+    printf("                                  at the first read, at insertion, or by the server\n");
+    printf("                                  just after insertion (lazy for the command line).\n");
+    printf("                                  default value is lazy\n");
+    printf("          -segment_size <MiB>: store the images in segments of this size (rounded up\n");
+    printf("                                  to a power of two) next to the database file.\n");
+    printf("                                  maximum value is %d\n", MAX_SEGMENT_SIZE);
+    printf("          -compact: store the metadata as compact records, the picture ids apart.\n");
     printf("  read   <dbfilename> <pictID> [original|orig|thumbnail|thumb|small]:\n");
     printf("      read an image from the pictDB and save it to a file.\n");
     printf("      default resolution is \"original\".\n");
     printf("  insert <dbfilename> <pictID> <filename>: insert a new image in the pictDB.\n");
     printf("  delete <dbfilename> <pictID>: delete picture pictID from pictDB\n");
     printf("  gc <dbfilename> <tmp dbfilename>: performs garbage collecting on pictDB. Requires a temporary filename for copying the pictDB.\n");
+    printf("  compact <dbfilename>: performs garbage collecting on pictDB in place, without a temporary file.\n");
+    printf("  grow <dbfilename> <MAX_FILES>: gives the pictDB room for more images, without copying them.\n");
+    printf("  convert <dbfilename> <tmp dbfilename>: stores the metadata of the pictDB as compact records,\n");
+    printf("      the picture ids apart; performs garbage collecting as gc does.\n");
+    printf("  warmup <dbfilename>: creates the missing thumbnail and small images of every picture.\n");
+    printf("  import <dbfilename> <directory|file list> [-threads <N>]: inserts every file of the directory\n");
+    printf("      (or listed in the file, one per line), named after the file.\n");
+    printf("      default number of threads is the number of processors, maximum value is %d\n", MAX_IMPORT_THREADS);
     return 0;
 }
 
@@ -241,7 +312,7 @@ int do_delete_cmd(int args, char* argv[])
     struct pictdb_file db_file;
 
     //Open the file in Read and write
-    check_do_open = do_open(filename, "rb+", &db_file);
+    check_do_open = do_open_mmap(filename, "rb+", &db_file);
     if(check_do_open == 0) {
         check_do_delete = do_delete(pictID, &db_file);
     }
@@ -304,7 +375,7 @@ int do_insert_cmd(int args, char* argv[])
 
     struct pictdb_file db_file;
     int check = 0;
-    check =  do_open(dbfilename, "rb+", &db_file);
+    check =  do_open_mmap(dbfilename, "rb+", &db_file);
     if(check != 0) {
         do_close(&db_file);
         return check;
@@ -440,8 +511,12 @@ int do_read_cmd(int args, char* argv[])
 
     struct pictdb_file db_file;
 
-    //Open the file in Read and write
-    int check = do_open(dbfilename, "rb+", &db_file);
+    //Open the file in read only, unless the image must be resized first
+    int check = do_open_mmap(dbfilename, "rb", &db_file);
+    if(check == 0 && read_needs_resize(pictID, res, &db_file)) {
+        do_close(&db_file);
+        check = do_open_mmap(dbfilename, "rb+", &db_file);
+    }
 
     if(check != 0) {
         do_close(&db_file);
@@ -499,7 +574,7 @@ int do_gc_cmd(int args, char* argv[])
     struct pictdb_file db_file;
 
     //Open the file in Read and write
-    int check = do_open(dbfilename, "rb+", &db_file);
+    int check = do_open_mmap(dbfilename, "rb+", &db_file);
     if(check != 0) {
         do_close(&db_file);
         return check;
@@ -515,6 +590,171 @@ int do_gc_cmd(int args, char* argv[])
     return 0;
 }
 
+/********************************************************************//**
+ * Converts the database to compact records.
+ */
+int do_convert_cmd(int args, char* argv[])
+{
+    if(args < 3) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    struct pictdb_file db_file;
+
+    int check = do_open_mmap(argv[1], "rb+", &db_file);
+    if(check != 0) {
+        do_close(&db_file);
+        return check;
+    }
+
+    check = do_convert(&db_file, argv[1], argv[2]);
+    do_close(&db_file);
+    return check;
+}
+
+/********************************************************************//**
+ * Compacts the database in place.
+ */
+int do_compact_cmd(int args, char* argv[])
+{
+    if(args < 2) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    struct pictdb_file db_file;
+
+    int check = do_open_mmap(argv[1], "rb+", &db_file);
+    if(check != 0) {
+        do_close(&db_file);
+        return check;
+    }
+
+    uint64_t before = data_bytes(&db_file);
+    check = do_compact(&db_file, argv[1]);
+    if(check == 0) {
+        printf("%" PRIu64 " bytes freed\n", before - data_bytes(&db_file));
+    }
+    do_close(&db_file);
+    return check;
+}
+
+/********************************************************************//**
+ * Gives the database more metadata.
+ */
+int do_grow_cmd(int args, char* argv[])
+{
+    if(args < 3) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    struct pictdb_file db_file;
+
+    int check = do_open_mmap(argv[1], "rb+", &db_file);
+    if(check != 0) {
+        do_close(&db_file);
+        return check;
+    }
+
+    uint32_t before = db_file.header.max_files;
+    check = do_grow(&db_file, atouint32(argv[2]));
+    if(check == 0) {
+        printf("max_files: %" PRIu32 " -> %" PRIu32 "\n", before, db_file.header.max_files);
+    }
+    do_close(&db_file);
+    return check;
+}
+
+/********************************************************************//**
+ * Creates every missing resized image, one decode per picture.
+ */
+int do_warmup_cmd(int args, char* argv[])
+{
+    if(args < 2) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    struct pictdb_file db_file;
+
+    int check = do_open_mmap(argv[1], "rb+", &db_file);
+    if(check != 0) {
+        do_close(&db_file);
+        return check;
+    }
+
+    size_t created = 0;
+    for(uint32_t i = 0; i < db_file.header.max_files && check == 0; i++) {
+        if(db_file.metadata[i].is_valid == NON_EMPTY
+           && (db_file.metadata[i].offset[RES_THUMB] == 0 || db_file.metadata[i].offset[RES_SMALL] == 0)) {
+            check = create_variants(&db_file, i, ALL_VARIANTS);
+            created += check == 0;
+        }
+    }
+    printf("%zu picture(s) resized\n", created);
+
+    do_close(&db_file);
+    return check;
+}
+
+/********************************************************************//**
+ * Imports the files of a directory, or listed in a file.
+ */
+int do_import_cmd(int args, char* argv[])
+{
+    if(args < 3) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+
+    const char* dbfilename = argv[1];
+    const char* source = argv[2];
+
+    long nb_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if(args >= 5 && !strcmp(argv[3], "-threads")) {
+        nb_threads = atouint32(argv[4]);
+        if(nb_threads == 0 || nb_threads > MAX_IMPORT_THREADS) {
+            return ERR_INVALID_ARGUMENT;
+        }
+    } else if(args != 3) {
+        return ERR_INVALID_ARGUMENT;
+    }
+    if(nb_threads < 1) {
+        nb_threads = 1;
+    }
+
+    char** files = NULL;
+    size_t nb_files = 0;
+    int check = list_import_files(source, &files, &nb_files);
+    if(check != 0) {
+        return check;
+    }
+
+    struct pictdb_file db_file;
+    check = do_open_mmap(dbfilename, "rb+", &db_file);
+    if(check != 0) {
+        do_close(&db_file);
+        free_file_list(files, nb_files);
+        return check;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct import_stats stats;
+    check = do_import(&db_file, files, nb_files, nb_threads, &stats);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    if(seconds <= 0) {
+        seconds = 1e-9;
+    }
+    printf("%zu image(s) imported (%zu duplicate content(s)), %zu skipped in %.3f s\n",
+           stats.imported, stats.duplicates, stats.skipped, seconds);
+    printf("%.1f images/s, %.1f MB/s read, %.1f MB/s written\n", stats.imported / seconds,
+           stats.bytes_read / seconds / 1e6, stats.bytes_written / seconds / 1e6);
+
+    do_close(&db_file);
+    free_file_list(files, nb_files);
+    return check;
+}
+
 /********************************************************************//**
  * MAIN
  */
@@ -541,9 +781,15 @@ int main (int argc, char* argv[])
         command_mapping read_cmd = {"read", do_read_cmd};
         command_mapping insert_cmd = {"insert", do_insert_cmd};
         command_mapping gc_cmd = {"gc", do_gc_cmd};
+        command_mapping compact_cmd = {"compact", do_compact_cmd};
+        command_mapping warmup_cmd = {"warmup", do_warmup_cmd};
+        command_mapping import_cmd = {"import", do_import_cmd};
+        command_mapping grow_cmd = {"grow", do_grow_cmd};
+        command_mapping convert_cmd = {"convert", do_convert_cmd};
 
         command_mapping tab[NUMBER_OF_COMMAND] = {list_cmd, create_cmd, delete_cmd, help_cmd,
-                                                  read_cmd, insert_cmd, gc_cmd
+                                                  read_cmd, insert_cmd, gc_cmd, warmup_cmd,
+                                                  import_cmd, compact_cmd, grow_cmd, convert_cmd
                                                  };
 
         //Check if we called an existing command
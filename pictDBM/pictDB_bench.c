@@ -0,0 +1,421 @@
+/**
+ * @file pictDB_bench.c
+ * @brief Micro-benchmarks of pictDB (make pictDB_bench).
+ *
+ * "pictDB_bench resize <jpeg>..." creates the thumbnail and the small
+ * resolution of the given images ROUNDS times, in two ways: decoding the
+ * whole image and resizing it (as create_image did), and with
+ * shrink-on-load (as load_resized in image_content.c does now). Each way
+ * runs in a process of its own, so that the peak resident set size of
+ * each is measured apart. For instance, on the sample images:
+ *
+ *     ./pictDB_bench resize papillon.jpg foret.jpg coquelicots.jpg
+ *
+ * "pictDB_bench scan [slots]" fills the metadata of a database in memory
+ * (100000 by default, half of them valid) and times the scans for the
+ * valid pictures, for an id and for a SHA, reading the metadata and
+ * reading the columns (see db_columns.c).
+ *
+ * @date 16 October 2026
+ */
+
+#define _DEFAULT_SOURCE // for wait4, clock_gettime
+
+#include "pictDB.h"
+#include "db_columns.h"
+#include "db_index.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <vips/vips.h>
+
+#define ROUNDS 10
+#define THUMB_RES 64
+#define SMALL_RES 256
+#define SCAN_SLOTS 100000
+#define SCAN_ROUNDS 100
+
+/**
+* @brief A JPEG image read from a file.
+*/
+struct jpeg {
+    char* content;
+    size_t size;
+};
+
+/**
+* @brief A way of resizing a JPEG image to fit in a res x res box.
+*/
+struct resize_way {
+    const char* name;
+    int (*resize)(const struct jpeg* jpeg, int res, VipsImage** resized);
+};
+
+/**
+* @brief A scan of the metadata, reading them or reading the columns.
+*/
+struct scan {
+    const char* name;
+    uint32_t (*on_metadata)(const struct pictdb_file* db_file);
+    uint32_t (*on_columns)(const struct pictdb_file* db_file);
+};
+
+//Looked for by the scans, and not stored
+static const char SCAN_ID[] = "not stored";
+static const unsigned char SCAN_SHA[SHA256_DIGEST_LENGTH] = {0};
+
+/**
+* @brief Read a whole file.
+* @param path Name of the file.
+* @param jpeg Where its content is stored (to be freed).
+* @return 0 if no error occurs, otherwise an error.
+*/
+static int read_jpeg(const char* path, struct jpeg* jpeg)
+{
+    FILE* file = fopen(path, "rb");
+    if(file == NULL) {
+        return ERR_IO;
+    }
+    int check = ERR_IO;
+    long size = fseek(file, 0, SEEK_END) == 0 ? ftell(file) : -1;
+    if(size > 0 && fseek(file, 0, SEEK_SET) == 0) {
+        jpeg->content = malloc((size_t)size);
+        jpeg->size = (size_t)size;
+        if(jpeg->content == NULL) {
+            check = ERR_OUT_OF_MEMORY;
+        } else if(fread(jpeg->content, 1, jpeg->size, file) == jpeg->size) {
+            check = 0;
+        } else {
+            free(jpeg->content);
+            jpeg->content = NULL;
+        }
+    }
+    fclose(file);
+    return check;
+}
+
+/**
+* @brief Decode the whole image, then resize it.
+*/
+static int resize_decoded(const struct jpeg* jpeg, int res, VipsImage** resized)
+{
+    VipsImage* original;
+    if(vips_jpegload_buffer(jpeg->content, jpeg->size, &original, NULL)) {
+        return ERR_VIPS;
+    }
+    double h_shrink = (double) res / (double) vips_image_get_width(original);
+    double v_shrink = (double) res / (double) vips_image_get_height(original);
+    int check = vips_resize(original, resized, h_shrink > v_shrink ? v_shrink : h_shrink, NULL);
+    g_object_unref(original);
+    return check != 0 ? ERR_VIPS : 0;
+}
+
+#if VIPS_MAJOR_VERSION > 8 || (VIPS_MAJOR_VERSION == 8 && VIPS_MINOR_VERSION >= 6)
+/**
+* @brief Let libjpeg decode the image already shrunk, then resize it.
+*/
+static int resize_on_load(const struct jpeg* jpeg, int res, VipsImage** resized)
+{
+    if(vips_thumbnail_buffer(jpeg->content, jpeg->size, resized, res, "height", res, NULL)) {
+        return ERR_VIPS;
+    }
+    return 0;
+}
+#endif
+
+/**
+* @brief Run a way of resizing on every image, in a child process, and
+* print its latency. Never returns.
+* @param way The way of resizing.
+* @param jpegs The images.
+* @param nb_jpegs Number of images.
+* @param argv0 Name of the program, for vips.
+*/
+static void run_way(const struct resize_way* way, const struct jpeg* jpegs, size_t nb_jpegs,
+                    const char* argv0)
+{
+    if (VIPS_INIT(argv0)) {
+        _exit(ERR_VIPS);
+    }
+    //Every round must resize again
+    vips_cache_set_max(0);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int check = 0;
+    for(size_t round = 0; round < ROUNDS && check == 0; round++) {
+        for(size_t i = 0; i < nb_jpegs && check == 0; i++) {
+            const int resolutions[] = {THUMB_RES, SMALL_RES};
+            for(size_t res = 0; res < 2 && check == 0; res++) {
+                VipsImage* resized;
+                check = way->resize(&jpegs[i], resolutions[res], &resized);
+                if(check == 0) {
+                    void* content;
+                    size_t len = 0;
+                    if(vips_jpegsave_buffer(resized, &content, &len, NULL)) {
+                        check = ERR_VIPS;
+                    } else {
+                        g_free(content);
+                    }
+                    g_object_unref(resized);
+                }
+            }
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    if(check == 0) {
+        double ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+        printf("%-10s %9.2f ms per image (thumbnail and small)", way->name, ms / (ROUNDS * nb_jpegs));
+        fflush(stdout);
+    }
+    vips_shutdown();
+    _exit(check);
+}
+
+/**
+* @brief Compare the ways of resizing on the given images.
+* @param args Number of images.
+* @param argv Names of the images.
+* @param argv0 Name of the program, for vips.
+* @return 0 if no error occurs, otherwise an error.
+*/
+static int bench_resize(int args, char* argv[], const char* argv0)
+{
+    if(args < 1) {
+        return ERR_NOT_ENOUGH_ARGUMENTS;
+    }
+    struct jpeg* jpegs = calloc((size_t)args, sizeof(struct jpeg));
+    if(jpegs == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    int check = 0;
+    for(int i = 0; i < args && check == 0; i++) {
+        check = read_jpeg(argv[i], &jpegs[i]);
+    }
+
+    const struct resize_way ways[] = {
+        {"decode", resize_decoded},
+#if VIPS_MAJOR_VERSION > 8 || (VIPS_MAJOR_VERSION == 8 && VIPS_MINOR_VERSION >= 6)
+        {"shrink", resize_on_load},
+#endif
+    };
+    for(size_t w = 0; w < sizeof(ways) / sizeof(ways[0]) && check == 0; w++) {
+        fflush(stdout);
+        pid_t child = fork();
+        if(child == -1) {
+            check = ERR_IO;
+        } else if(child == 0) {
+            run_way(&ways[w], jpegs, (size_t)args, argv0);
+        } else {
+            int status = 0;
+            struct rusage usage;
+            if(wait4(child, &status, 0, &usage) != child || !WIFEXITED(status)) {
+                check = ERR_IO;
+            } else if(WEXITSTATUS(status) != 0) {
+                check = WEXITSTATUS(status) <= ERR_DEBUG ? WEXITSTATUS(status) : ERR_VIPS;
+            } else {
+#ifdef __APPLE__
+                long peak = usage.ru_maxrss / 1024; // in bytes
+#else
+                long peak = usage.ru_maxrss; // in KiB
+#endif
+                printf(", peak RSS %ld KiB\n", peak);
+            }
+        }
+    }
+
+    for(int i = 0; i < args; i++) {
+        free(jpegs[i].content);
+    }
+    free(jpegs);
+    return check;
+}
+
+/**
+* @brief Count the valid pictures.
+*/
+static uint32_t valid_on_metadata(const struct pictdb_file* db_file)
+{
+    uint32_t count = 0;
+    for(uint32_t i = 0; i < db_file->header.max_files; i++) {
+        count += db_file->metadata[i].is_valid == NON_EMPTY;
+    }
+    return count;
+}
+
+static uint32_t valid_on_columns(const struct pictdb_file* db_file)
+{
+    const struct pict_columns* columns = &db_file->columns;
+    uint32_t count = 0;
+    for(uint32_t i = 0; (i = column_next_valid(columns, i)) < columns->count; i++) {
+        count += 1;
+    }
+    return count;
+}
+
+/**
+* @brief Look for SCAN_ID, as index_find_id would without its table.
+*/
+static uint32_t id_on_metadata(const struct pictdb_file* db_file)
+{
+    for(uint32_t i = 0; i < db_file->header.max_files; i++) {
+        if(db_file->metadata[i].is_valid == NON_EMPTY
+           && !strncmp(db_file->metadata[i].pict_id, SCAN_ID, MAX_PIC_ID)) {
+            return i;
+        }
+    }
+    return db_file->header.max_files;
+}
+
+static uint32_t id_on_columns(const struct pictdb_file* db_file)
+{
+    const struct pict_columns* columns = &db_file->columns;
+    uint32_t hash = (uint32_t)index_hash_id(SCAN_ID);
+    for(uint32_t i = 0; (i = column_next_valid(columns, i)) < columns->count; i++) {
+        if(columns->id_hash[i] == hash && !strncmp(db_file->metadata[i].pict_id, SCAN_ID, MAX_PIC_ID)) {
+            return i;
+        }
+    }
+    return columns->count;
+}
+
+/**
+* @brief Look for SCAN_SHA, as index_find_sha would without its table.
+*/
+static uint32_t sha_on_metadata(const struct pictdb_file* db_file)
+{
+    for(uint32_t i = 0; i < db_file->header.max_files; i++) {
+        if(db_file->metadata[i].is_valid == NON_EMPTY
+           && !memcmp(db_file->metadata[i].SHA, SCAN_SHA, SHA256_DIGEST_LENGTH)) {
+            return i;
+        }
+    }
+    return db_file->header.max_files;
+}
+
+static uint32_t sha_on_columns(const struct pictdb_file* db_file)
+{
+    const struct pict_columns* columns = &db_file->columns;
+    uint32_t prefix = 0;
+    memcpy(&prefix, SCAN_SHA, sizeof(prefix));
+    for(uint32_t i = 0; (i = column_next_valid(columns, i)) < columns->count; i++) {
+        if(columns->sha_prefix[i] == prefix && !memcmp(db_file->metadata[i].SHA, SCAN_SHA, SHA256_DIGEST_LENGTH)) {
+            return i;
+        }
+    }
+    return columns->count;
+}
+
+/**
+* @brief Time a scan.
+* @param scan The scan, on the metadata or on the columns.
+* @param db_file The database scanned.
+* @param result Where its result is added, so that it is not optimized out.
+* @return The time of one scan in nanoseconds per slot.
+*/
+static double time_scan(uint32_t (*scan)(const struct pictdb_file*), const struct pictdb_file* db_file,
+                        uint64_t* result)
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(size_t round = 0; round < SCAN_ROUNDS; round++) {
+        *result += scan(db_file);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+    return ns / SCAN_ROUNDS / db_file->header.max_files;
+}
+
+/**
+* @brief Compare the scans of the metadata and of the columns.
+* @param args Number of arguments.
+* @param argv The number of slots, if given.
+* @return 0 if no error occurs, otherwise an error.
+*/
+static int bench_scan(int args, char* argv[])
+{
+    unsigned long slots = SCAN_SLOTS;
+    if(args >= 1) {
+        char* end = NULL;
+        slots = strtoul(argv[0], &end, 10);
+        if(*end != '\0' || slots == 0 || slots > UINT32_MAX / 2) {
+            return ERR_INVALID_ARGUMENT;
+        }
+    }
+
+    struct pictdb_file db_file;
+    memset(&db_file, 0, sizeof(db_file));
+    db_file.header.max_files = (uint32_t)slots;
+    db_file.metadata = calloc(slots, sizeof(struct pict_metadata));
+    if(db_file.metadata == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    //Half of the slots valid, with distinct ids and random SHA
+    uint64_t random = 88172645463325252ULL;
+    for(uint32_t i = 0; i < slots; i++) {
+        struct pict_metadata* metadata = &db_file.metadata[i];
+        random ^= random << 13;
+        random ^= random >> 7;
+        random ^= random << 17;
+        if(random & 1) {
+            metadata->is_valid = NON_EMPTY;
+            snprintf(metadata->pict_id, MAX_PIC_ID + 1, "pict%u", i);
+            for(size_t byte = 0; byte < SHA256_DIGEST_LENGTH; byte++) {
+                metadata->SHA[byte] = (unsigned char)(random >> (byte % 8 * 8)) | 1;
+            }
+        }
+    }
+    int check = columns_build(&db_file);
+    if(check != 0) {
+        free(db_file.metadata);
+        return check;
+    }
+
+    printf("%lu slots, %zu bytes of metadata and %.1f bytes of columns per slot\n", slots,
+           sizeof(struct pict_metadata), 2 * sizeof(uint32_t) + 1.0 / 8);
+    const struct scan scans[] = {
+        {"valid", valid_on_metadata, valid_on_columns},
+        {"id", id_on_metadata, id_on_columns},
+        {"sha", sha_on_metadata, sha_on_columns},
+    };
+    uint64_t results[2] = {0, 0};
+    for(size_t s = 0; s < sizeof(scans) / sizeof(scans[0]); s++) {
+        double on_metadata = time_scan(scans[s].on_metadata, &db_file, &results[0]);
+        double on_columns = time_scan(scans[s].on_columns, &db_file, &results[1]);
+        printf("%-6s %7.2f ns per slot on the metadata, %7.2f on the columns (x%.1f)\n",
+               scans[s].name, on_metadata, on_columns, on_metadata / on_columns);
+    }
+    //Both ways find the same
+    if(results[0] != results[1]) {
+        check = ERR_DEBUG;
+    }
+
+    columns_free(&db_file);
+    free(db_file.metadata);
+    return check;
+}
+
+/**
+* @brief Run the benchmark given on the command line.
+*/
+int main(int argc, char* argv[])
+{
+    int check = ERR_INVALID_COMMAND;
+    if(argc >= 2 && !strcmp(argv[1], "resize")) {
+        check = bench_resize(argc - 2, argv + 2, argv[0]);
+    } else if(argc >= 2 && !strcmp(argv[1], "scan")) {
+        check = bench_scan(argc - 2, argv + 2);
+    }
+    if(check != 0) {
+        fprintf(stderr, "ERROR: %s\n", ERROR_MESSAGES[check]);
+        fprintf(stderr, "usage: %s resize <jpeg>...\n", argv[0]);
+        fprintf(stderr, "       %s scan [slots]\n", argv[0]);
+    }
+    return check;
+}
@@ -2,15 +2,60 @@
 * @file pictDB_server.c
 *
 * @brief Small webserver managing a picture database.
+*
+* The mongoose thread parses the requests into jobs. Without workers, the
+* jobs are run right away; with "-workers N", they are queued and run by
+* N worker threads, and the mongoose thread sends the replies once they
+* are done. A connection is answered one request at a time: the requests
+* which come while its job runs or while mongoose sends it a static file
+* are kept and handled in turn, so that the replies keep their order. The
+* database is protected by a reader/writer lock: list, stats
+* and reads of existing images share it, inserts and deletes take it
+* exclusively. A resize reads the original under the shared lock, resizes
+* it without the lock, and takes it exclusively only to write the result.
+*
+* Missing thumbnails and small images are created by resizer threads. At
+* most one resize per (slot, resolution) is in flight: with workers, every
+* read of that image waits on the same flight; without workers the read is
+* answered "202 Accepted" with a Retry-After instead of blocking the event
+* loop. With the background variants policy, they are requested as soon as
+* the image is inserted.
+*
+* The header and metadata writes of several changes can be gathered with
+* "-batch N" and "-interval MS" (see db_writeback.c), and synced to the disk
+* with "-fsync none|batch|always".
+*
+* "/pictDB/gc" collects the garbage in a background thread while the
+* requests go on being served (see gc_begin in db_gbcollect.c): only the
+* switch to the new file takes the lock exclusively, like an insertion.
+* With "-gc_threshold P", it is started by the deletion which makes the
+* dead bytes reach P percent of the data. A segmented database is collected
+* one segment at a time, and only the segments whose dead bytes reach P
+* percent (SEGMENT_GC_MIN without a threshold).
+*
+* An insertion which finds the database full doubles its metadata (see
+* grow_when_full) and is tried again once. While an online gc runs, the
+* table keeps its size and the insertion fails as full.
 */
 
+#define _POSIX_C_SOURCE 200809L // for pthread_rwlock_t
+
 #include "libmongoose/mongoose.h"
 #include "pictDB.h"
+#include "db_index.h"
+#include "db_segment.h"
+#include "image_content.h"
+#include "pictDBM_tools.h"
 #include <vips/vips.h>
 #include <string.h>
+#include <stdlib.h>
+#include <inttypes.h> // for PRIu64
+#include <signal.h> // for sigaction
+#include <pthread.h>
 
 #define MAX_QUERY_PARAM 5
 #define MAX_FILE_NAME 1024
+#define MAX_WORKERS 64
 
 static const char *s_http_port = "8000";
 static struct mg_serve_http_opts s_http_server_opts;
@@ -22,6 +67,118 @@ static struct mg_serve_http_opts s_http_server_opts;
 */
 struct pictdb_file db_file;
 
+/**
+* @brief Lock protecting db_file
+*/
+static pthread_rwlock_t db_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/**
+* @brief Kind of request handled by a job
+*/
+enum job_type {
+    JOB_LIST, JOB_READ, JOB_INSERT, JOB_DELETE, JOB_STATS, JOB_GC
+};
+
+/**
+* @struct job
+*
+* @brief A parsed request and, once run, its reply.
+*/
+struct job {
+    enum job_type type;
+    uintptr_t conn_id;           // id of its connection, see struct connection
+    char pict_id[MAX_PIC_ID+1];
+    int resolution;
+    char* img;                   // copy of the uploaded image for JOB_INSERT
+    size_t size;
+    struct mbuf reply;           // full HTTP reply
+    int close_after;             // close the connection once the reply is sent
+    struct job* next;
+};
+
+/**
+* @struct waiting_request
+*
+* @brief Copy of a request received while its connection was busy.
+*/
+struct waiting_request {
+    struct mbuf message;
+    struct waiting_request* next;
+};
+
+/**
+* @struct connection
+*
+* @brief State of a client connection, kept in its user_data.
+*/
+struct connection {
+    uintptr_t id;                   // matched against the conn_id of the jobs
+    int job_running;                // a job of the connection is at the workers
+    int sending_file;               // mg_serve_http may still stream a file
+    struct waiting_request* head;   // requests to handle next, in order
+    struct waiting_request* tail;
+};
+
+/**
+* @struct job_queue
+*
+* @brief FIFO of jobs shared between threads.
+*/
+struct job_queue {
+    struct job* head;
+    struct job* tail;
+    int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+};
+
+static struct job_queue todo_jobs = {NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+static struct job_queue done_jobs = {NULL, NULL, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+static struct mg_mgr mgr;
+static size_t nb_workers = 0;
+static size_t workers_running = 0;     // protected by todo_jobs.lock
+static size_t nb_resizers = 1;
+static uintptr_t last_conn_id = 0;
+static uint32_t write_batch = 1;       // see set_write_back
+static uint32_t write_interval_ms = 0;
+static int fsync_policy = FSYNC_NONE;
+static volatile sig_atomic_t stop_requested = 0;
+static const char* db_name = NULL;
+static char gc_name[MAX_FILE_NAME+4];   // <db_name>.gc
+static uint32_t gc_threshold = 0;       // percentage of dead bytes, 0: never automatic
+static int gc_running = 0;              // protected by gc_lock
+static pthread_mutex_t gc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gc_done = PTHREAD_COND_INITIALIZER;
+
+/**
+* @brief State of a resize flight
+*/
+enum flight_state {
+    FLIGHT_PENDING, FLIGHT_RUNNING, FLIGHT_DONE
+};
+
+/**
+* @struct resize_flight
+*
+* @brief One resize of an image to a resolution, shared by all the reads
+* waiting for it.
+*/
+struct resize_flight {
+    uint32_t slot;
+    int resolution;
+    char pict_id[MAX_PIC_ID+1];
+    enum flight_state state;
+    int result;
+    size_t waiters;
+    struct resize_flight* next;
+};
+
+static struct resize_flight* flights = NULL; // in flight, in submission order
+static pthread_mutex_t flights_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flight_pending = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t flight_done = PTHREAD_COND_INITIALIZER;
+static int resizers_stopped = 0; // protected by flights_lock
+
 /**
 * @brief Free the pointer received as parameter
 *
@@ -51,17 +208,357 @@ void free_data(char** data)
 }
 
 /**
-* @brief Routine that return a HTTP error code.
+* @brief Free a job and everything it owns.
 *
-* @param nc A pointer to a mongoose connection
+* @param job A pointer to the job
+*/
+static void free_job(struct job* job)
+{
+    if(job != NULL) {
+        do_free(job->img);
+        mbuf_free(&job->reply);
+        free(job);
+    }
+}
+
+/**
+* @brief Add a job at the end of a queue.
+*
+* @param queue A pointer to the queue
+*
+* @param job A pointer to the job
+*/
+static void queue_push(struct job_queue* queue, struct job* job)
+{
+    job->next = NULL;
+    pthread_mutex_lock(&queue->lock);
+    if(queue->tail == NULL) {
+        queue->head = job;
+    } else {
+        queue->tail->next = job;
+    }
+    queue->tail = job;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+* @brief Remove the first job of a queue.
+*
+* @param queue A pointer to the queue
+*
+* @param wait Wait for a job if the queue is empty
+*
+* @return The job, or NULL if the queue is empty (or closed when waiting)
+*/
+static struct job* queue_pop(struct job_queue* queue, int wait)
+{
+    pthread_mutex_lock(&queue->lock);
+    while(wait && queue->head == NULL && !queue->closed) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+    struct job* job = queue->head;
+    if(job != NULL) {
+        queue->head = job->next;
+        if(queue->head == NULL) {
+            queue->tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return job;
+}
+
+/**
+* @brief Routine that writes a HTTP error reply.
+*
+* @param reply The reply buffer
 *
 * @param error An error code
 */
-static void mg_error(struct mg_connection* nc, int error)
+static void reply_error(struct mbuf* reply, int error)
 {
     if(error > 0 && error < 16) {
-        mg_printf(nc, "HTTP/1.1 500\r\nContent-Length: 0\r\n\r\n%s", ERROR_MESSAGES[error]);
+        char head[128];
+        int len = snprintf(head, sizeof(head), "HTTP/1.1 500\r\nContent-Length: 0\r\n\r\n%s", ERROR_MESSAGES[error]);
+        mbuf_append(reply, head, len);
+    }
+}
+
+/**
+* @brief Routine that writes a HTTP 200 reply.
+*
+* @param reply The reply buffer
+*
+* @param type Content-Type of the body
+*
+* @param body The body
+*
+* @param len Length of the body
+*/
+static void reply_ok(struct mbuf* reply, const char* type, const char* body, size_t len)
+{
+    char head[128];
+    int head_len = snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\n\r\n", type, len);
+    mbuf_append(reply, head, head_len);
+    mbuf_append(reply, body, len);
+}
+
+/**
+* @brief Routine that writes a redirection to the index page.
+*
+* @param job The job
+*/
+static void reply_redirect(struct job* job)
+{
+    char head[128];
+    int len = snprintf(head, sizeof(head), "HTTP/1.1 302 Found\r\nLocation: http://localhost:%s/index.html\r\n\r\n", s_http_port);
+    mbuf_append(&job->reply, head, len);
+    job->close_after = 1;
+}
+
+/**
+* @brief Routine that tells the client to retry later.
+*
+* @param reply The reply buffer
+*/
+static void reply_retry_later(struct mbuf* reply)
+{
+    const char head[] = "HTTP/1.1 202 Accepted\r\nRetry-After: 1\r\nContent-Length: 0\r\n\r\n";
+    mbuf_append(reply, head, strlen(head));
+}
+
+/**
+* @brief Remove a flight from the list and free it. flights_lock must be held.
+*
+* @param flight The flight
+*/
+static void remove_flight(struct resize_flight* flight)
+{
+    struct resize_flight** cur = &flights;
+    while(*cur != NULL && *cur != flight) {
+        cur = &(*cur)->next;
+    }
+    if(*cur != NULL) {
+        *cur = flight->next;
     }
+    free(flight);
+}
+
+/**
+* @brief Ask for an image to be resized, joining the flight already
+* requested for the same slot and resolution if any.
+*
+* @param slot Position of the image in the metadata
+*
+* @param resolution Resolution to create
+*
+* @param pict_id Identifier of the image
+*
+* @param wait 1 if the caller will wait_resize on the flight
+*
+* @return The flight, or NULL if it could not be allocated
+*/
+static struct resize_flight* request_resize(uint32_t slot, int resolution, const char* pict_id, int wait)
+{
+    pthread_mutex_lock(&flights_lock);
+    struct resize_flight* flight = flights;
+    while(flight != NULL && (flight->slot != slot || flight->resolution != resolution
+                             || flight->state == FLIGHT_DONE)) {
+        flight = flight->next;
+    }
+    if(flight == NULL) {
+        flight = calloc(1, sizeof(struct resize_flight));
+        if(flight != NULL) {
+            flight->slot = slot;
+            flight->resolution = resolution;
+            strncpy(flight->pict_id, pict_id, MAX_PIC_ID);
+            flight->state = FLIGHT_PENDING;
+            //Appended, so that resizers serve the requests in order
+            struct resize_flight** last = &flights;
+            while(*last != NULL) {
+                last = &(*last)->next;
+            }
+            *last = flight;
+            pthread_cond_signal(&flight_pending);
+        }
+    }
+    if(flight != NULL && wait) {
+        flight->waiters += 1;
+    }
+    pthread_mutex_unlock(&flights_lock);
+    return flight;
+}
+
+/**
+* @brief Wait until a flight is done.
+*
+* @param flight The flight
+*
+* @return The result of the resize
+*/
+static int wait_resize(struct resize_flight* flight)
+{
+    pthread_mutex_lock(&flights_lock);
+    while(flight->state != FLIGHT_DONE) {
+        pthread_cond_wait(&flight_done, &flights_lock);
+    }
+    int result = flight->result;
+    flight->waiters -= 1;
+    if(flight->waiters == 0) {
+        remove_flight(flight);
+    }
+    pthread_mutex_unlock(&flights_lock);
+    return result;
+}
+
+/**
+* @brief Resizer thread: runs the pending flights, until the resizers are
+* stopped (the flights still pending are then left).
+*
+* @param arg Unused
+*/
+static void* resizer_thread(void* arg)
+{
+    (void)arg;
+    for(;;) {
+        pthread_mutex_lock(&flights_lock);
+        struct resize_flight* flight = NULL;
+        while(flight == NULL && !resizers_stopped) {
+            flight = flights;
+            while(flight != NULL && flight->state != FLIGHT_PENDING) {
+                flight = flight->next;
+            }
+            if(flight == NULL) {
+                pthread_cond_wait(&flight_pending, &flights_lock);
+            }
+        }
+        if(flight == NULL) {
+            pthread_mutex_unlock(&flights_lock);
+            return NULL;
+        }
+        flight->state = FLIGHT_RUNNING;
+        pthread_mutex_unlock(&flights_lock);
+
+        //The slot may have been deleted (and reused) since the request: it
+        //is checked when the original is read and when the resized images
+        //are written, the resize itself holds no lock
+        struct variants variants;
+        memset(&variants, 0, sizeof(variants));
+        pthread_rwlock_rdlock(&db_lock);
+        int result = ERR_FILE_NOT_FOUND;
+        if(index_find_id(&db_file, flight->pict_id) == flight->slot) {
+            //Both resolutions in one pass, as lazily_resize
+            result = variants_prepare(&db_file, flight->slot, ALL_VARIANTS, &variants);
+        }
+        pthread_rwlock_unlock(&db_lock);
+        if(result == 0) {
+            result = variants_resize(&variants);
+        }
+        if(result == 0) {
+            pthread_rwlock_wrlock(&db_lock);
+            result = index_find_id(&db_file, flight->pict_id) == flight->slot
+                     ? variants_store(&db_file, flight->slot, &variants) : ERR_FILE_NOT_FOUND;
+            pthread_rwlock_unlock(&db_lock);
+        }
+        variants_free(&variants);
+
+        pthread_mutex_lock(&flights_lock);
+        flight->state = FLIGHT_DONE;
+        flight->result = result;
+        if(flight->waiters == 0) {
+            remove_flight(flight);
+        } else {
+            pthread_cond_broadcast(&flight_done);
+        }
+        pthread_mutex_unlock(&flights_lock);
+    }
+    return NULL;
+}
+
+/**
+* @brief Garbage collector thread: copies the database while it is served,
+* then switches to the copy. A segmented database is collected one segment
+* at a time, the requests going on between two segments.
+*
+* @param arg Unused
+*/
+static void* gc_thread(void* arg)
+{
+    (void)arg;
+    int check = 0;
+    if(is_segmented(&db_file)) {
+        //Only the segments with enough garbage, each blocking the requests
+        uint32_t min_dead = gc_threshold != 0 ? gc_threshold : SEGMENT_GC_MIN;
+        int collected = 1;
+        while(check == 0 && collected) {
+            pthread_rwlock_wrlock(&db_lock);
+            check = segment_gc(&db_file, min_dead, &collected);
+            pthread_rwlock_unlock(&db_lock);
+        }
+    } else {
+        struct online_gc gc;
+        pthread_rwlock_wrlock(&db_lock);
+        check = gc_begin(&db_file, gc_name, &gc);
+        pthread_rwlock_unlock(&db_lock);
+
+        if(check == 0) {
+            //The requests go on meanwhile
+            check = gc_copy(&gc);
+            pthread_rwlock_wrlock(&db_lock);
+            if(check == 0) {
+                check = gc_finish(&db_file, db_name, &gc);
+            } else {
+                gc_abort(&db_file, &gc);
+            }
+            pthread_rwlock_unlock(&db_lock);
+        }
+    }
+    if(check != 0) {
+        fprintf(stderr, "gc: %s\n", ERROR_MESSAGES[check]);
+    }
+
+    pthread_mutex_lock(&gc_lock);
+    gc_running = 0;
+    pthread_cond_broadcast(&gc_done);
+    pthread_mutex_unlock(&gc_lock);
+    return NULL;
+}
+
+/**
+* @brief Start a garbage collection, unless one is already running.
+*
+* @return 0 or an error code
+*/
+static int start_gc(void)
+{
+    int check = 0;
+    pthread_mutex_lock(&gc_lock);
+    if(!gc_running) {
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if(pthread_create(&thread, &attr, gc_thread, NULL) == 0) {
+            gc_running = 1;
+        } else {
+            check = ERR_IO;
+        }
+        pthread_attr_destroy(&attr);
+    }
+    pthread_mutex_unlock(&gc_lock);
+    return check;
+}
+
+/**
+* @brief Wait until the running garbage collection, if any, is done.
+*/
+static void wait_gc(void)
+{
+    pthread_mutex_lock(&gc_lock);
+    while(gc_running) {
+        pthread_cond_wait(&gc_done, &gc_lock);
+    }
+    pthread_mutex_unlock(&gc_lock);
 }
 
 /**
@@ -80,142 +577,526 @@ static void mg_error(struct mg_connection* nc, int error)
 static void split (char* result[], char* tmp, const char* src, const char* delim, size_t len)
 {
     strncpy(tmp, src, len);
-    result[0] = strtok(tmp, delim);
+    char* saveptr = NULL;
+    result[0] = strtok_r(tmp, delim, &saveptr);
     for(size_t i = 1; i < MAX_QUERY_PARAM; i++) {
-        result[i] = strtok(NULL, delim);
+        result[i] = strtok_r(NULL, delim, &saveptr);
     }
 }
 
 /**
-* @brief Funtion that handles list calls. Called by the event handler.
+* @brief Funtion that handles list calls.
 *
-* @param nc A pointer to a mongoose connection
+* @param job The job
 */
-static void handle_list_call(struct mg_connection *nc)
+static void handle_list_call(struct job* job)
 {
+    pthread_rwlock_rdlock(&db_lock);
     const char* JSON_list = do_list(&db_file, JSON);
-    mg_printf(nc, "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n\r\n%s", strlen(JSON_list), JSON_list);
+    pthread_rwlock_unlock(&db_lock);
+    reply_ok(&job->reply, "application/json", JSON_list, strlen(JSON_list));
     do_free((char*)JSON_list);
 }
 
 /**
-* @brief Function that handles read call. Called by the event handler.
+* @brief Funtion that handles stats calls.
+*
+* @param job The job
+*/
+static void handle_stats_call(struct job* job)
+{
+    char stats[384];
+    pthread_rwlock_rdlock(&db_lock);
+    int len = snprintf(stats, sizeof(stats),
+                       "{\"num_files\":%" PRIu32 ",\"max_files\":%" PRIu32
+                       ",\"dedup_hits\":%" PRIu64 ",\"dedup_misses\":%" PRIu64
+                       ",\"dedup_saved_bytes\":%" PRIu64
+                       ",\"live_bytes\":%" PRIu64 ",\"dead_bytes\":%" PRIu64 "}",
+                       db_file.header.num_files, db_file.header.max_files,
+                       db_file.dedup.hits, db_file.dedup.misses, db_file.dedup.saved_bytes,
+                       live_bytes(&db_file), db_file.header.dead_bytes);
+    pthread_rwlock_unlock(&db_lock);
+    reply_ok(&job->reply, "application/json", stats, len);
+}
+
+/**
+* @brief Function that handles read call. Reads of existing images share the
+* lock; a missing resolution is first created by a resizer thread.
+*
+* @param job The job
+*/
+static void handle_read_call(struct job* job)
+{
+    char* data = NULL;
+    uint32_t pict_size = 0;
+
+    pthread_rwlock_rdlock(&db_lock);
+    if(read_needs_resize(job->pict_id, job->resolution, &db_file)) {
+        uint32_t slot = index_find_id(&db_file, job->pict_id);
+        pthread_rwlock_unlock(&db_lock);
+
+        //Without workers we are in the event loop: do not wait
+        struct resize_flight* flight = request_resize(slot, job->resolution, job->pict_id, nb_workers > 0);
+        if(flight == NULL) {
+            reply_error(&job->reply, ERR_OUT_OF_MEMORY);
+            return;
+        }
+        if(nb_workers == 0) {
+            reply_retry_later(&job->reply);
+            return;
+        }
+        int check = wait_resize(flight);
+        if(check != 0) {
+            reply_error(&job->reply, check);
+            return;
+        }
+
+        pthread_rwlock_rdlock(&db_lock);
+        //The image may have been replaced in the meantime
+        if(read_needs_resize(job->pict_id, job->resolution, &db_file)) {
+            pthread_rwlock_unlock(&db_lock);
+            pthread_rwlock_wrlock(&db_lock);
+        }
+    }
+    int check = do_read(job->pict_id, job->resolution, &data, &pict_size, &db_file);
+    pthread_rwlock_unlock(&db_lock);
+
+    if(check != 0) {
+        reply_error(&job->reply, check);
+    } else {
+        reply_ok(&job->reply, "image/jpeg", data, pict_size);
+    }
+    free_data(&data);
+}
+
+/**
+* @brief Function that handles insertion. With the VARIANTS_BACKGROUND
+* policy, the resized images are requested from the resizers right away.
+*
+* @param job The job
+*/
+static void handle_insert_call(struct job* job)
+{
+    pthread_rwlock_wrlock(&db_lock);
+    //A compact table can be full with free slots, its pages lacking room for the id
+    int check = do_insert(job->img, job->size, job->pict_id, &db_file);
+    if(check == ERR_FULL_DATABASE && grow_when_full(&db_file) == 0) {
+        check = do_insert(job->img, job->size, job->pict_id, &db_file);
+    }
+    uint32_t slot = index_find_id(&db_file, job->pict_id);
+    int background = variants_policy(&db_file.header) == VARIANTS_BACKGROUND;
+    pthread_rwlock_unlock(&db_lock);
+    if(check == 0 && background && slot != INDEX_NOT_FOUND) {
+        //The resizers create both resolutions in one pass
+        (void)request_resize(slot, RES_THUMB, job->pict_id, 0);
+    }
+    if(check != 0) {
+        reply_error(&job->reply, check);
+    } else {
+        reply_redirect(job);
+    }
+}
+
+/**
+* @brief Function that handles deletion. A garbage collection is started
+* once the dead bytes reach the threshold.
+*
+* @param job The job
+*/
+static void handle_delete_call(struct job* job)
+{
+    pthread_rwlock_wrlock(&db_lock);
+    int check = do_delete(job->pict_id, &db_file);
+    uint64_t dead = db_file.header.dead_bytes;
+    uint64_t total = dead + live_bytes(&db_file);
+    pthread_rwlock_unlock(&db_lock);
+    if(check == 0 && gc_threshold != 0 && dead > 0 && dead * 100 >= gc_threshold * total) {
+        (void)start_gc();
+    }
+    if(check != 0) {
+        reply_error(&job->reply, check);
+    } else {
+        reply_redirect(job);
+    }
+}
+
+/**
+* @brief Function that handles garbage collection: it runs in the background.
+*
+* @param job The job
+*/
+static void handle_gc_call(struct job* job)
+{
+    int check = start_gc();
+    if(check != 0) {
+        reply_error(&job->reply, check);
+    } else {
+        const char head[] = "HTTP/1.1 202 Accepted\r\nContent-Length: 0\r\n\r\n";
+        mbuf_append(&job->reply, head, strlen(head));
+    }
+}
+
+/**
+* @brief Run a job and fill its reply.
+*
+* @param job The job
+*/
+static void run_job(struct job* job)
+{
+    switch(job->type) {
+    case JOB_LIST:
+        handle_list_call(job);
+        break;
+    case JOB_READ:
+        handle_read_call(job);
+        break;
+    case JOB_INSERT:
+        handle_insert_call(job);
+        break;
+    case JOB_DELETE:
+        handle_delete_call(job);
+        break;
+    case JOB_STATS:
+        handle_stats_call(job);
+        break;
+    case JOB_GC:
+        handle_gc_call(job);
+        break;
+    }
+}
+
+/**
+* @brief Send the reply of a job on its connection.
 *
 * @param nc A pointer to a mongoose connection
 *
+* @param job The job
+*/
+static void send_reply(struct mg_connection* nc, struct job* job)
+{
+    mg_send(nc, job->reply.buf, (int)job->reply.len);
+    if(job->close_after) {
+        nc->flags |= MG_F_SEND_AND_CLOSE;
+    }
+}
+
+/**
+* @brief Called in the mongoose thread when a worker wakes it up; the replies
+* themselves are sent by send_done_jobs.
+*/
+static void wake_up(struct mg_connection* nc, int ev, void* ev_data)
+{
+    (void)nc;
+    (void)ev;
+    (void)ev_data;
+}
+
+/**
+* @brief Worker thread: runs the queued jobs.
+*
+* @param arg Unused
+*/
+static void* worker_thread(void* arg)
+{
+    (void)arg;
+    struct job* job;
+    while((job = queue_pop(&todo_jobs, 1)) != NULL) {
+        run_job(job);
+        queue_push(&done_jobs, job);
+        mg_broadcast(&mgr, wake_up, "", 1);
+    }
+    pthread_mutex_lock(&todo_jobs.lock);
+    workers_running--;
+    pthread_mutex_unlock(&todo_jobs.lock);
+    return NULL;
+}
+
+/**
+* @brief Free the requests waiting on a connection.
+*
+* @param conn A pointer to the connection state
+*/
+static void drop_waiting(struct connection* conn)
+{
+    while(conn->head != NULL) {
+        struct waiting_request* request = conn->head;
+        conn->head = request->next;
+        mbuf_free(&request->message);
+        free(request);
+    }
+    conn->tail = NULL;
+}
+
+/**
+* @brief Send the replies of the jobs done by the workers. The reply is
+* dropped if its connection has been closed in the meantime.
+*/
+static void send_done_jobs(void)
+{
+    struct job* job;
+    while((job = queue_pop(&done_jobs, 0)) != NULL) {
+        struct mg_connection* nc;
+        for(nc = mg_next(&mgr, NULL); nc != NULL; nc = mg_next(&mgr, nc)) {
+            struct connection* conn = nc->user_data;
+            if(conn != NULL && conn->id == job->conn_id) {
+                send_reply(nc, job);
+                conn->job_running = 0;
+                if(job->close_after) {
+                    drop_waiting(conn);
+                }
+                break;
+            }
+        }
+        free_job(job);
+    }
+}
+
+/**
+* @brief Get the pict_id and resolution from the query string of a request.
+*
+* @param job The job to fill
+*
 * @param mssg A pointer to a http_message
+*
+* @return 0 or an error code
 */
-static void handle_read_call(struct mg_connection *nc, struct http_message *mssg)
+static int parse_query(struct job* job, struct http_message* mssg)
 {
     char* tmp = calloc(MAX_QUERY_PARAM, MAX_PIC_ID+1);
     if(tmp == NULL) {
-        mg_error(nc, ERR_OUT_OF_MEMORY);
-    } else {
-        const char delim[] = "&=";
-        char* result[MAX_QUERY_PARAM];
-        size_t len = mssg->query_string.len;
-        size_t resolution = -1;
-        char pict_id[MAX_PIC_ID + 1];
-        //Split the query->string
-        split(result, tmp, mssg->query_string.p, delim, len);
-        //We get resolution and pict_id from the query.
-        for(size_t i = 0; i < MAX_QUERY_PARAM; i++) {
-            if(result[i] != NULL && i+1 < MAX_QUERY_PARAM) {
-                if(!strncmp(result[i], "res", strlen("res"))) { //Peut-être factoriser le i+1 < MAX_QUERRY...?
-                    resolution = resolution_atoi(result[i+1]);
-                } else if(!strncmp(result[i], "pict_id", strlen("pict_id"))) {
-                    if(result[i+1] != NULL) {
-                        strncpy(pict_id, result[i+1], MAX_PIC_ID);
-                    }
+        return ERR_OUT_OF_MEMORY;
+    }
+    const char delim[] = "&=";
+    char* result[MAX_QUERY_PARAM];
+    size_t len = mssg->query_string.len;
+    if(len >= MAX_QUERY_PARAM * (MAX_PIC_ID+1)) {
+        len = MAX_QUERY_PARAM * (MAX_PIC_ID+1) - 1;
+    }
+    //Split the query->string
+    split(result, tmp, mssg->query_string.p, delim, len);
+    //We get resolution and pict_id from the query.
+    for(size_t i = 0; i < MAX_QUERY_PARAM; i++) {
+        if(result[i] != NULL && i+1 < MAX_QUERY_PARAM) {
+            if(!strncmp(result[i], "res", strlen("res"))) {
+                job->resolution = resolution_atoi(result[i+1]);
+            } else if(!strncmp(result[i], "pict_id", strlen("pict_id"))) {
+                if(result[i+1] != NULL) {
+                    strncpy(job->pict_id, result[i+1], MAX_PIC_ID);
                 }
             }
         }
+    }
+    do_free(tmp);
+    return 0;
+}
+
+/**
+* @brief Build the job of a database request.
+*
+* @param type Kind of request
+*
+* @param mssg A pointer to a http_message
+*
+* @param job Where the job (or NULL) is stored
+*
+* @return 0 or an error code
+*/
+static int parse_request(enum job_type type, struct http_message* mssg, struct job** job)
+{
+    struct job* new_job = calloc(1, sizeof(struct job));
+    if(new_job == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    new_job->type = type;
+    new_job->resolution = -1;
+    mbuf_init(&new_job->reply, 0);
+
+    int check = 0;
+    if(type == JOB_READ || type == JOB_DELETE) {
+        check = parse_query(new_job, mssg);
         //We check that there were the 2 arguments resolution and pict_id in the querry.
-        if(resolution == -1) {
-            mg_error(nc, ERR_NOT_ENOUGH_ARGUMENTS);
+        if(check == 0 && type == JOB_READ && new_job->resolution == -1) {
+            check = ERR_NOT_ENOUGH_ARGUMENTS;
+        }
+    } else if(type == JOB_INSERT) {
+        char var_name[MAX_PIC_ID+1];
+        const char* img;
+        mg_parse_multipart(mssg->body.p,
+                           mssg->body.len,
+                           var_name, MAX_PIC_ID,
+                           new_job->pict_id, MAX_PIC_ID,
+                           &img, &new_job->size);
+        if(new_job->size == 0) {
+            check = ERR_INVALID_ARGUMENT;
         } else {
-            char* data;
-            uint32_t pict_size = 0;
-            int check = do_read(pict_id, resolution, &data, &pict_size, &db_file);
-            if(check != 0) {
-                mg_error(nc, check);
+            //The request buffer belongs to mongoose: the worker needs its own copy
+            new_job->img = malloc(new_job->size);
+            if(new_job->img == NULL) {
+                check = ERR_OUT_OF_MEMORY;
             } else {
-                mg_printf(nc, "HTTP/1.1 200 OK\r\nContent-Type: image/jpeg\r\nContent-Length: %d\r\n\r\n", pict_size);
-                mg_send(nc, data, (int)pict_size);
+                memcpy(new_job->img, img, new_job->size);
             }
-            free_data(&data);
         }
-        do_free(tmp);
     }
+
+    if(check != 0) {
+        free_job(new_job);
+        return check;
+    }
+    *job = new_job;
+    return 0;
 }
 
 /**
-* @brief Function that handles insertion. Called by the event handler.
+* @brief Function that handles a database request: run it right away or
+* hand it to the workers.
 *
 * @param nc A pointer to a mongoose connection
 *
+* @param type Kind of request
+*
 * @param mssg A pointer to a http_message
 */
-static void handle_insert_call(struct mg_connection *nc, struct http_message *mssg)
+static void dispatch(struct mg_connection* nc, enum job_type type, struct http_message* mssg)
 {
-    char var_name[MAX_PIC_ID+1];
-    char pict_id[MAX_PIC_ID+1];
-    const char* img;
-    size_t size = 0;
-
-    mg_parse_multipart(mssg->body.p,
-                       mssg->body.len,
-                       var_name, MAX_PIC_ID,
-                       pict_id, MAX_PIC_ID,
-                       &img, &size);
-    if(size == 0) {
-        mg_error(nc, ERR_INVALID_ARGUMENT);
+    struct job* job = NULL;
+    int check = parse_request(type, mssg, &job);
+    if(check != 0) {
+        struct mbuf reply;
+        mbuf_init(&reply, 0);
+        reply_error(&reply, check);
+        mg_send(nc, reply.buf, (int)reply.len);
+        mbuf_free(&reply);
+        return;
+    }
+
+    if(nb_workers == 0) {
+        run_job(job);
+        send_reply(nc, job);
+        free_job(job);
     } else {
-        int check = do_insert(img, size, pict_id, &db_file);
-        if(check != 0) {
-            mg_error(nc, check);
-        } else {
-            mg_printf(nc, "HTTP/1.1 302 Found\r\nLocation: http://localhost:%s/index.html\r\n\r\n", s_http_port);
-            nc->flags |= MG_F_SEND_AND_CLOSE;
-        }
+        struct connection* conn = nc->user_data;
+        job->conn_id = conn->id;
+        conn->job_running = 1;
+        queue_push(&todo_jobs, job);
     }
 }
 
 /**
-* @brief Function that handles deletion. Called by the event handler.
+* @brief Function that handles a http request whose turn has come.
 *
 * @param nc A pointer to a mongoose connection
 *
-* @param mssg A pointer to a http_message
+* @param hm A pointer to a http_message
 */
-static void handle_delete_call(struct mg_connection *nc, struct http_message *mssg)
+static void handle_request(struct mg_connection* nc, struct http_message* hm)
 {
-    char* tmp = calloc(MAX_QUERY_PARAM, MAX_PIC_ID+1);
-    if(tmp == NULL) {
-        mg_error(nc, ERR_OUT_OF_MEMORY);
+    if (mg_vcmp(&hm->uri, "/pictDB/list") == 0) {
+        dispatch(nc, JOB_LIST, hm);
+    } else if(mg_vcmp(&hm->uri, "/pictDB/read") == 0) {
+        dispatch(nc, JOB_READ, hm);
+    } else if(mg_vcmp(&hm->uri, "/pictDB/insert") == 0) {
+        dispatch(nc, JOB_INSERT, hm);
+    } else if(mg_vcmp(&hm->uri, "/pictDB/delete") == 0) {
+        dispatch(nc, JOB_DELETE, hm);
+    } else if(mg_vcmp(&hm->uri, "/pictDB/stats") == 0) {
+        dispatch(nc, JOB_STATS, hm);
+    } else if(mg_vcmp(&hm->uri, "/pictDB/gc") == 0) {
+        dispatch(nc, JOB_GC, hm);
     } else {
-        const char delim[] = "&=";
-        char* result[MAX_QUERY_PARAM];
-        size_t len = mssg->query_string.len;
-        char pict_id[MAX_PIC_ID + 1];
-        //Split the query->string
-        split(result, tmp, mssg->query_string.p, delim, len);
-        //We get resolution and pict_id from the query.
-        for(size_t i = 0; i < MAX_QUERY_PARAM; i++) {
-            if(result[i] != NULL && !strncmp(result[i], "pict_id", strlen("pict_id")) && i+1 < MAX_QUERY_PARAM) {
-                if(result[i+1] != NULL) {
-                    strncpy(pict_id, result[i+1], MAX_PIC_ID);
+        mg_serve_http(nc, hm, s_http_server_opts); /* Serve static content */
+        //The file is sent by mongoose as the socket drains
+        struct connection* conn = nc->user_data;
+        conn->sending_file = (nc->proto_data != NULL);
+    }
+}
+
+/**
+* @brief Tell whether a connection must answer a request before the next one.
+*
+* @param nc A pointer to a mongoose connection
+*
+* @param conn A pointer to its state
+*
+* @return 1 if busy, 0 otherwise
+*/
+static int connection_busy(struct mg_connection* nc, struct connection* conn)
+{
+    if(conn->sending_file && nc->proto_data == NULL) {
+        conn->sending_file = 0;
+    }
+    return conn->job_running || conn->sending_file;
+}
+
+/**
+* @brief Keep a copy of a request until its connection is free.
+*
+* @param conn A pointer to the connection state
+*
+* @param hm A pointer to a http_message
+*
+* @return 0 or an error code
+*/
+static int wait_request(struct connection* conn, struct http_message* hm)
+{
+    struct waiting_request* request = malloc(sizeof(struct waiting_request));
+    if(request == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
+    mbuf_init(&request->message, 0);
+    if(mbuf_append(&request->message, hm->message.p, hm->message.len) != hm->message.len) {
+        mbuf_free(&request->message);
+        free(request);
+        return ERR_OUT_OF_MEMORY;
+    }
+    request->next = NULL;
+    if(conn->tail == NULL) {
+        conn->head = request;
+    } else {
+        conn->tail->next = request;
+    }
+    conn->tail = request;
+    return 0;
+}
+
+/**
+* @brief Handle the next requests of the connections which are free again:
+* first the waiting copies, then the requests pipelined behind them that
+* mongoose left in the receive buffer (it parses one per read).
+*/
+static void resume_connections(void)
+{
+    struct mg_connection* nc;
+    for(nc = mg_next(&mgr, NULL); nc != NULL; nc = mg_next(&mgr, nc)) {
+        struct connection* conn = nc->user_data;
+        if(conn == NULL) {
+            continue;
+        }
+        while(!(nc->flags & (MG_F_SEND_AND_CLOSE | MG_F_CLOSE_IMMEDIATELY))
+              && !connection_busy(nc, conn)) {
+            if(conn->head != NULL) {
+                struct waiting_request* request = conn->head;
+                conn->head = request->next;
+                if(conn->head == NULL) {
+                    conn->tail = NULL;
                 }
+                struct http_message hm;
+                if(mg_parse_http(request->message.buf, (int)request->message.len, &hm, 1) > 0) {
+                    handle_request(nc, &hm);
+                }
+                mbuf_free(&request->message);
+                free(request);
+            } else if(nc->recv_mbuf.len > 0 && nc->proto_handler != NULL) {
+                size_t len = nc->recv_mbuf.len;
+                int received = 0;
+                nc->proto_handler(nc, MG_EV_RECV, &received);
+                if(nc->recv_mbuf.len == len) {
+                    break; // the next request is not complete yet
+                }
+            } else {
+                break;
             }
         }
-        int check = do_delete(pict_id, &db_file);
-        if(check != 0) {
-            mg_error(nc, check);
-        } else {
-            mg_printf(nc,"HTTP/1.1 302 Found\r\nLocation: http://localhost:%s/index.html\r\n\r\n", s_http_port);
-            nc->flags |= MG_F_SEND_AND_CLOSE;
-        }
-        do_free(tmp);
     }
 }
 
@@ -229,18 +1110,31 @@ static void handle_delete_call(struct mg_connection *nc, struct http_message *ms
 static void ev_handler(struct mg_connection *nc, int ev, void* ev_data)
 {
     struct http_message *hm = (struct http_message*) ev_data;
+    struct connection* conn = nc->user_data;
     switch (ev) {
     case MG_EV_HTTP_REQUEST:
-        if (mg_vcmp(&hm->uri, "/pictDB/list") == 0) {
-            handle_list_call(nc);
-        } else if(mg_vcmp(&hm->uri, "/pictDB/read") == 0) {
-            handle_read_call(nc, hm);
-        } else if(mg_vcmp(&hm->uri, "/pictDB/insert") == 0) {
-            handle_insert_call(nc, hm);
-        } else if(mg_vcmp(&hm->uri, "/pictDB/delete") == 0) {
-            handle_delete_call(nc, hm);
+        if(conn == NULL) {
+            conn = calloc(1, sizeof(struct connection));
+            if(conn == NULL) {
+                nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+                break;
+            }
+            conn->id = ++last_conn_id;
+            nc->user_data = conn;
+        }
+        if(conn->head != NULL || connection_busy(nc, conn)) {
+            if(wait_request(conn, hm) != 0) {
+                nc->flags |= MG_F_CLOSE_IMMEDIATELY;
+            }
         } else {
-            mg_serve_http(nc, hm, s_http_server_opts); /* Serve static content */
+            handle_request(nc, hm);
+        }
+        break;
+    case MG_EV_CLOSE:
+        if(conn != NULL) {
+            drop_waiting(conn);
+            free(conn);
+            nc->user_data = NULL;
         }
         break;
     default:
@@ -251,20 +1145,96 @@ static void ev_handler(struct mg_connection *nc, int ev, void* ev_data)
 /************************************************************
 * Main
 *************************************************************/
+/**
+* @brief Signal handler: the main loop stops and the database is closed.
+*
+* @param sig The signal
+*/
+static void stop_server(int sig)
+{
+    (void)sig;
+    stop_requested = 1;
+}
+
+/**
+* @brief Get the fsync policy associated with its name.
+*
+* @param name none, batch or always
+*
+* @return The policy, or -1 if the name is unknown
+*/
+static int fsync_policy_atoi(const char* name)
+{
+    if(!strcmp(name, "none")) {
+        return FSYNC_NONE;
+    } else if(!strcmp(name, "batch")) {
+        return FSYNC_BATCH;
+    } else if(!strcmp(name, "always")) {
+        return FSYNC_ALWAYS;
+    }
+    return -1;
+}
+
 int main(int argc, char* argv[])
 {
     if (argc < 2) {
         return ERR_NOT_ENOUGH_ARGUMENTS;
     } else {
 
+        const char* dbfilename = argv[1];
+        if(strlen(dbfilename) > MAX_FILE_NAME) {
+            return ERR_INVALID_FILENAME;
+        }
+        db_name = dbfilename;
+        snprintf(gc_name, sizeof(gc_name), "%s.gc", dbfilename);
+
+        //Options
+        for(int i = 2; i < argc; i += 2) {
+            if(!strcmp(argv[i], "-workers") && i + 1 < argc) {
+                nb_workers = atouint32(argv[i+1]);
+                if(nb_workers > MAX_WORKERS) {
+                    return ERR_INVALID_ARGUMENT;
+                }
+            } else if(!strcmp(argv[i], "-resizers") && i + 1 < argc) {
+                nb_resizers = atouint32(argv[i+1]);
+                if(nb_resizers == 0 || nb_resizers > MAX_WORKERS) {
+                    return ERR_INVALID_ARGUMENT;
+                }
+            } else if(!strcmp(argv[i], "-batch") && i + 1 < argc) {
+                write_batch = atouint32(argv[i+1]);
+                if(write_batch == 0) {
+                    return ERR_INVALID_ARGUMENT;
+                }
+            } else if(!strcmp(argv[i], "-interval") && i + 1 < argc) {
+                write_interval_ms = atouint32(argv[i+1]);
+            } else if(!strcmp(argv[i], "-gc_threshold") && i + 1 < argc) {
+                gc_threshold = atouint32(argv[i+1]);
+                if(gc_threshold > 100) {
+                    return ERR_INVALID_ARGUMENT;
+                }
+            } else if(!strcmp(argv[i], "-fsync") && i + 1 < argc) {
+                fsync_policy = fsync_policy_atoi(argv[i+1]);
+                if(fsync_policy == -1) {
+                    return ERR_INVALID_ARGUMENT;
+                }
+            } else {
+                return ERR_INVALID_ARGUMENT;
+            }
+        }
+
         if (VIPS_INIT(argv[0])) {
             return ERR_VIPS;
         }
 
-        const char* dbfilename = argv[1];
-
         //Open the file in Read and write
-        int check = do_open(dbfilename, "rb+", &db_file);
+        int check = do_open_mmap(dbfilename, "rb+", &db_file);
+        if(check == 0) {
+            //Built now, before several threads look it up
+            check = index_build(&db_file);
+        }
+        if(check == 0) {
+            check = set_write_back(&db_file, write_batch, write_interval_ms, fsync_policy);
+        }
 
         if(check != 0) {
             do_close(&db_file);
@@ -273,7 +1243,6 @@ int main(int argc, char* argv[])
         //Print the header
         print_header(&db_file.header);
 
-        struct mg_mgr mgr;
         struct mg_connection *nc;
 
         mg_mgr_init(&mgr, NULL);
@@ -283,11 +1252,71 @@ int main(int argc, char* argv[])
         s_http_server_opts.dav_document_root = ".";  // Allow access via WebDav
         s_http_server_opts.enable_directory_listing = "yes";
 
-        for (;;) {
+        pthread_t workers[MAX_WORKERS];
+        workers_running = nb_workers;
+        for(size_t i = 0; i < nb_workers; i++) {
+            if(pthread_create(&workers[i], NULL, worker_thread, NULL) != 0) {
+                return ERR_IO;
+            }
+        }
+        pthread_t resizers[MAX_WORKERS];
+        for(size_t i = 0; i < nb_resizers; i++) {
+            if(pthread_create(&resizers[i], NULL, resizer_thread, NULL) != 0) {
+                return ERR_IO;
+            }
+        }
+
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = stop_server;
+        sigaction(SIGINT, &action, NULL);
+        sigaction(SIGTERM, &action, NULL);
+
+        while(!stop_requested) {
             mg_mgr_poll(&mgr, 1000);
+            send_done_jobs();
+            resume_connections();
+            //Changes gathered by the write-back are not kept waiting too long
+            if(write_interval_ms != 0) {
+                pthread_rwlock_wrlock(&db_lock);
+                (void)db_flush_if_due(&db_file);
+                pthread_rwlock_unlock(&db_lock);
+            }
         }
 
         //Shutdown
+        pthread_mutex_lock(&todo_jobs.lock);
+        todo_jobs.closed = 1;
+        pthread_cond_broadcast(&todo_jobs.not_empty);
+        //A worker waits in mg_broadcast until the mongoose thread has read
+        //its wake up: keep polling until they all have left
+        size_t running = nb_workers;
+        while(running > 0) {
+            pthread_mutex_unlock(&todo_jobs.lock);
+            mg_mgr_poll(&mgr, 100);
+            send_done_jobs();
+            pthread_mutex_lock(&todo_jobs.lock);
+            running = workers_running;
+        }
+        pthread_mutex_unlock(&todo_jobs.lock);
+        for(size_t i = 0; i < nb_workers; i++) {
+            pthread_join(workers[i], NULL);
+        }
+        wait_gc();
+        //No one waits for a resize anymore: the running ones are finished,
+        //the pending ones given up (the images are resized on read)
+        pthread_mutex_lock(&flights_lock);
+        resizers_stopped = 1;
+        pthread_cond_broadcast(&flight_pending);
+        pthread_mutex_unlock(&flights_lock);
+        for(size_t i = 0; i < nb_resizers; i++) {
+            pthread_join(resizers[i], NULL);
+        }
+        pthread_mutex_lock(&flights_lock);
+        while(flights != NULL) {
+            remove_flight(flights);
+        }
+        pthread_mutex_unlock(&flights_lock);
         do_close(&db_file);
         mg_mgr_free(&mgr);
 
@@ -295,4 +1324,4 @@ int main(int argc, char* argv[])
 
         return 0;
     }
-}
\ No newline at end of file
+}